@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Benchmarks batch demangling of symbols scattered through a large string
+table, the way they are in a profile: a symbol table's names are picked in
+a random order, with repeats. A second set of lookups draws on only 10000
+names, like the samples of a profile with a few hot functions, which is
+where deduplicating pays off.
+
+  cc -O2 -pthread -o bench bench.c demangle-ghc.c demangle-ghc-parallel.c demangle-ghc-intern.c
+  ./bench [table size in MB, default 100]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "demangle-ghc.h"
+
+static
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift, so that runs are repeatable
+static
+uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static const char *const units[] = {
+  "", "base_", "ghczmprim_", "containerszm0zi6zi7_", "textzm2zi0zi2zmabc123_"
+};
+
+static const char *const modules[] = {
+  "GHCziBase", "DataziMapziInternal", "DataziTextziShow", "Main",
+  "ControlziMonadziStateziStrict", "GHCziListziNonEmpty"
+};
+
+static const char *const binders[] = {
+  "map", "zdwgo", "zdfShowZLz2cUZR", "foldrzq", "zlzgzg", "insertWith",
+  "zdwzdcshowsPrec", "Z3T", "unsafeIndex", "z2219Uop"
+};
+
+static const char *const suffixes[] = {
+  "_info", "_closure", "_con_info", "_slow", "_entry"
+};
+
+#define PICK(array) array[next_random(&state) % (sizeof(array) / sizeof(array[0]))]
+
+typedef int (*batch_fn)(const char *const *, size_t, struct haskell_batch *, const void *);
+
+static
+int run_sequential(const char *const *symbols, size_t count, struct haskell_batch *out, const void *arg) {
+  (void) arg;
+  return haskell_demangle_batch(symbols, NULL, count, out);
+}
+
+static
+int run_parallel(const char *const *symbols, size_t count, struct haskell_batch *out, const void *arg) {
+  return haskell_demangle_batch_parallel(symbols, NULL, count, arg, out);
+}
+
+static
+void bench(const char *name, batch_fn fn, const void *arg, const char *const *symbols, size_t count) {
+  double best = 0;
+  for (int round = 0; round < 3; round++) {
+    struct haskell_batch batch;
+    double start = now();
+    if (fn(symbols, count, &batch, arg)) {
+      fprintf(stderr, "%s: failed\n", name);
+      exit(1);
+    }
+    double elapsed = now() - start;
+    if (round == 0 || elapsed < best) {
+      best = elapsed;
+    }
+    haskell_batch_free(&batch);
+  }
+  printf("%-32s %7.1f ns/symbol\n", name, best * 1e9 / count);
+}
+
+int main(int argc, char **argv) {
+  size_t table_len = (argc > 1 ? strtoul(argv[1], NULL, 10) : 100) << 20;
+  uint64_t state = 0x9e3779b97f4a7c15;
+
+  // The string table: NUL-terminated names, back to back
+  char *table = malloc(table_len + 256);
+  const char **names = NULL;
+  size_t name_count = 0;
+  size_t name_capacity = 0;
+  size_t len = 0;
+  while (table != NULL && len < table_len) {
+    if (name_count == name_capacity) {
+      name_capacity = name_capacity ? name_capacity * 2 : 1 << 16;
+      names = realloc(names, name_capacity * sizeof(char *));
+      if (names == NULL) {
+        break;
+      }
+    }
+    names[name_count++] = &table[len];
+    len += sprintf(
+      &table[len], "%s%s_%s%u%s",
+      PICK(units), PICK(modules), PICK(binders),
+      (unsigned) (next_random(&state) % 1000), PICK(suffixes)
+    ) + 1;
+  }
+  if (table == NULL || names == NULL) {
+    perror("bench");
+    return 1;
+  }
+
+  // As many lookups as there are names, in a random order, so about a
+  // third of them are repeats
+  size_t count = name_count;
+  const char **symbols = malloc(count * sizeof(char *));
+  if (symbols == NULL) {
+    perror("bench");
+    return 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    symbols[i] = names[next_random(&state) % name_count];
+  }
+  const char **hot = malloc(count * sizeof(char *));
+  if (hot == NULL) {
+    perror("bench");
+    return 1;
+  }
+  size_t hot_count = name_count < 10000 ? name_count : 10000;
+  for (size_t i = 0; i < count; i++) {
+    hot[i] = names[next_random(&state) % hot_count];
+  }
+  printf("%zu MB table, %zu symbols\n", len >> 20, count);
+
+  struct haskell_batch_options no_prefetch = haskell_default_batch_options;
+  no_prefetch.prefetch = 0;
+  struct haskell_batch_options address_order = haskell_default_batch_options;
+  address_order.address_order = true;
+  struct haskell_batch_options dedup = haskell_default_batch_options;
+  dedup.dedup = true;
+
+  bench("sequential", run_sequential, NULL, symbols, count);
+  bench("parallel", run_parallel, &no_prefetch, symbols, count);
+  bench("parallel, prefetching", run_parallel, &haskell_default_batch_options, symbols, count);
+  bench("parallel, in address order", run_parallel, &address_order, symbols, count);
+  bench("parallel, deduplicated", run_parallel, &dedup, symbols, count);
+  bench("parallel, 10000 hot names", run_parallel, &haskell_default_batch_options, hot, count);
+  bench("deduplicated, 10000 hot names", run_parallel, &dedup, hot, count);
+
+  free(hot);
+  free(symbols);
+  free(names);
+  free(table);
+  return 0;
+}
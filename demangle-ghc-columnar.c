@@ -0,0 +1,190 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Columnar output file, for loading batch results into analytics engines.
+
+The file is the buffers of a struct haskell_batch, behind a fixed header,
+so it can be mmap'd and used as it is. All integers are little-endian.
+
+  offset  size  field
+       0     8  magic, "GHCDMCOL"
+       8     4  version, 1
+      12     4  offset width in bytes, 8
+      16     8  count
+      24     8  null_count
+      32     8  file offset of the validity bitmap
+      40     8  file offset of the offsets
+      48     8  file offset of the data
+      56     8  data length
+
+Each buffer starts on a 64 byte boundary, as Arrow recommends, and padding
+is zeroed. The buffers are exactly those of an Arrow LargeUtf8 array: the
+validity bitmap is (count + 7) / 8 bytes, least significant bit first, and
+there are count + 1 int64 offsets into the UTF-8 data. Deduplicated
+batches aren't supported.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "demangle-ghc.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Columnar files are written straight from memory, which must be little-endian"
+#endif
+
+#define COLUMNAR_MAGIC "GHCDMCOL"
+#define COLUMNAR_VERSION 1
+#define COLUMNAR_HEADER_SIZE 64
+#define COLUMNAR_ALIGN 64
+
+struct columnar_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t offset_width;
+  uint64_t count;
+  uint64_t null_count;
+  uint64_t validity_offset;
+  uint64_t offsets_offset;
+  uint64_t data_offset;
+  uint64_t data_len;
+};
+
+_Static_assert(sizeof(struct columnar_header) == COLUMNAR_HEADER_SIZE, "header layout");
+
+static
+uint64_t align_up(uint64_t n) {
+  return (n + COLUMNAR_ALIGN - 1) & ~(uint64_t) (COLUMNAR_ALIGN - 1);
+}
+
+// writev until everything's written, or it fails
+static
+int write_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+int
+haskell_batch_write_columnar(const struct haskell_batch *batch, int fd)
+{
+  static const char padding[COLUMNAR_ALIGN] = { 0 };
+  if (batch->indices != NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint64_t validity_len = (batch->count + 7) / 8;
+  uint64_t offsets_len = (batch->count + 1) * sizeof(int64_t);
+
+  struct columnar_header header = {
+    .magic = COLUMNAR_MAGIC,
+    .version = COLUMNAR_VERSION,
+    .offset_width = sizeof(int64_t),
+    .count = batch->count,
+    .null_count = batch->null_count,
+    .validity_offset = COLUMNAR_HEADER_SIZE,
+    .data_len = batch->data_len
+  };
+  header.offsets_offset = align_up(header.validity_offset + validity_len);
+  header.data_offset = align_up(header.offsets_offset + offsets_len);
+  uint64_t file_len = align_up(header.data_offset + batch->data_len);
+
+  // The buffers are written straight from the batch, with only the header
+  // and the padding between them coming from here.
+  struct iovec iov[] = {
+    { &header, sizeof(header) },
+    { batch->validity, validity_len },
+    { (void *) padding, header.offsets_offset - header.validity_offset - validity_len },
+    { batch->offsets, offsets_len },
+    { (void *) padding, header.data_offset - header.offsets_offset - offsets_len },
+    { batch->data, batch->data_len },
+    { (void *) padding, file_len - header.data_offset - batch->data_len },
+  };
+  return write_all(fd, iov, sizeof(iov) / sizeof(iov[0]));
+}
+
+int
+haskell_columnar_open(const char *path, struct haskell_columnar *col)
+{
+  memset(col, 0, sizeof(*col));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < COLUMNAR_HEADER_SIZE) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  const struct columnar_header *header = map;
+  uint64_t size = st.st_size;
+  if (
+    memcmp(header->magic, COLUMNAR_MAGIC, 8) != 0
+    || header->version != COLUMNAR_VERSION
+    || header->offset_width != sizeof(int64_t)
+    // The file's smaller than 2^63, so with count under it, the lengths
+    // can't overflow, and the offsets are checked in a form that can't
+    // either
+    || header->count > size
+    || header->validity_offset > size
+    || (header->count + 7) / 8 > size - header->validity_offset
+    || header->offsets_offset > size
+    || (header->count + 1) * sizeof(int64_t) > size - header->offsets_offset
+    || header->offsets_offset % sizeof(int64_t) != 0
+    || header->data_offset > size
+    || header->data_len > size - header->data_offset
+  ) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  col->map = map;
+  col->map_len = st.st_size;
+  // Cast away const: the mapping is read only, and so are these buffers
+  col->batch = (struct haskell_batch) {
+    .count = header->count,
+    .null_count = header->null_count,
+    .validity = (uint8_t *) map + header->validity_offset,
+    .offsets = (int64_t *) ((char *) map + header->offsets_offset),
+    .data = (char *) map + header->data_offset,
+    .data_len = header->data_len,
+    .entries = header->count
+  };
+  return 0;
+}
+
+void
+haskell_columnar_close(struct haskell_columnar *col)
+{
+  if (col->map != NULL) {
+    munmap(col->map, col->map_len);
+  }
+  memset(col, 0, sizeof(*col));
+}
@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Dictionary-encoded output.
+
+The stream is a sequence of unsigned LEB128 varints. A zero introduces a
+new name: its length in bytes, as a varint, followed by its UTF-8 bytes.
+New names are numbered from zero, in the order they appear. Any other value
+n stands for the name numbered n - 1.
+
+Repeated symbols are recognised by their mangled form, so each is only
+demangled once. Symbols that don't demangle aren't numbered.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "demangle-ghc.h"
+
+struct haskell_dict_encoder {
+  struct haskell_intern *symbols;
+};
+
+struct haskell_dict_encoder *
+haskell_dict_encoder_new(void)
+{
+  struct haskell_dict_encoder *enc = malloc(sizeof(struct haskell_dict_encoder));
+  if (enc == NULL) {
+    return NULL;
+  }
+  enc->symbols = haskell_intern_new();
+  if (enc->symbols == NULL) {
+    free(enc);
+    return NULL;
+  }
+  return enc;
+}
+
+void
+haskell_dict_encoder_free(struct haskell_dict_encoder *enc)
+{
+  if (enc == NULL) {
+    return;
+  }
+  haskell_intern_free(enc->symbols);
+  free(enc);
+}
+
+static
+int put_varint(uint64_t n, FILE *out) {
+  unsigned char bytes[10];
+  size_t len = 0;
+  do {
+    bytes[len] = n & 0x7F;
+    n >>= 7;
+    if (n != 0) {
+      bytes[len] |= 0x80;
+    }
+    len++;
+  } while (n != 0);
+  return fwrite(bytes, 1, len, out) == len ? 0 : -1;
+}
+
+// Returns 1 at the end of the input, -1 on a truncated or overlong varint
+static
+int get_varint(FILE *in, uint64_t *n) {
+  *n = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(in);
+    if (c == EOF) {
+      return shift == 0 ? 1 : -1;
+    }
+    *n |= (uint64_t) (c & 0x7F) << shift;
+    if ((c & 0x80) == 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int
+haskell_dict_encode(struct haskell_dict_encoder *enc, const char *mangled, size_t len, FILE *out)
+{
+  uint32_t id;
+  if (haskell_intern_find(enc->symbols, mangled, len, &id)) {
+    return put_varint((uint64_t) id + 1, out);
+  }
+  // Only numbered once it's known to demangle, so that a failure leaves
+  // the stream as it was
+  char *demangled = haskell_demangle_n(mangled, len);
+  if (demangled == NULL) {
+    return -1;
+  }
+  bool added;
+  if (haskell_intern_add(enc->symbols, mangled, len, &added) == HASKELL_INTERN_ERROR) {
+    free(demangled);
+    return -1;
+  }
+  size_t demangled_len = strlen(demangled);
+  int res = put_varint(0, out);
+  if (res == 0) {
+    res = put_varint(demangled_len, out);
+  }
+  if (res == 0 && fwrite(demangled, 1, demangled_len, out) != demangled_len) {
+    res = -1;
+  }
+  free(demangled);
+  return res;
+}
+
+int
+haskell_dict_decode(FILE *in, FILE *out)
+{
+  size_t count = 0;
+  size_t capacity = 256;
+  char **names = malloc(capacity * sizeof(char *));
+  size_t *lens = malloc(capacity * sizeof(size_t));
+  int res = names == NULL || lens == NULL ? -1 : 0;
+
+  while (res == 0) {
+    uint64_t n;
+    res = get_varint(in, &n);
+    if (res != 0) {
+      break;
+    }
+    if (n > 0) {
+      if (n > count) {
+        res = -1;
+        break;
+      }
+      fwrite(names[n - 1], 1, lens[n - 1], out);
+      putc('\n', out);
+      continue;
+    }
+
+    uint64_t len;
+    if (get_varint(in, &len) != 0 || len > SIZE_MAX - 1) {
+      res = -1;
+      break;
+    }
+    if (count == capacity) {
+      capacity *= 2;
+      char **new_names = realloc(names, capacity * sizeof(char *));
+      if (new_names != NULL) {
+        names = new_names;
+      }
+      size_t *new_lens = realloc(lens, capacity * sizeof(size_t));
+      if (new_lens != NULL) {
+        lens = new_lens;
+      }
+      if (new_names == NULL || new_lens == NULL) {
+        res = -1;
+        break;
+      }
+    }
+    char *name = malloc(len + 1);
+    if (name == NULL || fread(name, 1, len, in) != len) {
+      free(name);
+      res = -1;
+      break;
+    }
+    names[count] = name;
+    lens[count] = len;
+    count++;
+    fwrite(name, 1, len, out);
+    putc('\n', out);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    free(names[i]);
+  }
+  free(names);
+  free(lens);
+  if (ferror(out)) {
+    return -1;
+  }
+  // Running out of input between records is the normal way to stop
+  return res == 1 ? 0 : -1;
+}
@@ -0,0 +1,636 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Symbol table diff between two builds.
+
+Each file's ELF symbol table (.symtab, or .dynsym if it's stripped) is
+read in place from an mmap. Every defined symbol's name is demangled, and
+so is its module, the part of the name up to the end of its module
+component, in parallel batches, the modules deduplicated. The unit and
+module are told apart as haskell_demangle_binder does, so a capitalised
+package's unit ("QuickCheckzm2zi14zi3zmAbC") isn't taken for a module.
+
+Names can be normalized first, in their mangled form, where a literal '_'
+always separates components:
+
+  - A unit ID's hash, or other trailing tag, is dropped from the component
+    before the module, when it follows a version: "textzm2zi0zmAbC12"
+    becomes "textzm2zi0", but "ghczmprim" stays as it is.
+  - Uniques are dropped from local binders: a component past the binder's
+    first that is a lower case letter, then letters and digits, with at
+    least one digit, such as the "r2Lx" in "Main_zdwgo_r2Lx_info".
+
+The two tables are then joined on a hash of the demangled name. Each
+thread owns a share of the hash space: it builds an open-addressing table
+of the old symbols in its share, probes it with the new ones, and reports
+what's only on one side, or whose size changed. Symbols with the same
+name on one side, such as local symbols from different objects, are
+compared by their total size.
+*/
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "demangle-ghc-internal.h"
+
+const struct haskell_symbol_diff_options haskell_default_symbol_diff_options = {
+  .threads = 0,
+  .normalize = true
+};
+
+struct diff_side {
+  const uint8_t *file;
+  size_t file_len;
+  size_t count;
+  // Mangled, and normalized into `arena` if asked
+  const char **mangled;
+  size_t *lens;
+  size_t *module_lens;
+  uint64_t *sizes;
+  char *arena;
+  struct haskell_batch names;
+  struct haskell_batch modules;
+  uint64_t *hashes;
+};
+
+struct haskell_symbol_diff_state {
+  struct diff_side sides[2];
+};
+
+/*
+Reading
+*/
+
+static
+bool elf_range(size_t file_len, uint64_t offset, uint64_t len) {
+  return offset <= file_len && len <= file_len - offset;
+}
+
+// Collects the defined symbols
+// true signals an error
+static
+bool read_symbols(const char *path, struct diff_side *side) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return true;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Elf64_Ehdr)) {
+    close(fd);
+    return true;
+  }
+  side->file_len = st.st_size;
+  void *map = mmap(NULL, side->file_len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return true;
+  }
+  side->file = map;
+
+  const uint8_t *file = side->file;
+  size_t file_len = side->file_len;
+  const Elf64_Ehdr *ehdr = map;
+  if (
+    memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+    || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+    || ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+    || ehdr->e_shentsize != sizeof(Elf64_Shdr)
+    || !elf_range(file_len, ehdr->e_shoff, (uint64_t) ehdr->e_shnum * sizeof(Elf64_Shdr))
+  ) {
+    return true;
+  }
+  const Elf64_Shdr *shdrs = (const Elf64_Shdr *) (file + ehdr->e_shoff);
+  const Elf64_Shdr *symtab = NULL;
+  for (size_t i = 0; i < ehdr->e_shnum; i++) {
+    if (shdrs[i].sh_type == SHT_SYMTAB || (shdrs[i].sh_type == SHT_DYNSYM && symtab == NULL)) {
+      symtab = &shdrs[i];
+    }
+  }
+  if (
+    symtab == NULL
+    || symtab->sh_link >= ehdr->e_shnum
+    || !elf_range(file_len, symtab->sh_offset, symtab->sh_size)
+    || !elf_range(file_len, shdrs[symtab->sh_link].sh_offset, shdrs[symtab->sh_link].sh_size)
+  ) {
+    return true;
+  }
+  const Elf64_Sym *syms = (const Elf64_Sym *) (file + symtab->sh_offset);
+  size_t sym_count = symtab->sh_size / sizeof(Elf64_Sym);
+  const char *strtab = (const char *) file + shdrs[symtab->sh_link].sh_offset;
+  size_t strtab_len = shdrs[symtab->sh_link].sh_size;
+
+  side->mangled = malloc((sym_count + 1) * sizeof(char *));
+  side->lens = malloc((sym_count + 1) * sizeof(size_t));
+  side->module_lens = malloc((sym_count + 1) * sizeof(size_t));
+  side->sizes = malloc((sym_count + 1) * sizeof(uint64_t));
+  if (side->mangled == NULL || side->lens == NULL || side->module_lens == NULL || side->sizes == NULL) {
+    return true;
+  }
+  for (size_t i = 0; i < sym_count; i++) {
+    const Elf64_Sym *sym = &syms[i];
+    unsigned type = ELF64_ST_TYPE(sym->st_info);
+    if (
+      sym->st_shndx == SHN_UNDEF
+      || type == STT_SECTION
+      || type == STT_FILE
+      || sym->st_name >= strtab_len
+    ) {
+      continue;
+    }
+    const char *name = &strtab[sym->st_name];
+    const char *nul = memchr(name, '\0', strtab_len - sym->st_name);
+    if (nul == NULL || nul == name) {
+      continue;
+    }
+    side->mangled[side->count] = name;
+    side->lens[side->count] = nul - name;
+    side->sizes[side->count] = sym->st_size;
+    side->count++;
+  }
+  return false;
+}
+
+/*
+Normalizing
+*/
+
+// Splits a mangled name at its literal '_'s, up to `max` components
+static
+size_t components(const char *name, size_t len, size_t *starts, size_t *ends, size_t max) {
+  size_t n = 0;
+  size_t start = 0;
+  for (size_t i = 0; i <= len && n < max; i++) {
+    if (i == len || name[i] == '_') {
+      starts[n] = start;
+      ends[n] = i;
+      n++;
+      start = i + 1;
+    }
+  }
+  return n;
+}
+
+// A version, mangled: digits and "zi"s
+static
+bool is_version(const char *s, size_t len) {
+  if (len == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (s[i] >= '0' && s[i] <= '9') {
+      continue;
+    }
+    if (s[i] == 'z' && i + 1 < len && s[i + 1] == 'i') {
+      i++;
+      continue;
+    }
+    return false;
+  }
+  return true;
+}
+
+// Where a unit ID's trailing tag starts, or `len` if it has none
+static
+size_t unit_tag(const char *s, size_t len) {
+  // The last two '-'s, which are "zm" at the start of an escape
+  size_t last = len;
+  size_t before = len;
+  for (size_t i = 0; i + 1 < len; i++) {
+    if (s[i] != 'z' && s[i] != 'Z') {
+      continue;
+    }
+    if (s[i] == 'z' && s[i + 1] == 'm') {
+      before = last;
+      last = i;
+    }
+    // Skip the escape's second character; a "zNNNU" escape's digits
+    // and 'U' can't be mistaken for one
+    i++;
+  }
+  if (last == len || before == len || is_version(&s[last + 2], len - last - 2)) {
+    return len;
+  }
+  return is_version(&s[before + 2], last - before - 2) ? last : len;
+}
+
+// Too many components to be a GHC symbol past this, so it's left alone
+#define MAX_COMPONENTS 32
+
+// Writes the normalized name to `out`, which has room for the original,
+// and returns its length. Sets `module_len` to the length of its module
+// prefix, or zero if it has no module.
+static
+size_t normalize(const char *name, size_t len, bool strip, char *out, size_t *module_len) {
+  size_t starts[MAX_COMPONENTS];
+  size_t ends[MAX_COMPONENTS];
+  size_t n = components(name, len, starts, ends, MAX_COMPONENTS);
+  struct haskell_name_parts parts;
+  if (ends[n - 1] != len || !haskell_split_name(name, len, &parts)) {
+    // Too many components to say, or no module
+    memcpy(out, name, len);
+    *module_len = 0;
+    return len;
+  }
+  size_t module = parts.unit_len > 0 ? 1 : 0;
+
+  size_t written = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t end = ends[i];
+    if (strip && i + 1 == module) {
+      end = starts[i] + unit_tag(&name[starts[i]], ends[i] - starts[i]);
+    }
+    if (strip && i >= module + 2 && haskell_is_unique(&name[starts[i]], ends[i] - starts[i])) {
+      continue;
+    }
+    if (written > 0) {
+      out[written++] = '_';
+    }
+    memcpy(&out[written], &name[starts[i]], end - starts[i]);
+    written += end - starts[i];
+    if (i == module) {
+      *module_len = written;
+    }
+  }
+  return written;
+}
+
+struct prepare_job {
+  struct diff_side *side;
+  bool normalize;
+  size_t start;
+  size_t end;
+  // Where this share's names go in the arena
+  size_t arena_start;
+};
+
+// Normalizes this share's names, and finds their modules
+static
+void *prepare_symbols(void *arg) {
+  struct prepare_job *job = arg;
+  struct diff_side *side = job->side;
+  char *out = side->arena + job->arena_start;
+  for (size_t i = job->start; i < job->end; i++) {
+    size_t len = normalize(side->mangled[i], side->lens[i], job->normalize, out, &side->module_lens[i]);
+    side->mangled[i] = out;
+    side->lens[i] = len;
+    out += len;
+  }
+  return NULL;
+}
+
+static
+uint64_t name_hash(const char *str, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) str[i]) * 0x100000001b3;
+  }
+  hash ^= hash >> 32;
+  hash *= 0xd6e8feb86659fd93;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+// The demangled name, or the mangled one if it doesn't demangle
+static
+const char *side_name(const struct diff_side *side, size_t i, size_t *len) {
+  const char *name = haskell_batch_get(&side->names, i, len);
+  if (name == NULL) {
+    *len = side->lens[i];
+    return side->mangled[i];
+  }
+  return name;
+}
+
+static
+const char *side_module(const struct diff_side *side, size_t i, size_t *len) {
+  const char *module = haskell_batch_get(&side->modules, i, len);
+  if (module == NULL) {
+    *len = side->module_lens[i];
+    return side->mangled[i];
+  }
+  return module;
+}
+
+struct hash_job {
+  struct diff_side *side;
+  size_t start;
+  size_t end;
+};
+
+static
+void *hash_symbols(void *arg) {
+  struct hash_job *job = arg;
+  for (size_t i = job->start; i < job->end; i++) {
+    size_t len;
+    const char *name = side_name(job->side, i, &len);
+    job->side->hashes[i] = name_hash(name, len);
+  }
+  return NULL;
+}
+
+// true signals an error
+static
+bool prepare_side(struct diff_side *side, const struct haskell_symbol_diff_options *options, size_t shares) {
+  size_t arena_len = 0;
+  for (size_t i = 0; i < side->count; i++) {
+    arena_len += side->lens[i];
+  }
+  side->arena = malloc(arena_len + 1);
+  struct prepare_job *prepare = calloc(shares, sizeof(struct prepare_job));
+  struct hash_job *hash = calloc(shares, sizeof(struct hash_job));
+  side->hashes = malloc((side->count + 1) * sizeof(uint64_t));
+  bool error = true;
+  if (side->arena == NULL || prepare == NULL || hash == NULL || side->hashes == NULL) {
+    goto done;
+  }
+  size_t arena_start = 0;
+  size_t i = 0;
+  for (size_t s = 0; s < shares; s++) {
+    size_t end = side->count * (s + 1) / shares;
+    prepare[s] = (struct prepare_job) { side, options->normalize, i, end, arena_start };
+    hash[s] = (struct hash_job) { side, i, end };
+    for (; i < end; i++) {
+      arena_start += side->lens[i];
+    }
+  }
+  if (haskell_run_jobs(prepare_symbols, prepare, sizeof(struct prepare_job), shares)) {
+    goto done;
+  }
+
+  struct haskell_batch_options batch_options = haskell_default_batch_options;
+  batch_options.threads = options->threads;
+  if (haskell_demangle_batch_parallel(side->mangled, side->lens, side->count, &batch_options, &side->names)) {
+    goto done;
+  }
+  batch_options.dedup = true;
+  if (haskell_demangle_batch_parallel(side->mangled, side->module_lens, side->count, &batch_options, &side->modules)) {
+    goto done;
+  }
+  if (haskell_run_jobs(hash_symbols, hash, sizeof(struct hash_job), shares)) {
+    goto done;
+  }
+  error = false;
+
+done:
+  free(prepare);
+  free(hash);
+  return error;
+}
+
+/*
+Joining
+*/
+
+struct join_slot {
+  uint64_t hash;
+  // The first old and new symbols with the name, or SIZE_MAX
+  size_t old_index;
+  size_t new_index;
+  uint64_t old_size;
+  uint64_t new_size;
+};
+
+struct join_job {
+  const struct diff_side *old_side;
+  const struct diff_side *new_side;
+  // This job owns the hashes h with h % shares == share
+  size_t share;
+  size_t shares;
+  struct haskell_symbol_change *changes;
+  size_t count;
+  int error;
+};
+
+static
+bool same_name(const struct diff_side *a, size_t i, const struct diff_side *b, size_t j) {
+  size_t a_len, b_len;
+  const char *a_name = side_name(a, i, &a_len);
+  const char *b_name = side_name(b, j, &b_len);
+  return a_len == b_len && memcmp(a_name, b_name, a_len) == 0;
+}
+
+// The slot holding the name, or the empty slot it belongs in
+static
+struct join_slot *find_slot(
+  struct join_slot *slots,
+  size_t mask,
+  const struct diff_side *side,
+  size_t i,
+  const struct join_job *job
+) {
+  uint64_t hash = side->hashes[i];
+  for (size_t s = (hash / job->shares) & mask; ; s = (s + 1) & mask) {
+    struct join_slot *slot = &slots[s];
+    if (slot->old_index == SIZE_MAX && slot->new_index == SIZE_MAX) {
+      return slot;
+    }
+    if (slot->hash != hash) {
+      continue;
+    }
+    if (slot->old_index != SIZE_MAX && same_name(job->old_side, slot->old_index, side, i)) {
+      return slot;
+    }
+    if (slot->new_index != SIZE_MAX && same_name(job->new_side, slot->new_index, side, i)) {
+      return slot;
+    }
+  }
+}
+
+static
+void *join_share(void *arg) {
+  struct join_job *job = arg;
+  const struct diff_side *sides[2] = { job->old_side, job->new_side };
+  size_t mine = 0;
+  for (size_t side = 0; side < 2; side++) {
+    for (size_t i = 0; i < sides[side]->count; i++) {
+      mine += sides[side]->hashes[i] % job->shares == job->share;
+    }
+  }
+  size_t capacity = 16;
+  while (capacity < mine * 2) {
+    capacity *= 2;
+  }
+  struct join_slot *slots = malloc(capacity * sizeof(struct join_slot));
+  if (slots == NULL) {
+    job->error = -1;
+    return NULL;
+  }
+  for (size_t s = 0; s < capacity; s++) {
+    slots[s] = (struct join_slot) { .old_index = SIZE_MAX, .new_index = SIZE_MAX };
+  }
+
+  for (size_t side = 0; side < 2; side++) {
+    const struct diff_side *d = sides[side];
+    for (size_t i = 0; i < d->count; i++) {
+      if (d->hashes[i] % job->shares != job->share) {
+        continue;
+      }
+      struct join_slot *slot = find_slot(slots, capacity - 1, d, i, job);
+      slot->hash = d->hashes[i];
+      if (side == 0) {
+        if (slot->old_index == SIZE_MAX) {
+          slot->old_index = i;
+        }
+        slot->old_size += d->sizes[i];
+      } else {
+        if (slot->new_index == SIZE_MAX) {
+          slot->new_index = i;
+        }
+        slot->new_size += d->sizes[i];
+      }
+    }
+  }
+
+  size_t changes = 0;
+  for (size_t s = 0; s < capacity; s++) {
+    struct join_slot *slot = &slots[s];
+    changes += slot->old_index == SIZE_MAX || slot->new_index == SIZE_MAX ? slot->old_index != slot->new_index : slot->old_size != slot->new_size;
+  }
+  job->changes = malloc((changes + 1) * sizeof(struct haskell_symbol_change));
+  if (job->changes == NULL) {
+    free(slots);
+    job->error = -1;
+    return NULL;
+  }
+  for (size_t s = 0; s < capacity; s++) {
+    struct join_slot *slot = &slots[s];
+    if (slot->old_index == SIZE_MAX && slot->new_index == SIZE_MAX) {
+      continue;
+    }
+    struct haskell_symbol_change change = { .old_size = slot->old_size, .new_size = slot->new_size };
+    const struct diff_side *side = job->new_side;
+    size_t i = slot->new_index;
+    if (slot->new_index == SIZE_MAX) {
+      change.kind = HASKELL_SYMBOL_REMOVED;
+      side = job->old_side;
+      i = slot->old_index;
+    } else if (slot->old_index == SIZE_MAX) {
+      change.kind = HASKELL_SYMBOL_ADDED;
+    } else if (slot->old_size != slot->new_size) {
+      change.kind = HASKELL_SYMBOL_RESIZED;
+    } else {
+      continue;
+    }
+    change.name = side_name(side, i, &change.name_len);
+    change.module = side_module(side, i, &change.module_len);
+    job->changes[job->count++] = change;
+  }
+  free(slots);
+  return NULL;
+}
+
+static
+int change_cmp(const void *a, const void *b) {
+  const struct haskell_symbol_change *x = a;
+  const struct haskell_symbol_change *y = b;
+  size_t len = x->module_len < y->module_len ? x->module_len : y->module_len;
+  int cmp = memcmp(x->module, y->module, len);
+  if (cmp == 0) {
+    cmp = (x->module_len > y->module_len) - (x->module_len < y->module_len);
+  }
+  if (cmp != 0) {
+    return cmp;
+  }
+  len = x->name_len < y->name_len ? x->name_len : y->name_len;
+  cmp = memcmp(x->name, y->name, len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (x->name_len > y->name_len) - (x->name_len < y->name_len);
+}
+
+static
+void free_side(struct diff_side *side) {
+  if (side->file != NULL) {
+    munmap((void *) side->file, side->file_len);
+  }
+  free(side->mangled);
+  free(side->lens);
+  free(side->module_lens);
+  free(side->sizes);
+  free(side->arena);
+  free(side->hashes);
+  haskell_batch_free(&side->names);
+  haskell_batch_free(&side->modules);
+}
+
+int
+haskell_symbol_diff(
+  const char *old_path,
+  const char *new_path,
+  const struct haskell_symbol_diff_options *options,
+  struct haskell_symbol_diff *out
+) {
+  *out = (struct haskell_symbol_diff) { 0 };
+  out->state = calloc(1, sizeof(struct haskell_symbol_diff_state));
+  if (out->state == NULL) {
+    return -1;
+  }
+  struct diff_side *sides = out->state->sides;
+  unsigned threads = haskell_default_threads(options->threads);
+  const char *paths[2] = { old_path, new_path };
+  for (size_t s = 0; s < 2; s++) {
+    if (read_symbols(paths[s], &sides[s])) {
+      goto fail;
+    }
+    // Not worth a thread for fewer than this
+    size_t shares = sides[s].count / 4096;
+    shares = shares > threads ? threads : shares > 0 ? shares : 1;
+    if (prepare_side(&sides[s], options, shares)) {
+      goto fail;
+    }
+  }
+
+  size_t shares = (sides[0].count + sides[1].count) / 4096;
+  shares = shares > threads ? threads : shares > 0 ? shares : 1;
+  struct join_job *jobs = calloc(shares, sizeof(struct join_job));
+  if (jobs == NULL) {
+    goto fail;
+  }
+  for (size_t i = 0; i < shares; i++) {
+    jobs[i] = (struct join_job) { &sides[0], &sides[1], i, shares, NULL, 0, 0 };
+  }
+  int error = haskell_run_jobs(join_share, jobs, sizeof(struct join_job), shares);
+  size_t count = 0;
+  for (size_t i = 0; i < shares; i++) {
+    error |= jobs[i].error;
+    count += jobs[i].count;
+  }
+  out->changes = error ? NULL : malloc((count + 1) * sizeof(struct haskell_symbol_change));
+  if (out->changes != NULL) {
+    for (size_t i = 0; i < shares; i++) {
+      memcpy(&out->changes[out->count], jobs[i].changes, jobs[i].count * sizeof(struct haskell_symbol_change));
+      out->count += jobs[i].count;
+    }
+  }
+  for (size_t i = 0; i < shares; i++) {
+    free(jobs[i].changes);
+  }
+  free(jobs);
+  if (out->changes == NULL) {
+    goto fail;
+  }
+  qsort(out->changes, out->count, sizeof(struct haskell_symbol_change), change_cmp);
+  return 0;
+
+fail:
+  haskell_symbol_diff_free(out);
+  return -1;
+}
+
+void
+haskell_symbol_diff_free(struct haskell_symbol_diff *diff)
+{
+  if (diff->state != NULL) {
+    free_side(&diff->state->sides[0]);
+    free_side(&diff->state->sides[1]);
+    free(diff->state);
+  }
+  free(diff->changes);
+  *diff = (struct haskell_symbol_diff) { 0 };
+}
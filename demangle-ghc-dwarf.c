@@ -0,0 +1,1395 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Function index from DWARF debug info.
+
+GHC's -g output names each procedure's DW_TAG_subprogram after its
+z-encoded label. This reads .debug_info straight from an mmap'd ELF file,
+collects every subprogram with an address range, and demangles all of
+their names in one parallel, deduplicated batch, so lookups never demangle.
+
+A file without .debug_info, such as one built without -g, or stripped of
+its debug info, is indexed from its function symbols instead, in .symtab,
+or else .dynsym, and has no source locations.
+
+Only 64-bit little-endian ELF files are read. DWARF versions 2 to 5 are
+understood, in both the 32 and 64-bit formats, with strings in
+.debug_str, .debug_line_str, or reached through .debug_str_offsets, and
+addresses reached through .debug_addr. Compressed sections, split DWARF,
+and subprograms that only have DW_AT_ranges are not.
+
+Source locations come from .debug_line. Each line program is run, and
+its rows kept in one table sorted by address, holding a row only where the
+file or line changes, and an end row where a sequence stops. File names
+are interned, so a row is sixteen bytes.
+
+Every read is bounds checked, so a malformed file fails to open, rather
+than being read out of bounds.
+*/
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "demangle-ghc.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "DWARF is read straight from memory, which must be little-endian"
+#endif
+
+#define DW_TAG_subprogram 0x2e
+
+#define DW_AT_name 0x03
+#define DW_AT_low_pc 0x11
+#define DW_AT_high_pc 0x12
+#define DW_AT_linkage_name 0x6e
+#define DW_AT_str_offsets_base 0x72
+#define DW_AT_addr_base 0x73
+#define DW_AT_MIPS_linkage_name 0x2007
+
+#define DW_LNS_copy 0x01
+#define DW_LNS_advance_pc 0x02
+#define DW_LNS_advance_line 0x03
+#define DW_LNS_set_file 0x04
+#define DW_LNS_const_add_pc 0x08
+#define DW_LNS_fixed_advance_pc 0x09
+
+#define DW_LNE_end_sequence 0x01
+#define DW_LNE_set_address 0x02
+#define DW_LNE_define_file 0x03
+
+#define DW_LNCT_path 0x01
+
+#define DW_UT_skeleton 0x04
+#define DW_UT_split_compile 0x05
+#define DW_UT_type 0x02
+#define DW_UT_split_type 0x06
+
+enum {
+  DW_FORM_addr = 0x01,
+  DW_FORM_block2 = 0x03,
+  DW_FORM_block4 = 0x04,
+  DW_FORM_data2 = 0x05,
+  DW_FORM_data4 = 0x06,
+  DW_FORM_data8 = 0x07,
+  DW_FORM_string = 0x08,
+  DW_FORM_block = 0x09,
+  DW_FORM_block1 = 0x0a,
+  DW_FORM_data1 = 0x0b,
+  DW_FORM_flag = 0x0c,
+  DW_FORM_sdata = 0x0d,
+  DW_FORM_strp = 0x0e,
+  DW_FORM_udata = 0x0f,
+  DW_FORM_ref_addr = 0x10,
+  DW_FORM_ref1 = 0x11,
+  DW_FORM_ref2 = 0x12,
+  DW_FORM_ref4 = 0x13,
+  DW_FORM_ref8 = 0x14,
+  DW_FORM_ref_udata = 0x15,
+  DW_FORM_indirect = 0x16,
+  DW_FORM_sec_offset = 0x17,
+  DW_FORM_exprloc = 0x18,
+  DW_FORM_flag_present = 0x19,
+  DW_FORM_strx = 0x1a,
+  DW_FORM_addrx = 0x1b,
+  DW_FORM_ref_sup4 = 0x1c,
+  DW_FORM_strp_sup = 0x1d,
+  DW_FORM_data16 = 0x1e,
+  DW_FORM_line_strp = 0x1f,
+  DW_FORM_ref_sig8 = 0x20,
+  DW_FORM_implicit_const = 0x21,
+  DW_FORM_loclistx = 0x22,
+  DW_FORM_rnglistx = 0x23,
+  DW_FORM_ref_sup8 = 0x24,
+  DW_FORM_strx1 = 0x25,
+  DW_FORM_strx2 = 0x26,
+  DW_FORM_strx3 = 0x27,
+  DW_FORM_strx4 = 0x28,
+  DW_FORM_addrx1 = 0x29,
+  DW_FORM_addrx2 = 0x2a,
+  DW_FORM_addrx3 = 0x2b,
+  DW_FORM_addrx4 = 0x2c,
+  DW_FORM_GNU_addr_index = 0x1f01,
+  DW_FORM_GNU_str_index = 0x1f02,
+  DW_FORM_GNU_ref_alt = 0x1f20,
+  DW_FORM_GNU_strp_alt = 0x1f21,
+};
+
+struct section {
+  const uint8_t *data;
+  size_t len;
+};
+
+struct dwarf_sections {
+  struct section info;
+  struct section abbrev;
+  struct section str;
+  struct section line_str;
+  struct section str_offsets;
+  struct section addr;
+  struct section line;
+  // Function symbols, for files without debug info: .symtab, or else
+  // .dynsym, and the string table it links to
+  struct section symtab;
+  struct section symstr;
+  const Elf64_Shdr *shdrs;
+  size_t shnum;
+};
+
+// A cursor over a section. Reading past the end sets `error`, and
+// returns zeros from then on.
+struct reader {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool error;
+};
+
+static
+const uint8_t *read_bytes(struct reader *r, size_t n) {
+  if (r->error || (size_t) (r->end - r->p) < n) {
+    r->error = true;
+    r->p = r->end;
+    return NULL;
+  }
+  const uint8_t *p = r->p;
+  r->p += n;
+  return p;
+}
+
+// Reads an n byte little-endian unsigned integer, for n up to eight
+static
+uint64_t read_uint(struct reader *r, size_t n) {
+  const uint8_t *p = read_bytes(r, n);
+  uint64_t value = 0;
+  if (p != NULL) {
+    memcpy(&value, p, n);
+  }
+  return value;
+}
+
+static
+uint64_t read_uleb(struct reader *r) {
+  uint64_t value = 0;
+  for (unsigned shift = 0; ; shift += 7) {
+    const uint8_t *p = read_bytes(r, 1);
+    if (p == NULL) {
+      return 0;
+    }
+    if (shift < 64) {
+      value |= (uint64_t) (*p & 0x7f) << shift;
+    }
+    if ((*p & 0x80) == 0) {
+      return value;
+    }
+  }
+}
+
+static
+int64_t read_sleb(struct reader *r) {
+  uint64_t value = 0;
+  unsigned shift = 0;
+  const uint8_t *p;
+  do {
+    p = read_bytes(r, 1);
+    if (p == NULL) {
+      return 0;
+    }
+    if (shift < 64) {
+      value |= (uint64_t) (*p & 0x7f) << shift;
+    }
+    shift += 7;
+  } while (*p & 0x80);
+  if (shift < 64 && (*p & 0x40)) {
+    value |= ~(uint64_t) 0 << shift;
+  }
+  return (int64_t) value;
+}
+
+// The NUL-terminated string at `offset` in a string section, or NULL
+static
+const char *section_string(const struct section *s, uint64_t offset, size_t *len) {
+  if (offset >= s->len) {
+    return NULL;
+  }
+  const char *str = (const char *) s->data + offset;
+  const char *nul = memchr(str, '\0', s->len - offset);
+  if (nul == NULL) {
+    return NULL;
+  }
+  *len = nul - str;
+  return str;
+}
+
+/*
+ELF
+*/
+
+static
+bool elf_range(size_t file_len, uint64_t offset, uint64_t len) {
+  return offset <= file_len && len <= file_len - offset;
+}
+
+// true signals an error
+static
+bool elf_sections(const uint8_t *file, size_t file_len, struct dwarf_sections *sections) {
+  memset(sections, 0, sizeof(*sections));
+  if (file_len < sizeof(Elf64_Ehdr)) {
+    return true;
+  }
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) file;
+  if (
+    memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+    || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+    || ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+    || ehdr->e_shentsize != sizeof(Elf64_Shdr)
+    || !elf_range(file_len, ehdr->e_shoff, (uint64_t) ehdr->e_shnum * sizeof(Elf64_Shdr))
+    || ehdr->e_shstrndx >= ehdr->e_shnum
+  ) {
+    return true;
+  }
+  const Elf64_Shdr *shdrs = (const Elf64_Shdr *) (file + ehdr->e_shoff);
+  const Elf64_Shdr *names = &shdrs[ehdr->e_shstrndx];
+  if (!elf_range(file_len, names->sh_offset, names->sh_size)) {
+    return true;
+  }
+  struct section shstrtab = { file + names->sh_offset, names->sh_size };
+
+  static const struct {
+    const char *name;
+    size_t field;
+  } wanted[] = {
+    { ".debug_info", offsetof(struct dwarf_sections, info) },
+    { ".debug_abbrev", offsetof(struct dwarf_sections, abbrev) },
+    { ".debug_str", offsetof(struct dwarf_sections, str) },
+    { ".debug_line_str", offsetof(struct dwarf_sections, line_str) },
+    { ".debug_str_offsets", offsetof(struct dwarf_sections, str_offsets) },
+    { ".debug_addr", offsetof(struct dwarf_sections, addr) },
+    { ".debug_line", offsetof(struct dwarf_sections, line) },
+  };
+  for (size_t i = 0; i < ehdr->e_shnum; i++) {
+    size_t name_len;
+    const char *name = section_string(&shstrtab, shdrs[i].sh_name, &name_len);
+    if (name == NULL || shdrs[i].sh_type == SHT_NOBITS) {
+      continue;
+    }
+    for (size_t w = 0; w < sizeof(wanted) / sizeof(wanted[0]); w++) {
+      if (strcmp(name, wanted[w].name) != 0) {
+        continue;
+      }
+      if (
+        (shdrs[i].sh_flags & SHF_COMPRESSED)
+        || !elf_range(file_len, shdrs[i].sh_offset, shdrs[i].sh_size)
+      ) {
+        return true;
+      }
+      struct section *s = (struct section *) ((char *) sections + wanted[w].field);
+      *s = (struct section) { file + shdrs[i].sh_offset, shdrs[i].sh_size };
+    }
+  }
+  sections->shdrs = shdrs;
+  sections->shnum = ehdr->e_shnum;
+  const Elf64_Shdr *symtab = NULL;
+  for (size_t i = 0; i < ehdr->e_shnum; i++) {
+    if (shdrs[i].sh_type == SHT_SYMTAB || (shdrs[i].sh_type == SHT_DYNSYM && symtab == NULL)) {
+      symtab = &shdrs[i];
+    }
+  }
+  if (
+    symtab != NULL
+    && symtab->sh_entsize == sizeof(Elf64_Sym)
+    && symtab->sh_link < ehdr->e_shnum
+    && elf_range(file_len, symtab->sh_offset, symtab->sh_size)
+    && elf_range(file_len, shdrs[symtab->sh_link].sh_offset, shdrs[symtab->sh_link].sh_size)
+  ) {
+    const Elf64_Shdr *strtab = &shdrs[symtab->sh_link];
+    sections->symtab = (struct section) { file + symtab->sh_offset, symtab->sh_size };
+    sections->symstr = (struct section) { file + strtab->sh_offset, strtab->sh_size };
+  }
+  bool dwarf = sections->info.data != NULL && sections->abbrev.data != NULL;
+  return !dwarf && sections->symtab.data == NULL;
+}
+
+/*
+Abbreviations
+*/
+
+struct abbrev_attr {
+  uint64_t name;
+  uint64_t form;
+  int64_t implicit_const;
+};
+
+struct abbrev {
+  uint64_t code;
+  uint64_t tag;
+  bool children;
+  size_t attr_start;
+  size_t attr_count;
+};
+
+struct abbrev_table {
+  struct abbrev *abbrevs;
+  size_t count;
+  size_t capacity;
+  struct abbrev_attr *attrs;
+  size_t attr_count;
+  size_t attr_capacity;
+};
+
+// Grows an array to hold at least one more element
+// true signals an error
+static
+bool grow(void **array, size_t *capacity, size_t count, size_t size) {
+  if (count < *capacity) {
+    return false;
+  }
+  size_t new_capacity = *capacity ? *capacity * 2 : 64;
+  void *new_array = realloc(*array, new_capacity * size);
+  if (new_array == NULL) {
+    return true;
+  }
+  *array = new_array;
+  *capacity = new_capacity;
+  return false;
+}
+
+// true signals an error
+static
+bool abbrev_table_read(struct abbrev_table *table, const struct section *abbrev, uint64_t offset) {
+  table->count = 0;
+  table->attr_count = 0;
+  if (offset >= abbrev->len) {
+    return true;
+  }
+  struct reader r = { abbrev->data + offset, abbrev->data + abbrev->len, false };
+  for (;;) {
+    uint64_t code = read_uleb(&r);
+    if (code == 0 || r.error) {
+      return r.error;
+    }
+    if (grow((void **) &table->abbrevs, &table->capacity, table->count, sizeof(struct abbrev))) {
+      return true;
+    }
+    struct abbrev *a = &table->abbrevs[table->count++];
+    a->code = code;
+    a->tag = read_uleb(&r);
+    a->children = read_uint(&r, 1) != 0;
+    a->attr_start = table->attr_count;
+    for (;;) {
+      uint64_t name = read_uleb(&r);
+      uint64_t form = read_uleb(&r);
+      if ((name == 0 && form == 0) || r.error) {
+        break;
+      }
+      if (grow((void **) &table->attrs, &table->attr_capacity, table->attr_count, sizeof(struct abbrev_attr))) {
+        return true;
+      }
+      struct abbrev_attr *attr = &table->attrs[table->attr_count++];
+      attr->name = name;
+      attr->form = form;
+      attr->implicit_const = form == DW_FORM_implicit_const ? read_sleb(&r) : 0;
+    }
+    a->attr_count = table->attr_count - a->attr_start;
+  }
+}
+
+// Codes are almost always numbered from one, in order
+static
+const struct abbrev *abbrev_find(const struct abbrev_table *table, uint64_t code) {
+  if (code - 1 < table->count && table->abbrevs[code - 1].code == code) {
+    return &table->abbrevs[code - 1];
+  }
+  for (size_t i = 0; i < table->count; i++) {
+    if (table->abbrevs[i].code == code) {
+      return &table->abbrevs[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+Attribute values
+*/
+
+struct unit {
+  uint16_t version;
+  uint8_t offset_size;
+  uint8_t address_size;
+  uint64_t str_offsets_base;
+  uint64_t addr_base;
+};
+
+struct attr_value {
+  enum {
+    VALUE_OTHER,
+    VALUE_CONSTANT,
+    VALUE_ADDRESS,
+    // Indices into .debug_addr and .debug_str_offsets, which are resolved
+    // once the unit's bases are known
+    VALUE_ADDRESS_INDEX,
+    VALUE_STRING_INDEX,
+    VALUE_STRING,
+  } kind;
+  uint64_t u;
+  const char *str;
+  size_t str_len;
+};
+
+// true signals an error
+static
+bool read_value(
+  struct reader *r,
+  const struct dwarf_sections *sections,
+  const struct unit *unit,
+  const struct abbrev_attr *attr,
+  struct attr_value *value
+) {
+  uint64_t form = attr->form;
+  value->kind = VALUE_OTHER;
+  value->str = NULL;
+  if (form == DW_FORM_indirect) {
+    form = read_uleb(r);
+  }
+  switch (form) {
+    case DW_FORM_addr:
+      value->kind = VALUE_ADDRESS;
+      value->u = read_uint(r, unit->address_size);
+      break;
+    case DW_FORM_data1:
+    case DW_FORM_data2:
+    case DW_FORM_data4:
+    case DW_FORM_data8:
+      value->kind = VALUE_CONSTANT;
+      value->u = read_uint(r, form == DW_FORM_data1 ? 1 : form == DW_FORM_data2 ? 2 : form == DW_FORM_data4 ? 4 : 8);
+      break;
+    case DW_FORM_udata:
+      value->kind = VALUE_CONSTANT;
+      value->u = read_uleb(r);
+      break;
+    case DW_FORM_sdata:
+      value->kind = VALUE_CONSTANT;
+      value->u = read_sleb(r);
+      break;
+    case DW_FORM_implicit_const:
+      value->kind = VALUE_CONSTANT;
+      value->u = attr->implicit_const;
+      break;
+    case DW_FORM_string: {
+      const char *str = (const char *) r->p;
+      const char *nul = memchr(str, '\0', r->end - r->p);
+      if (nul == NULL) {
+        return true;
+      }
+      value->kind = VALUE_STRING;
+      value->str = str;
+      value->str_len = nul - str;
+      r->p = (const uint8_t *) nul + 1;
+      break;
+    }
+    case DW_FORM_strp:
+    case DW_FORM_line_strp:
+      value->kind = VALUE_STRING;
+      value->str = section_string(
+        form == DW_FORM_strp ? &sections->str : &sections->line_str,
+        read_uint(r, unit->offset_size),
+        &value->str_len
+      );
+      if (value->str == NULL) {
+        return true;
+      }
+      break;
+    case DW_FORM_strx:
+    case DW_FORM_GNU_str_index:
+      value->kind = VALUE_STRING_INDEX;
+      value->u = read_uleb(r);
+      break;
+    case DW_FORM_strx1:
+    case DW_FORM_strx2:
+    case DW_FORM_strx3:
+    case DW_FORM_strx4:
+      value->kind = VALUE_STRING_INDEX;
+      value->u = read_uint(r, form - DW_FORM_strx1 + 1);
+      break;
+    case DW_FORM_addrx:
+    case DW_FORM_GNU_addr_index:
+      value->kind = VALUE_ADDRESS_INDEX;
+      value->u = read_uleb(r);
+      break;
+    case DW_FORM_addrx1:
+    case DW_FORM_addrx2:
+    case DW_FORM_addrx3:
+    case DW_FORM_addrx4:
+      value->kind = VALUE_ADDRESS_INDEX;
+      value->u = read_uint(r, form - DW_FORM_addrx1 + 1);
+      break;
+    case DW_FORM_sec_offset:
+    case DW_FORM_strp_sup:
+    case DW_FORM_GNU_ref_alt:
+    case DW_FORM_GNU_strp_alt:
+      value->kind = VALUE_CONSTANT;
+      value->u = read_uint(r, unit->offset_size);
+      break;
+    case DW_FORM_ref_addr:
+      read_bytes(r, unit->version == 2 ? unit->address_size : unit->offset_size);
+      break;
+    case DW_FORM_flag:
+    case DW_FORM_ref1:
+      read_bytes(r, 1);
+      break;
+    case DW_FORM_ref2:
+      read_bytes(r, 2);
+      break;
+    case DW_FORM_ref4:
+    case DW_FORM_ref_sup4:
+      read_bytes(r, 4);
+      break;
+    case DW_FORM_ref8:
+    case DW_FORM_ref_sig8:
+    case DW_FORM_ref_sup8:
+      read_bytes(r, 8);
+      break;
+    case DW_FORM_data16:
+      read_bytes(r, 16);
+      break;
+    case DW_FORM_ref_udata:
+    case DW_FORM_loclistx:
+    case DW_FORM_rnglistx:
+      read_uleb(r);
+      break;
+    case DW_FORM_flag_present:
+      break;
+    case DW_FORM_block1:
+      read_bytes(r, read_uint(r, 1));
+      break;
+    case DW_FORM_block2:
+      read_bytes(r, read_uint(r, 2));
+      break;
+    case DW_FORM_block4:
+      read_bytes(r, read_uint(r, 4));
+      break;
+    case DW_FORM_block:
+    case DW_FORM_exprloc:
+      read_bytes(r, read_uleb(r));
+      break;
+    default:
+      // Without knowing its size, nothing after it can be read
+      return true;
+  }
+  return r->error;
+}
+
+// Turns an index into the address or string it stands for
+// true signals an error
+static
+bool resolve_value(const struct dwarf_sections *sections, const struct unit *unit, struct attr_value *value) {
+  if (value->kind == VALUE_ADDRESS_INDEX) {
+    uint64_t offset = unit->addr_base + value->u * unit->address_size;
+    if (offset >= sections->addr.len) {
+      return true;
+    }
+    struct reader r = { sections->addr.data + offset, sections->addr.data + sections->addr.len, false };
+    value->kind = VALUE_ADDRESS;
+    value->u = read_uint(&r, unit->address_size);
+    return r.error;
+  }
+  if (value->kind == VALUE_STRING_INDEX) {
+    uint64_t offset = unit->str_offsets_base + value->u * unit->offset_size;
+    if (offset >= sections->str_offsets.len) {
+      return true;
+    }
+    struct reader r = {
+      sections->str_offsets.data + offset,
+      sections->str_offsets.data + sections->str_offsets.len,
+      false
+    };
+    value->kind = VALUE_STRING;
+    value->str = section_string(&sections->str, read_uint(&r, unit->offset_size), &value->str_len);
+    return r.error || value->str == NULL;
+  }
+  return false;
+}
+
+/*
+Walking .debug_info
+*/
+
+// A subprogram, before its name is demangled
+struct pending_function {
+  uint64_t low_pc;
+  uint64_t high_pc;
+  const char *mangled;
+  size_t mangled_len;
+};
+
+struct pending {
+  struct pending_function *functions;
+  size_t count;
+  size_t capacity;
+};
+
+// true signals an error
+static
+bool read_unit(
+  const struct dwarf_sections *sections,
+  struct reader *r,
+  struct abbrev_table *abbrevs,
+  struct pending *pending
+) {
+  struct unit unit = { .offset_size = 4 };
+  uint64_t unit_len = read_uint(r, 4);
+  if (unit_len == 0xffffffff) {
+    unit.offset_size = 8;
+    unit_len = read_uint(r, 8);
+  }
+  const uint8_t *start = r->p;
+  if (read_bytes(r, unit_len) == NULL) {
+    return true;
+  }
+  struct reader u = { start, start + unit_len, false };
+  unit.version = read_uint(&u, 2);
+  uint64_t abbrev_offset;
+  if (unit.version >= 5) {
+    uint8_t unit_type = read_uint(&u, 1);
+    unit.address_size = read_uint(&u, 1);
+    abbrev_offset = read_uint(&u, unit.offset_size);
+    if (unit_type == DW_UT_skeleton || unit_type == DW_UT_split_compile) {
+      read_bytes(&u, 8);
+    } else if (unit_type == DW_UT_type || unit_type == DW_UT_split_type) {
+      read_bytes(&u, 8 + unit.offset_size);
+    }
+  } else {
+    abbrev_offset = read_uint(&u, unit.offset_size);
+    unit.address_size = read_uint(&u, 1);
+  }
+  if (
+    u.error
+    || unit.version < 2
+    || unit.version > 5
+    || (unit.address_size != 4 && unit.address_size != 8)
+    || abbrev_table_read(abbrevs, &sections->abbrev, abbrev_offset)
+  ) {
+    return true;
+  }
+  // Where the first unit's contributions start, if it doesn't say
+  unit.str_offsets_base = unit.offset_size == 4 ? 8 : 16;
+  unit.addr_base = 8;
+
+  bool first = true;
+  while (u.p < u.end) {
+    uint64_t code = read_uleb(&u);
+    if (code == 0) {
+      // The end of a list of children
+      continue;
+    }
+    const struct abbrev *a = abbrev_find(abbrevs, code);
+    if (a == NULL) {
+      return true;
+    }
+    struct attr_value name = { .kind = VALUE_OTHER };
+    struct attr_value linkage_name = { .kind = VALUE_OTHER };
+    struct attr_value low_pc = { .kind = VALUE_OTHER };
+    struct attr_value high_pc = { .kind = VALUE_OTHER };
+    for (size_t i = 0; i < a->attr_count; i++) {
+      const struct abbrev_attr *attr = &abbrevs->attrs[a->attr_start + i];
+      struct attr_value value;
+      if (read_value(&u, sections, &unit, attr, &value)) {
+        return true;
+      }
+      switch (attr->name) {
+        case DW_AT_name:
+          name = value;
+          break;
+        case DW_AT_linkage_name:
+        case DW_AT_MIPS_linkage_name:
+          linkage_name = value;
+          break;
+        case DW_AT_low_pc:
+          low_pc = value;
+          break;
+        case DW_AT_high_pc:
+          high_pc = value;
+          break;
+        case DW_AT_str_offsets_base:
+          if (first) {
+            unit.str_offsets_base = value.u;
+          }
+          break;
+        case DW_AT_addr_base:
+          if (first) {
+            unit.addr_base = value.u;
+          }
+          break;
+      }
+    }
+    first = false;
+    if (a->tag != DW_TAG_subprogram) {
+      continue;
+    }
+    // GHC puts the label in the linkage name, if it gives one
+    struct attr_value *mangled = linkage_name.kind != VALUE_OTHER ? &linkage_name : &name;
+    if (
+      resolve_value(sections, &unit, mangled)
+      || resolve_value(sections, &unit, &low_pc)
+      || resolve_value(sections, &unit, &high_pc)
+    ) {
+      return true;
+    }
+    if (mangled->kind != VALUE_STRING || low_pc.kind != VALUE_ADDRESS) {
+      // Declarations, and functions we can't place
+      continue;
+    }
+    if (grow((void **) &pending->functions, &pending->capacity, pending->count, sizeof(struct pending_function))) {
+      return true;
+    }
+    struct pending_function *f = &pending->functions[pending->count++];
+    f->low_pc = low_pc.u;
+    // As a constant, it's the function's length
+    f->high_pc = high_pc.kind == VALUE_ADDRESS ? high_pc.u
+      : high_pc.kind == VALUE_CONSTANT ? low_pc.u + high_pc.u
+      : low_pc.u;
+    f->mangled = mangled->str;
+    f->mangled_len = mangled->str_len;
+  }
+  return u.error;
+}
+
+/*
+Symbols
+*/
+
+static
+int pending_cmp(const void *a, const void *b) {
+  const struct pending_function *x = a;
+  const struct pending_function *y = b;
+  if (x->low_pc != y->low_pc) {
+    return x->low_pc < y->low_pc ? -1 : 1;
+  }
+  return 0;
+}
+
+// Collects the defined code symbols of a file without debug info. GHC
+// gives most of its labels no size, so those run to the end of their
+// section, and then every function is cut short where the next begins.
+// true signals an error
+static
+bool read_symbols(const struct dwarf_sections *sections, struct pending *pending) {
+  const Elf64_Sym *syms = (const Elf64_Sym *) sections->symtab.data;
+  size_t count = sections->symtab.len / sizeof(Elf64_Sym);
+  for (size_t i = 0; i < count; i++) {
+    const Elf64_Sym *sym = &syms[i];
+    unsigned type = ELF64_ST_TYPE(sym->st_info);
+    if (
+      (type != STT_FUNC && type != STT_NOTYPE)
+      || sym->st_shndx == SHN_UNDEF
+      || sym->st_shndx >= sections->shnum
+      || !(sections->shdrs[sym->st_shndx].sh_flags & SHF_EXECINSTR)
+    ) {
+      continue;
+    }
+    size_t len;
+    const char *name = section_string(&sections->symstr, sym->st_name, &len);
+    if (name == NULL || len == 0) {
+      continue;
+    }
+    if (grow((void **) &pending->functions, &pending->capacity, pending->count, sizeof(struct pending_function))) {
+      return true;
+    }
+    const Elf64_Shdr *shdr = &sections->shdrs[sym->st_shndx];
+    struct pending_function *f = &pending->functions[pending->count++];
+    f->low_pc = sym->st_value;
+    f->high_pc = sym->st_size > 0 ? sym->st_value + sym->st_size : shdr->sh_addr + shdr->sh_size;
+    f->mangled = name;
+    f->mangled_len = len;
+  }
+
+  qsort(pending->functions, pending->count, sizeof(struct pending_function), pending_cmp);
+  // Walking back, `next` is the nearest symbol starting after this one
+  uint64_t next = UINT64_MAX;
+  for (size_t i = pending->count; i-- > 0; ) {
+    struct pending_function *f = &pending->functions[i];
+    if (f->high_pc > next) {
+      f->high_pc = next;
+    }
+    if (i == 0 || pending->functions[i - 1].low_pc != f->low_pc) {
+      next = f->low_pc;
+    }
+  }
+  return false;
+}
+
+/*
+Line programs
+*/
+
+// Marks where a sequence ends, and nothing is known until the next starts
+#define NO_FILE UINT32_MAX
+
+struct line_table {
+  struct haskell_dwarf_line *rows;
+  size_t count;
+  size_t capacity;
+  // Where the current sequence's rows start
+  size_t sequence_start;
+};
+
+// true signals an error
+static
+bool line_row(struct line_table *table, uint64_t address, uint32_t file, uint32_t line) {
+  if (table->count > table->sequence_start) {
+    struct haskell_dwarf_line *last = &table->rows[table->count - 1];
+    if (last->file == file && last->line == line && file != NO_FILE) {
+      return false;
+    }
+    // Of rows at the same address, the last is the one that counts
+    if (last->address == address) {
+      *last = (struct haskell_dwarf_line) { address, file, line };
+      return false;
+    }
+  }
+  if (grow((void **) &table->rows, &table->capacity, table->count, sizeof(struct haskell_dwarf_line))) {
+    return true;
+  }
+  table->rows[table->count++] = (struct haskell_dwarf_line) { address, file, line };
+  return false;
+}
+
+// A program's files, as IDs in the index's file table
+struct line_files {
+  uint32_t *ids;
+  size_t count;
+  size_t capacity;
+};
+
+// true signals an error
+static
+bool line_file(struct haskell_intern *names, struct line_files *files, const char *name, size_t len) {
+  if (grow((void **) &files->ids, &files->capacity, files->count, sizeof(uint32_t))) {
+    return true;
+  }
+  bool added;
+  uint32_t id = haskell_intern_add(names, name, len, &added);
+  files->ids[files->count++] = id;
+  return id == HASKELL_INTERN_ERROR;
+}
+
+// Reads the directory or file entries of a version 5 header, keeping
+// the paths of files
+// true signals an error
+static
+bool line_entries_v5(
+  struct reader *r,
+  const struct dwarf_sections *sections,
+  const struct unit *unit,
+  struct haskell_intern *names,
+  struct line_files *files
+) {
+  struct abbrev_attr formats[16];
+  uint8_t format_count = read_uint(r, 1);
+  if (format_count > sizeof(formats) / sizeof(formats[0])) {
+    return true;
+  }
+  for (size_t i = 0; i < format_count; i++) {
+    formats[i].name = read_uleb(r);
+    formats[i].form = read_uleb(r);
+    formats[i].implicit_const = 0;
+  }
+  uint64_t count = read_uleb(r);
+  for (uint64_t e = 0; e < count && !r->error; e++) {
+    struct attr_value path = { .kind = VALUE_OTHER };
+    for (size_t i = 0; i < format_count; i++) {
+      struct attr_value value;
+      if (read_value(r, sections, unit, &formats[i], &value)) {
+        return true;
+      }
+      if (formats[i].name == DW_LNCT_path) {
+        path = value;
+      }
+    }
+    if (files != NULL) {
+      if (resolve_value(sections, unit, &path) || path.kind != VALUE_STRING) {
+        return true;
+      }
+      if (line_file(names, files, path.str, path.str_len)) {
+        return true;
+      }
+    }
+  }
+  return r->error;
+}
+
+// Runs one line program, adding its rows to the table
+// true signals an error
+static
+bool read_line_program(
+  const struct dwarf_sections *sections,
+  struct reader *r,
+  struct haskell_intern *names,
+  struct line_files *files,
+  struct line_table *table
+) {
+  struct unit unit = { .offset_size = 4, .address_size = 8 };
+  uint64_t unit_len = read_uint(r, 4);
+  if (unit_len == 0xffffffff) {
+    unit.offset_size = 8;
+    unit_len = read_uint(r, 8);
+  }
+  const uint8_t *start = r->p;
+  if (read_bytes(r, unit_len) == NULL) {
+    return true;
+  }
+  struct reader u = { start, start + unit_len, false };
+  unit.version = read_uint(&u, 2);
+  unit.str_offsets_base = unit.offset_size == 4 ? 8 : 16;
+  if (unit.version >= 5) {
+    unit.address_size = read_uint(&u, 1);
+    read_bytes(&u, 1);
+  }
+  uint64_t header_len = read_uint(&u, unit.offset_size);
+  const uint8_t *program = u.p;
+  if (read_bytes(&u, header_len) == NULL) {
+    return true;
+  }
+  struct reader program_end = { program + header_len, u.end, false };
+  u = (struct reader) { program, program + header_len, false };
+
+  uint8_t min_inst_len = read_uint(&u, 1);
+  if (unit.version >= 4) {
+    // VLIW operation indices aren't tracked
+    read_bytes(&u, 1);
+  }
+  read_bytes(&u, 1);
+  int8_t line_base = read_uint(&u, 1);
+  uint8_t line_range = read_uint(&u, 1);
+  uint8_t opcode_base = read_uint(&u, 1);
+  const uint8_t *opcode_lens = read_bytes(&u, opcode_base > 0 ? opcode_base - 1 : 0);
+  if (u.error || unit.version < 2 || unit.version > 5 || line_range == 0 || opcode_base == 0) {
+    return true;
+  }
+
+  files->count = 0;
+  if (unit.version >= 5) {
+    // Directories, then files, which are numbered from zero
+    if (
+      line_entries_v5(&u, sections, &unit, names, NULL)
+      || line_entries_v5(&u, sections, &unit, names, files)
+    ) {
+      return true;
+    }
+  } else {
+    // Directories, then files, which are numbered from one
+    while (u.p < u.end && *u.p != '\0') {
+      struct abbrev_attr string = { .form = DW_FORM_string };
+      struct attr_value dir;
+      if (read_value(&u, sections, &unit, &string, &dir)) {
+        return true;
+      }
+    }
+    read_bytes(&u, 1);
+    if (grow((void **) &files->ids, &files->capacity, files->count, sizeof(uint32_t))) {
+      return true;
+    }
+    files->ids[files->count++] = NO_FILE;
+    for (;;) {
+      struct abbrev_attr string = { .form = DW_FORM_string };
+      struct attr_value name;
+      if (read_value(&u, sections, &unit, &string, &name)) {
+        return true;
+      }
+      if (name.str_len == 0) {
+        break;
+      }
+      read_uleb(&u);
+      read_uleb(&u);
+      read_uleb(&u);
+      if (line_file(names, files, name.str, name.str_len)) {
+        return true;
+      }
+    }
+  }
+  if (u.error) {
+    return true;
+  }
+
+  u = program_end;
+  uint64_t address = 0;
+  uint64_t file = 1;
+  int64_t line = 1;
+  table->sequence_start = table->count;
+#define ROW() do { \
+    uint32_t id = file < files->count ? files->ids[file] : NO_FILE; \
+    if (line_row(table, address, id, line)) { \
+      return true; \
+    } \
+  } while (0)
+  while (u.p < u.end) {
+    uint8_t opcode = read_uint(&u, 1);
+    if (opcode >= opcode_base) {
+      uint8_t adjusted = opcode - opcode_base;
+      address += (uint64_t) (adjusted / line_range) * min_inst_len;
+      line += line_base + adjusted % line_range;
+      ROW();
+      continue;
+    }
+    switch (opcode) {
+      case 0: {
+        uint64_t len = read_uleb(&u);
+        const uint8_t *args = read_bytes(&u, len);
+        if (args == NULL || len == 0) {
+          return true;
+        }
+        struct reader e = { args + 1, args + len, false };
+        switch (args[0]) {
+          case DW_LNE_end_sequence:
+            if (line_row(table, address, NO_FILE, 0)) {
+              return true;
+            }
+            address = 0;
+            file = 1;
+            line = 1;
+            table->sequence_start = table->count;
+            break;
+          case DW_LNE_set_address:
+            address = read_uint(&e, len - 1 > 8 ? 8 : len - 1);
+            break;
+          case DW_LNE_define_file: {
+            struct abbrev_attr string = { .form = DW_FORM_string };
+            struct attr_value name;
+            if (
+              read_value(&e, sections, &unit, &string, &name)
+              || line_file(names, files, name.str, name.str_len)
+            ) {
+              return true;
+            }
+            break;
+          }
+        }
+        break;
+      }
+      case DW_LNS_copy:
+        ROW();
+        break;
+      case DW_LNS_advance_pc:
+        address += read_uleb(&u) * min_inst_len;
+        break;
+      case DW_LNS_advance_line:
+        line += read_sleb(&u);
+        break;
+      case DW_LNS_set_file:
+        file = read_uleb(&u);
+        break;
+      case DW_LNS_const_add_pc:
+        address += (uint64_t) ((255 - opcode_base) / line_range) * min_inst_len;
+        break;
+      case DW_LNS_fixed_advance_pc:
+        address += read_uint(&u, 2);
+        break;
+      default:
+        // Skip the operands of opcodes that don't matter here
+        for (uint8_t i = 0; i < opcode_lens[opcode - 1]; i++) {
+          read_uleb(&u);
+        }
+        break;
+    }
+  }
+#undef ROW
+  return u.error;
+}
+
+static
+int line_cmp(const void *a, const void *b) {
+  const struct haskell_dwarf_line *x = a;
+  const struct haskell_dwarf_line *y = b;
+  if (x->address != y->address) {
+    return x->address < y->address ? -1 : 1;
+  }
+  // A sequence's end row goes before the row starting the next
+  return (y->file == NO_FILE) - (x->file == NO_FILE);
+}
+
+// true signals an error
+static
+bool index_lines(const struct dwarf_sections *sections, struct haskell_dwarf_index *index) {
+  index->files = haskell_intern_new();
+  if (index->files == NULL) {
+    return true;
+  }
+  struct line_table table = { 0 };
+  struct line_files files = { 0 };
+  struct reader r = { sections->line.data, sections->line.data + sections->line.len, false };
+  while (r.p < r.end) {
+    if (read_line_program(sections, &r, index->files, &files, &table)) {
+      free(table.rows);
+      free(files.ids);
+      return true;
+    }
+  }
+  free(files.ids);
+  qsort(table.rows, table.count, sizeof(struct haskell_dwarf_line), line_cmp);
+  index->lines = table.rows;
+  index->line_count = table.count;
+  return false;
+}
+
+static
+int function_cmp(const void *a, const void *b) {
+  const struct haskell_dwarf_function *x = a;
+  const struct haskell_dwarf_function *y = b;
+  if (x->low_pc != y->low_pc) {
+    return x->low_pc < y->low_pc ? -1 : 1;
+  }
+  return 0;
+}
+
+// Demangles every pending function's name in one batch, falling back to
+// the name as it is, for names that aren't z-encoded
+// true signals an error
+static
+bool index_functions(struct haskell_dwarf_index *index, const struct pending *pending, unsigned threads) {
+  const char **names = malloc(pending->count * sizeof(char *));
+  size_t *lens = malloc(pending->count * sizeof(size_t));
+  index->functions = malloc(pending->count * sizeof(struct haskell_dwarf_function));
+  if ((names == NULL || lens == NULL || index->functions == NULL) && pending->count > 0) {
+    free(names);
+    free(lens);
+    return true;
+  }
+  for (size_t i = 0; i < pending->count; i++) {
+    names[i] = pending->functions[i].mangled;
+    lens[i] = pending->functions[i].mangled_len;
+  }
+  struct haskell_batch_options options = haskell_default_batch_options;
+  options.threads = threads;
+  // Each name appears once in .debug_str, but is often referred to by
+  // more than one subprogram
+  options.dedup = true;
+  int res = haskell_demangle_batch_parallel(names, lens, pending->count, &options, &index->names);
+  free(names);
+  free(lens);
+  if (res) {
+    return true;
+  }
+
+  for (size_t i = 0; i < pending->count; i++) {
+    const struct pending_function *p = &pending->functions[i];
+    struct haskell_dwarf_function *f = &index->functions[i];
+    f->low_pc = p->low_pc;
+    f->high_pc = p->high_pc;
+    f->name = haskell_batch_get(&index->names, i, &f->name_len);
+    if (f->name == NULL) {
+      f->name = p->mangled;
+      f->name_len = p->mangled_len;
+    }
+  }
+  index->count = pending->count;
+  qsort(index->functions, index->count, sizeof(struct haskell_dwarf_function), function_cmp);
+  return false;
+}
+
+int
+haskell_dwarf_index_open(const char *path, unsigned threads, struct haskell_dwarf_index *index)
+{
+  memset(index, 0, sizeof(*index));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  index->map = map;
+  index->map_len = st.st_size;
+
+  struct dwarf_sections sections;
+  struct abbrev_table abbrevs = { 0 };
+  struct pending pending = { 0 };
+  if (elf_sections(map, st.st_size, &sections)) {
+    goto fail;
+  }
+  if (sections.info.data != NULL && sections.abbrev.data != NULL) {
+    struct reader r = { sections.info.data, sections.info.data + sections.info.len, false };
+    while (r.p < r.end) {
+      if (read_unit(&sections, &r, &abbrevs, &pending)) {
+        goto fail;
+      }
+    }
+  } else if (read_symbols(&sections, &pending)) {
+    goto fail;
+  }
+  if (
+    index_functions(index, &pending, threads)
+    || (sections.line.data != NULL && index_lines(&sections, index))
+  ) {
+    goto fail;
+  }
+  free(abbrevs.abbrevs);
+  free(abbrevs.attrs);
+  free(pending.functions);
+  return 0;
+
+fail:
+  free(abbrevs.abbrevs);
+  free(abbrevs.attrs);
+  free(pending.functions);
+  haskell_dwarf_index_close(index);
+  return -1;
+}
+
+const struct haskell_dwarf_function *
+haskell_dwarf_index_lookup(const struct haskell_dwarf_index *index, uint64_t address)
+{
+  // The last function starting at or before the address
+  size_t lo = 0;
+  size_t hi = index->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->functions[mid].low_pc <= address) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || address >= index->functions[lo - 1].high_pc) {
+    return NULL;
+  }
+  return &index->functions[lo - 1];
+}
+
+void
+haskell_dwarf_index_symbolize(
+  const struct haskell_dwarf_index *index,
+  const uint64_t *addresses,
+  size_t count,
+  struct haskell_dwarf_symbol *out
+) {
+  for (size_t i = 0; i < count; i++) {
+    uint64_t address = addresses[i];
+    out[i] = (struct haskell_dwarf_symbol) {
+      .function = haskell_dwarf_index_lookup(index, address)
+    };
+    // The last row at or before the address
+    size_t lo = 0;
+    size_t hi = index->line_count;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (index->lines[mid].address <= address) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo > 0 && index->lines[lo - 1].file != NO_FILE) {
+      const struct haskell_dwarf_line *row = &index->lines[lo - 1];
+      out[i].file = haskell_intern_get(index->files, row->file, &out[i].file_len);
+      out[i].line = row->line;
+    }
+  }
+}
+
+int
+haskell_elf_build_id(const char *path, uint8_t *id, size_t *len)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Elf64_Ehdr)) {
+    close(fd);
+    return -1;
+  }
+  size_t file_len = st.st_size;
+  const uint8_t *file = mmap(NULL, file_len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    return -1;
+  }
+  int res = -1;
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) file;
+  if (
+    memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0
+    || ehdr->e_ident[EI_CLASS] != ELFCLASS64
+    || ehdr->e_ident[EI_DATA] != ELFDATA2LSB
+    || ehdr->e_phentsize != sizeof(Elf64_Phdr)
+    || !elf_range(file_len, ehdr->e_phoff, (uint64_t) ehdr->e_phnum * sizeof(Elf64_Phdr))
+  ) {
+    goto done;
+  }
+  // The note is in a PT_NOTE segment, which even stripped files keep
+  const Elf64_Phdr *phdrs = (const Elf64_Phdr *) (file + ehdr->e_phoff);
+  for (size_t i = 0; i < ehdr->e_phnum && res != 0; i++) {
+    if (phdrs[i].p_type != PT_NOTE || !elf_range(file_len, phdrs[i].p_offset, phdrs[i].p_filesz)) {
+      continue;
+    }
+    size_t align = phdrs[i].p_align == 8 ? 8 : 4;
+    struct reader r = { file + phdrs[i].p_offset, file + phdrs[i].p_offset + phdrs[i].p_filesz, false };
+    while (!r.error && r.p < r.end) {
+      uint32_t name_len = read_uint(&r, 4);
+      uint32_t desc_len = read_uint(&r, 4);
+      uint32_t type = read_uint(&r, 4);
+      const uint8_t *name = read_bytes(&r, (name_len + align - 1) & ~(align - 1));
+      const uint8_t *desc = read_bytes(&r, (desc_len + align - 1) & ~(align - 1));
+      if (
+        desc != NULL
+        && type == NT_GNU_BUILD_ID
+        && name_len == 4
+        && memcmp(name, "GNU", 4) == 0
+        && desc_len <= HASKELL_BUILD_ID_MAX
+      ) {
+        memcpy(id, desc, desc_len);
+        *len = desc_len;
+        res = 0;
+        break;
+      }
+    }
+  }
+
+done:
+  munmap((void *) file, file_len);
+  return res;
+}
+
+uint64_t
+haskell_dwarf_index_address(const struct haskell_dwarf_index *index, uint64_t file_offset)
+{
+  // The header was checked when the index was opened
+  const uint8_t *file = index->map;
+  const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *) file;
+  if (
+    ehdr->e_phentsize != sizeof(Elf64_Phdr)
+    || !elf_range(index->map_len, ehdr->e_phoff, (uint64_t) ehdr->e_phnum * sizeof(Elf64_Phdr))
+  ) {
+    return file_offset;
+  }
+  const Elf64_Phdr *phdrs = (const Elf64_Phdr *) (file + ehdr->e_phoff);
+  for (size_t i = 0; i < ehdr->e_phnum; i++) {
+    const Elf64_Phdr *ph = &phdrs[i];
+    if (ph->p_type == PT_LOAD && file_offset >= ph->p_offset && file_offset - ph->p_offset < ph->p_filesz) {
+      return file_offset - ph->p_offset + ph->p_vaddr;
+    }
+  }
+  return file_offset;
+}
+
+void
+haskell_dwarf_index_close(struct haskell_dwarf_index *index)
+{
+  if (index->map != NULL) {
+    munmap(index->map, index->map_len);
+  }
+  free(index->functions);
+  haskell_batch_free(&index->names);
+  free(index->lines);
+  haskell_intern_free(index->files);
+  memset(index, 0, sizeof(*index));
+}
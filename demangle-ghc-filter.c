@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Filtering text, demangling the GHC symbols in it, like c++filt.
+
+A symbol is a run of letters, digits, and underscores, not starting with a
+digit, that ends in one of the kinds of symbol GHC emits ("_info",
+"_closure", ...), and changes when demangled. Everything else is copied
+through as it is: in logs and profiles, that's most of the bytes.
+
+So the output isn't built in a buffer. It's a list of iovecs, pointing at
+the input for the runs between symbols, and at a small arena for the
+demangled names, which are demangled straight into it. When either fills
+up, the list is written with one writev, and both start over. Input bytes
+are only ever copied by the kernel, which makes filtering a mapped file
+about as cheap as scanning it.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "demangle-ghc.h"
+
+#define ARENA_SIZE ((size_t) 64 << 10)
+
+#ifdef IOV_MAX
+#define MAX_IOVS IOV_MAX
+#else
+#define MAX_IOVS 1024
+#endif
+
+struct writer {
+  int fd;
+  struct iovec iovs[MAX_IOVS];
+  int iov_count;
+  char arena[ARENA_SIZE];
+  size_t arena_len;
+};
+
+// Writes out the list, resuming after short writes
+// true signals an error
+static
+bool flush(struct writer *w) {
+  struct iovec *iov = w->iovs;
+  int count = w->iov_count;
+  while (count > 0) {
+    ssize_t n = writev(w->fd, iov, count);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return true;
+    }
+    while (count > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  w->iov_count = 0;
+  w->arena_len = 0;
+  return false;
+}
+
+// true signals an error
+static
+bool push(struct writer *w, const char *data, size_t len) {
+  if (len == 0) {
+    return false;
+  }
+  if (w->iov_count == MAX_IOVS && flush(w)) {
+    return true;
+  }
+  w->iovs[w->iov_count++] = (struct iovec) { (void *) data, len };
+  return false;
+}
+
+static
+bool is_symbol_char(char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Whether a token's last component is a kind of symbol GHC emits
+static
+bool has_ghc_kind(const char *token, size_t len) {
+  static const char *const kinds[] = {
+    "_info", "_closure", "_entry", "_slow", "_fast", "_srt", "_bytes", "_ret",
+  };
+  for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    size_t kind_len = strlen(kinds[i]);
+    if (len > kind_len && memcmp(token + len - kind_len, kinds[i], kind_len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Writes out a token, demangled if it's a symbol, after the run of text
+// before it, which is left pending if it isn't
+// true signals an error
+static
+bool filter_token(struct writer *w, const char **pending, const char *token, size_t len) {
+  // Names without escapes demangle to themselves
+  if (memchr(token, 'z', len) == NULL && memchr(token, 'Z', len) == NULL) {
+    return false;
+  }
+  // Room for the run and the name, so that pushing them doesn't flush the
+  // arena out from under the name
+  if (w->iov_count > MAX_IOVS - 2 && flush(w)) {
+    return true;
+  }
+  size_t written;
+  enum haskell_demangle_error res = haskell_demangle_into(
+    token, len, &haskell_default_limits,
+    w->arena + w->arena_len, ARENA_SIZE - w->arena_len, &written
+  );
+  if (res == HASKELL_DEMANGLE_TOO_LONG && w->arena_len > 0) {
+    if (flush(w)) {
+      return true;
+    }
+    res = haskell_demangle_into(token, len, &haskell_default_limits, w->arena, ARENA_SIZE, &written);
+  }
+  if (res == HASKELL_DEMANGLE_TOO_LONG) {
+    // Bigger than the arena: written out on its own
+    char *demangled = haskell_demangle_n(token, len);
+    if (demangled == NULL) {
+      return true;
+    }
+    bool error = push(w, *pending, token - *pending) || push(w, demangled, strlen(demangled)) || flush(w);
+    free(demangled);
+    *pending = token + len;
+    return error;
+  }
+  if (res == HASKELL_DEMANGLE_NO_MEMORY) {
+    return true;
+  }
+  if (res != HASKELL_DEMANGLE_OK || (written == len && memcmp(w->arena + w->arena_len, token, len) == 0)) {
+    return false;
+  }
+  push(w, *pending, token - *pending);
+  push(w, w->arena + w->arena_len, written);
+  w->arena_len += written;
+  *pending = token + len;
+  return false;
+}
+
+int
+haskell_filter(const char *text, size_t len, int fd)
+{
+  struct writer *w = malloc(sizeof(struct writer));
+  if (w == NULL) {
+    return -1;
+  }
+  w->fd = fd;
+  w->iov_count = 0;
+  w->arena_len = 0;
+  // Start of the run not written yet
+  const char *pending = text;
+  const char *end = text + len;
+  const char *p = text;
+  while (p < end) {
+    if (!is_symbol_char(*p)) {
+      p++;
+      continue;
+    }
+    const char *token = p;
+    while (p < end && is_symbol_char(*p)) {
+      p++;
+    }
+    if (*token >= '0' && *token <= '9') {
+      continue;
+    }
+    if (has_ghc_kind(token, p - token) && filter_token(w, &pending, token, p - token)) {
+      goto fail;
+    }
+  }
+  if (push(w, pending, end - pending) || flush(w)) {
+    goto fail;
+  }
+  free(w);
+  return 0;
+
+fail:
+  free(w);
+  return -1;
+}
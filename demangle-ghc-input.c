@@ -0,0 +1,505 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Compressed input.
+
+haskell_open_input looks at the first bytes of a stream, and if they're a
+gzip or zstd magic number, returns a stream that reads the decompressed
+data. Decompression runs on threads of its own, a window of chunks ahead
+of the reader, and the reader takes chunks in order as they're ready.
+
+gzip is inflated by one thread, member after member, in chunks of a
+megabyte. zstd input with several frames, as pzstd writes, is read whole
+(mapped, if it's a file), split at its frames, and the frames are
+decompressed in parallel, a frame to a chunk, so memory is the window's
+worth of frames. That needs every frame's header to give its size. A
+single frame, or frames without their sizes, as `zstd` writes to a pipe,
+are decompressed by one thread, a chunk at a time.
+
+Support is compiled in with HAVE_ZLIB and HAVE_ZSTD. Without them,
+compressed input is still recognized, and rejected with ENOTSUP, rather
+than being read as text.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "demangle-ghc.h"
+
+#define CHUNK_SIZE ((size_t) 1 << 20)
+// Chunks decompressed ahead of the reader
+#define WINDOW 8
+
+static const uint8_t gzip_magic[] = { 0x1f, 0x8b };
+static const uint8_t zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+struct chunk {
+  char *data;
+  size_t len;
+  bool ready;
+};
+
+struct pipeline {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct chunk window[WINDOW];
+  // The chunk being read, and how far into it
+  uint64_t next;
+  size_t pos;
+  // How many chunks there are, once the producers know
+  uint64_t total;
+  bool total_known;
+  bool error;
+  bool closing;
+  pthread_t threads[WINDOW];
+  size_t thread_count;
+
+  // The compressed input, and the magic number read from its start
+  FILE *in;
+  uint8_t magic[4];
+  size_t magic_len;
+  // zstd: all of the input, and where its frames start
+  const uint8_t *src;
+  size_t src_len;
+  size_t map_len;
+  size_t *frames;
+  size_t frame_count;
+  // Whether every frame's header gives its decompressed size
+  bool frames_sized;
+  uint64_t next_frame;
+};
+
+/*
+Window
+*/
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+// Waits for room for chunk `seq`. Returns false if the reader's gone.
+static
+bool wait_slot(struct pipeline *p, uint64_t seq) {
+  pthread_mutex_lock(&p->lock);
+  while (seq >= p->next + WINDOW && !p->closing) {
+    pthread_cond_wait(&p->changed, &p->lock);
+  }
+  bool open = !p->closing;
+  pthread_mutex_unlock(&p->lock);
+  return open;
+}
+
+static
+void publish(struct pipeline *p, uint64_t seq, char *data, size_t len) {
+  pthread_mutex_lock(&p->lock);
+  p->window[seq % WINDOW] = (struct chunk) { data, len, true };
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+
+static
+void finish(struct pipeline *p, uint64_t total, bool error) {
+  pthread_mutex_lock(&p->lock);
+  if (error) {
+    p->error = true;
+  } else {
+    p->total = total;
+    p->total_known = true;
+  }
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+#endif
+
+static
+ssize_t pipeline_read(void *cookie, char *buf, size_t size) {
+  struct pipeline *p = cookie;
+  pthread_mutex_lock(&p->lock);
+  ssize_t n = 0;
+  while (true) {
+    struct chunk *c = &p->window[p->next % WINDOW];
+    if (c->ready && p->pos < c->len) {
+      n = c->len - p->pos < size ? c->len - p->pos : size;
+      memcpy(buf, c->data + p->pos, n);
+      p->pos += n;
+      break;
+    }
+    if (c->ready) {
+      // Used up, or empty
+      free(c->data);
+      *c = (struct chunk) { 0 };
+      p->next++;
+      p->pos = 0;
+      pthread_cond_broadcast(&p->changed);
+      continue;
+    }
+    if (p->error) {
+      errno = EIO;
+      n = -1;
+      break;
+    }
+    if (p->total_known && p->next >= p->total) {
+      break;
+    }
+    pthread_cond_wait(&p->changed, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return n;
+}
+
+static
+int pipeline_close(void *cookie) {
+  struct pipeline *p = cookie;
+  pthread_mutex_lock(&p->lock);
+  p->closing = true;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+  for (size_t i = 0; i < p->thread_count; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  for (size_t i = 0; i < WINDOW; i++) {
+    free(p->window[i].data);
+  }
+  if (p->map_len > 0) {
+    munmap((void *) p->src, p->map_len);
+  } else {
+    free((void *) p->src);
+  }
+  free(p->frames);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->changed);
+  free(p);
+  return 0;
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+// Reads compressed input, starting with the magic number
+static
+size_t read_input(struct pipeline *p, uint8_t *buf, size_t size) {
+  size_t n = 0;
+  if (p->magic_len > 0) {
+    n = p->magic_len < size ? p->magic_len : size;
+    memcpy(buf, p->magic, n);
+    memmove(p->magic, p->magic + n, p->magic_len - n);
+    p->magic_len -= n;
+  }
+  return n + fread(buf + n, 1, size - n, p->in);
+}
+#endif
+
+/*
+gzip
+*/
+
+#ifdef HAVE_ZLIB
+static
+void *inflate_gzip(void *arg) {
+  struct pipeline *p = arg;
+  uint8_t *in = malloc(CHUNK_SIZE);
+  char *out = malloc(CHUNK_SIZE);
+  z_stream z = { 0 };
+  uint64_t seq = 0;
+  bool error = in == NULL || out == NULL || inflateInit2(&z, 15 + 16) != Z_OK;
+  // Whether a member has been started and not finished
+  bool partial = false;
+  while (!error) {
+    if (z.avail_in == 0) {
+      z.next_in = in;
+      z.avail_in = read_input(p, in, CHUNK_SIZE);
+      if (z.avail_in == 0) {
+        error = ferror(p->in) || partial;
+        break;
+      }
+    }
+    if (z.next_out == NULL || z.avail_out == 0) {
+      z.next_out = (uint8_t *) out;
+      z.avail_out = CHUNK_SIZE;
+    }
+    partial = true;
+    int res = inflate(&z, Z_NO_FLUSH);
+    if (res == Z_STREAM_END) {
+      // Another member may follow
+      partial = false;
+      error = inflateReset(&z) != Z_OK;
+    } else if (res != Z_OK && res != Z_BUF_ERROR) {
+      error = true;
+    }
+    if (z.avail_out == 0) {
+      if (!wait_slot(p, seq)) {
+        break;
+      }
+      publish(p, seq++, out, CHUNK_SIZE);
+      out = malloc(CHUNK_SIZE);
+      z.next_out = NULL;
+      error |= out == NULL;
+    }
+  }
+  if (!error && z.next_out != NULL && wait_slot(p, seq)) {
+    publish(p, seq++, out, CHUNK_SIZE - z.avail_out);
+    out = NULL;
+  }
+  finish(p, seq, error);
+  inflateEnd(&z);
+  free(in);
+  free(out);
+  return NULL;
+}
+#endif
+
+/*
+zstd
+*/
+
+#ifdef HAVE_ZSTD
+// All of the frames, one after another, streamed from memory a chunk at a
+// time
+static
+void *stream_zstd(void *arg) {
+  struct pipeline *p = arg;
+  ZSTD_DStream *stream = ZSTD_createDStream();
+  ZSTD_inBuffer input = { p->src, p->src_len, 0 };
+  uint64_t seq = 0;
+  bool error = stream == NULL;
+  // Zero once the frame is done
+  size_t hint = 1;
+  // Whether the last chunk filled up, and so more may be buffered
+  bool full = false;
+  while (!error && (input.pos < input.size || full)) {
+    char *out = malloc(CHUNK_SIZE);
+    if (out == NULL) {
+      error = true;
+      break;
+    }
+    ZSTD_outBuffer output = { out, CHUNK_SIZE, 0 };
+    do {
+      hint = ZSTD_decompressStream(stream, &output, &input);
+      error = ZSTD_isError(hint);
+    } while (!error && output.pos < output.size && input.pos < input.size);
+    full = output.pos == output.size;
+    if (error || !wait_slot(p, seq)) {
+      free(out);
+      break;
+    }
+    publish(p, seq++, out, output.pos);
+  }
+  finish(p, seq, error || hint != 0);
+  ZSTD_freeDStream(stream);
+  return NULL;
+}
+
+// Frames in parallel: each thread takes the next frame, and decompresses it
+// whole into its chunk
+static
+void *decompress_frames(void *arg) {
+  struct pipeline *p = arg;
+  ZSTD_DCtx *ctx = ZSTD_createDCtx();
+  bool error = ctx == NULL;
+  while (!error) {
+    pthread_mutex_lock(&p->lock);
+    uint64_t seq = p->next_frame++;
+    pthread_mutex_unlock(&p->lock);
+    if (seq >= p->frame_count || !wait_slot(p, seq)) {
+      break;
+    }
+    const uint8_t *frame = p->src + p->frames[seq];
+    size_t frame_len = p->frames[seq + 1] - p->frames[seq];
+    // Known, since find_frames checked every frame
+    unsigned long long size = ZSTD_getFrameContentSize(frame, frame_len);
+    char *out = malloc(size + 1);
+    size_t len = out == NULL ? 0 : ZSTD_decompressDCtx(ctx, out, size, frame, frame_len);
+    if (out == NULL || ZSTD_isError(len)) {
+      free(out);
+      error = true;
+      break;
+    }
+    publish(p, seq, out, len);
+  }
+  if (error) {
+    finish(p, 0, true);
+  }
+  ZSTD_freeDCtx(ctx);
+  return NULL;
+}
+
+// Reads all of the input, mapping it if it's a file
+// true signals an error
+static
+bool read_all(struct pipeline *p) {
+  struct stat st;
+  int fd = fileno(p->in);
+  off_t at = ftello(p->in);
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && at >= (off_t) p->magic_len) {
+    // The magic number was read through the stream's buffer, so the start
+    // is behind where the stream is
+    off_t start = at - p->magic_len;
+    if (start <= st.st_size && st.st_size > 0) {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        p->map_len = st.st_size;
+        p->src = (const uint8_t *) map + start;
+        p->src_len = st.st_size - start;
+        return false;
+      }
+    }
+  }
+  size_t capacity = CHUNK_SIZE;
+  uint8_t *src = malloc(capacity);
+  size_t len = 0;
+  while (src != NULL) {
+    len += read_input(p, src + len, capacity - len);
+    if (len < capacity) {
+      break;
+    }
+    capacity *= 2;
+    uint8_t *grown = realloc(src, capacity);
+    if (grown == NULL) {
+      free(src);
+    }
+    src = grown;
+  }
+  p->src = src;
+  p->src_len = len;
+  return src == NULL || ferror(p->in);
+}
+
+// true signals an error
+static
+bool find_frames(struct pipeline *p) {
+  size_t capacity = 16;
+  p->frames = malloc(capacity * sizeof(size_t));
+  p->frames_sized = true;
+  size_t at = 0;
+  while (p->frames != NULL) {
+    if (p->frame_count + 2 > capacity) {
+      capacity *= 2;
+      size_t *frames = realloc(p->frames, capacity * sizeof(size_t));
+      if (frames == NULL) {
+        return true;
+      }
+      p->frames = frames;
+    }
+    p->frames[p->frame_count] = at;
+    if (at == p->src_len) {
+      return false;
+    }
+    size_t len = ZSTD_findFrameCompressedSize(p->src + at, p->src_len - at);
+    if (ZSTD_isError(len)) {
+      return true;
+    }
+    unsigned long long size = ZSTD_getFrameContentSize(p->src + at, len);
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) {
+      p->frames_sized = false;
+    }
+    at += len;
+    p->frame_count++;
+  }
+  return true;
+}
+#endif
+
+/*
+Opening
+*/
+
+// Starts the threads that decompress the input
+// true signals an error
+static
+bool start(struct pipeline *p, bool zstd, unsigned threads) {
+  void *(*fn)(void *) = NULL;
+  size_t count = 1;
+#ifdef HAVE_ZLIB
+  if (!zstd) {
+    fn = inflate_gzip;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (zstd) {
+    if (read_all(p) || find_frames(p)) {
+      return true;
+    }
+    // A frame without its size, as zstd writes to a pipe, can't be
+    // decompressed whole, so then the frames are streamed one by one
+    fn = stream_zstd;
+    if (p->frame_count > 1 && p->frames_sized) {
+      fn = decompress_frames;
+      count = threads < WINDOW ? threads : WINDOW;
+      // A chunk a frame
+      finish(p, p->frame_count, false);
+    }
+  }
+#endif
+  (void) zstd;
+  (void) threads;
+  if (fn == NULL) {
+    errno = ENOTSUP;
+    return true;
+  }
+  for (; p->thread_count < count; p->thread_count++) {
+    if (pthread_create(&p->threads[p->thread_count], NULL, fn, p) != 0) {
+      break;
+    }
+  }
+  return p->thread_count == 0;
+}
+
+FILE *
+haskell_open_input(FILE *in, unsigned threads)
+{
+  // Reading ahead would stall an interactive session
+  if (isatty(fileno(in))) {
+    return in;
+  }
+  struct pipeline *p = calloc(1, sizeof(struct pipeline));
+  if (p == NULL) {
+    return NULL;
+  }
+  p->in = in;
+  p->magic_len = fread(p->magic, 1, sizeof(zstd_magic), in);
+  bool gzip = p->magic_len >= sizeof(gzip_magic) && memcmp(p->magic, gzip_magic, sizeof(gzip_magic)) == 0;
+  bool zstd = p->magic_len >= sizeof(zstd_magic) && memcmp(p->magic, zstd_magic, sizeof(zstd_magic)) == 0;
+
+  if (!gzip && !zstd) {
+    // Plain text: hand the magic number's bytes back. Pipes can't seek,
+    // and ungetc only promises one byte, but glibc, which fopencookie
+    // needs anyway, takes back as many as it's given.
+    bool error = ferror(in);
+    if (!error && p->magic_len > 0 && fseeko(in, -(off_t) p->magic_len, SEEK_CUR) != 0) {
+      clearerr(in);
+      for (size_t i = p->magic_len; i-- > 0 && !error;) {
+        error = ungetc(p->magic[i], in) == EOF;
+      }
+    }
+    free(p);
+    return error ? NULL : in;
+  }
+
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->changed, NULL);
+  cookie_io_functions_t io = { .read = pipeline_read, .close = pipeline_close };
+  if (start(p, zstd, threads)) {
+    int error = errno;
+    pipeline_close(p);
+    errno = error;
+    return NULL;
+  }
+  FILE *out = fopencookie(p, "r", io);
+  if (out == NULL) {
+    pipeline_close(p);
+  }
+  return out;
+}
@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+String interning table.
+
+Maps byte strings to dense IDs, in the order they were first added. Keys
+are copied into one growing arena, and looked up through an open addressing
+table of (hash, ID) pairs, so a lookup only touches the arena on a hash
+match.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "demangle-ghc.h"
+
+struct intern_slot {
+  uint64_t hash;
+  // ID + 1, so that zero marks an empty slot
+  uint32_t id;
+};
+
+struct haskell_intern {
+  struct intern_slot *slots;
+  // Always a power of two
+  size_t slot_count;
+  // Key i is arena[offsets[i]..offsets[i + 1])
+  size_t *offsets;
+  size_t count;
+  size_t offsets_capacity;
+  char *arena;
+  size_t arena_capacity;
+};
+
+// FNV-1a, eight bytes at a time where possible
+static
+uint64_t intern_hash(const char *str, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, &str[i], 8);
+    hash = (hash ^ word) * 0x100000001b3;
+    hash ^= hash >> 29;
+  }
+  for (; i < len; i++) {
+    hash = (hash ^ (unsigned char) str[i]) * 0x100000001b3;
+  }
+  // Finalise, so that the low bits depend on all of the input
+  hash ^= hash >> 32;
+  hash *= 0xd6e8feb86659fd93;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+struct haskell_intern *
+haskell_intern_new(void)
+{
+  struct haskell_intern *table = calloc(1, sizeof(struct haskell_intern));
+  if (table == NULL) {
+    return NULL;
+  }
+  table->slot_count = 1024;
+  table->slots = calloc(table->slot_count, sizeof(struct intern_slot));
+  table->offsets_capacity = 512;
+  table->offsets = malloc(table->offsets_capacity * sizeof(size_t));
+  table->arena_capacity = 16384;
+  table->arena = malloc(table->arena_capacity);
+  if (table->slots == NULL || table->offsets == NULL || table->arena == NULL) {
+    haskell_intern_free(table);
+    return NULL;
+  }
+  table->offsets[0] = 0;
+  return table;
+}
+
+void
+haskell_intern_free(struct haskell_intern *table)
+{
+  if (table == NULL) {
+    return;
+  }
+  free(table->slots);
+  free(table->offsets);
+  free(table->arena);
+  free(table);
+}
+
+size_t
+haskell_intern_count(const struct haskell_intern *table)
+{
+  return table->count;
+}
+
+const char *
+haskell_intern_get(const struct haskell_intern *table, uint32_t id, size_t *len)
+{
+  *len = table->offsets[id + 1] - table->offsets[id];
+  return &table->arena[table->offsets[id]];
+}
+
+// Doubles the number of slots, keeping the load factor under a half
+static
+int intern_grow(struct haskell_intern *table) {
+  size_t slot_count = table->slot_count * 2;
+  struct intern_slot *slots = calloc(slot_count, sizeof(struct intern_slot));
+  if (slots == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < table->slot_count; i++) {
+    struct intern_slot slot = table->slots[i];
+    if (slot.id == 0) {
+      continue;
+    }
+    size_t j = slot.hash & (slot_count - 1);
+    while (slots[j].id != 0) {
+      j = (j + 1) & (slot_count - 1);
+    }
+    slots[j] = slot;
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->slot_count = slot_count;
+  return 0;
+}
+
+// Finds the string's slot, or the empty slot where it would go
+static
+size_t intern_lookup(const struct haskell_intern *table, const char *str, size_t len, uint64_t hash) {
+  size_t mask = table->slot_count - 1;
+  size_t i = hash & mask;
+  for (; table->slots[i].id != 0; i = (i + 1) & mask) {
+    if (table->slots[i].hash != hash) {
+      continue;
+    }
+    size_t existing_len;
+    const char *existing = haskell_intern_get(table, table->slots[i].id - 1, &existing_len);
+    if (existing_len == len && memcmp(existing, str, len) == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+bool
+haskell_intern_find(const struct haskell_intern *table, const char *str, size_t len, uint32_t *id)
+{
+  size_t i = intern_lookup(table, str, len, intern_hash(str, len));
+  if (table->slots[i].id == 0) {
+    return false;
+  }
+  *id = table->slots[i].id - 1;
+  return true;
+}
+
+uint32_t
+haskell_intern_add(struct haskell_intern *table, const char *str, size_t len, bool *added)
+{
+  if ((table->count + 1) * 2 > table->slot_count && intern_grow(table)) {
+    return HASKELL_INTERN_ERROR;
+  }
+  uint64_t hash = intern_hash(str, len);
+  size_t i = intern_lookup(table, str, len, hash);
+  if (table->slots[i].id != 0) {
+    *added = false;
+    return table->slots[i].id - 1;
+  }
+
+  if (table->count + 1 >= UINT32_MAX) {
+    return HASKELL_INTERN_ERROR;
+  }
+  size_t used = table->offsets[table->count];
+  if (used + len > table->arena_capacity) {
+    size_t capacity = table->arena_capacity * 2;
+    if (capacity < used + len) {
+      capacity = used + len;
+    }
+    char *arena = realloc(table->arena, capacity);
+    if (arena == NULL) {
+      return HASKELL_INTERN_ERROR;
+    }
+    table->arena = arena;
+    table->arena_capacity = capacity;
+  }
+  if (table->count + 2 > table->offsets_capacity) {
+    size_t capacity = table->offsets_capacity * 2;
+    size_t *offsets = realloc(table->offsets, capacity * sizeof(size_t));
+    if (offsets == NULL) {
+      return HASKELL_INTERN_ERROR;
+    }
+    table->offsets = offsets;
+    table->offsets_capacity = capacity;
+  }
+  memcpy(&table->arena[used], str, len);
+  uint32_t id = table->count++;
+  table->offsets[table->count] = used + len;
+  table->slots[i] = (struct intern_slot) {
+    .hash = hash,
+    .id = id + 1
+  };
+  *added = true;
+  return id;
+}
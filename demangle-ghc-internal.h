@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Helpers shared between the library's files, which aren't part of its
+interface.
+*/
+
+#ifndef DEMANGLE_GHC_INTERNAL_H
+#define DEMANGLE_GHC_INTERNAL_H
+
+#include "demangle-ghc.h"
+
+/*
+Mangled names' parts. Defined in demangle-ghc.c.
+*/
+
+// Offsets of a mangled name's parts. The unit is [0, unit_len), and
+// empty if there's none.
+struct haskell_name_parts {
+  size_t unit_len;
+  size_t module_start;
+  size_t module_end;
+  size_t binder_start;
+  size_t binder_end;
+};
+
+// Splits <unit>_<module>_<binder>_... at its literal '_'s, which never
+// appear inside escapes, so nothing is decoded. The first component is
+// only taken to be a unit if two more components follow it, and it's
+// lower case ("base") or has a version ("QuickCheckzm2zi14zi3zmAbC").
+// Returns false if there's no module followed by a binder.
+bool haskell_split_name(const char *name, size_t len, struct haskell_name_parts *parts);
+
+// Whether a component is a local binder's unique, such as "r1Ab" or "s1Abc"
+bool haskell_is_unique(const char *s, size_t len);
+
+/*
+Threads. Defined in demangle-ghc-parallel.c.
+*/
+
+// Runs fn on every job, on its own thread, except for the first, which
+// runs on the caller's thread. Returns zero on success, or -1 if memory
+// runs out.
+int haskell_run_jobs(void *(*fn)(void *), void *jobs, size_t job_size, size_t count);
+
+// `threads`, or one per CPU if it's zero
+unsigned haskell_default_threads(unsigned threads);
+
+/*
+Sorted names and output buffers, for the store and the trie. Defined in
+demangle-ghc-store.c.
+*/
+
+struct haskell_name {
+  const char *str;
+  size_t len;
+};
+
+// Orders names by their bytes, for qsort
+int haskell_name_cmp(const void *a, const void *b);
+
+// The distinct, non-null names in a batch, sorted, in a malloc'd array,
+// pointing into the batch. Sets `count`, and `max_len` to the length of
+// the longest. Returns NULL if memory runs out.
+struct haskell_name *haskell_sorted_names(const struct haskell_batch *batch, size_t *count, size_t *max_len);
+
+struct haskell_out_buf {
+  uint8_t *data;
+  size_t len;
+  size_t capacity;
+};
+
+// Makes room for n more bytes
+// true signals an error
+bool haskell_out_reserve(struct haskell_out_buf *out, size_t n);
+
+// Appends an unsigned LEB128 varint. The caller reserves room for it: ten
+// bytes at most.
+void haskell_out_varint(struct haskell_out_buf *out, uint64_t n);
+
+#endif
@@ -2,18 +2,65 @@
 This file lets you test the haskell_demangle function
 defined in demangle-ghc.c
 
-It can be used in a UNIX pipe, or interactively.
+It can be used in a UNIX pipe, or interactively. Input compressed with
+gzip or zstd is decompressed, if support for it was built in (see
+demangle-ghc-input.c).
+
+Options:
+  -o FILE        demangle every line into FILE, which is written in place,
+                 by every thread, rather than to stdout. Lines that don't
+                 demangle are written as they are. FILE can't be the input,
+                 and -o can't be given with the other options.
+  --dict         write a dictionary-encoded stream (see demangle-ghc-dict.c)
+  --dict-decode  read a dictionary-encoded stream, and write one name per line
+  --unique       write each distinct line once, demangled, in the order
+                 first seen
+  --top K        write the K most frequent lines, demangled, with their
+                 counts, like `sort | uniq -c | sort -rn | head -n K`.
+                 Past a few million distinct lines, counts are estimates.
+  --exact        with --top, always count exactly
+  --columnar F   demangle every line, and write the results to F as a
+                 columnar file (see demangle-ghc-columnar.c)
+  --trie F       demangle every line, and write an autocomplete index of
+                 the results to F (see demangle-ghc-trie.c)
+  --complete F   read prefixes, one per line, and write the next module
+                 path components after each, from the index F, with how
+                 many names each covers
+  --dwarf F      list the functions in the debug info of the ELF file F,
+                 or in its symbol table if it has none, one "low high
+                 name" line each, sorted by address
+  --symbolize F  read hex addresses, one per line, and write the function
+                 and source location of each, from the ELF file F
+  --pid P        like --symbolize, for addresses in the running process P
+  --diff OLD NEW compare the symbol tables of two ELF files, and write the
+                 symbols added (+), removed (-), or resized (~), by module
+  --no-normalize with --diff, keep unit ID hashes and uniques in names
+  --perf F       write the samples in the perf.data file F as folded stacks
+  --ticky F...   sum the counters in the ticky-ticky profiles F... per
+                 binder, most allocating first (see demangle-ghc-ticky.c)
+  --by-module    with --ticky, sum per module
+  --filter       copy the input, demangling the GHC symbols in it, like
+                 c++filt (see demangle-ghc-filter.c)
 */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-char *haskell_demangle(const char *mangled);
+#include "demangle-ghc.h"
+
+// stdin, decompressed if it needs to be
+static FILE *input;
 
-int main() {
+static
+int demangle_lines(void) {
   char *line = malloc(10);
   size_t line_len = 10;
   bool tty = isatty(STDIN_FILENO);
@@ -22,7 +69,7 @@ int main() {
       fputs("> ", stdout);
     }
     errno = 0;
-    ssize_t n = getline(&line, &line_len, stdin);
+    ssize_t n = getline(&line, &line_len, input);
     if (n <= 0 && errno != 0) {
       perror("failed to read input");
       return 1;
@@ -40,3 +87,835 @@ int main() {
   }
   free(line);
 }
+
+static
+int dict_encode_lines(void) {
+  struct haskell_dict_encoder *enc = haskell_dict_encoder_new();
+  if (enc == NULL) {
+    perror("failed to create encoder");
+    return 1;
+  }
+  char *line = NULL;
+  size_t line_len = 0;
+  int res = 0;
+  while (true) {
+    errno = 0;
+    ssize_t n = getline(&line, &line_len, input);
+    if (n <= 0 && errno != 0) {
+      perror("failed to read input");
+      res = 1;
+      break;
+    }
+    if (n <= 0) {
+      break;
+    }
+    if (line[n - 1] == '\n') {
+      n--;
+    }
+    if (haskell_dict_encode(enc, line, n, stdout)) {
+      fputs("Demangler error!\n", stderr);
+      res = 1;
+      break;
+    }
+  }
+  free(line);
+  haskell_dict_encoder_free(enc);
+  return res;
+}
+
+// Demangles a line that's been seen for the first time, or writes it as
+// it is, if it doesn't demangle
+static
+void write_demangled(const char *line, size_t len) {
+  char *demangled = haskell_demangle_n(line, len);
+  if (demangled != NULL) {
+    puts(demangled);
+    free(demangled);
+  } else {
+    printf("%.*s\n", (int) len, line);
+  }
+}
+
+static
+int unique_lines(void) {
+  struct haskell_intern *seen = haskell_intern_new();
+  if (seen == NULL) {
+    perror("failed to create table");
+    return 1;
+  }
+  char *line = NULL;
+  size_t line_len = 0;
+  int res = 0;
+  while (true) {
+    errno = 0;
+    ssize_t n = getline(&line, &line_len, input);
+    if (n <= 0) {
+      if (errno != 0) {
+        perror("failed to read input");
+        res = 1;
+      }
+      break;
+    }
+    if (line[n - 1] == '\n') {
+      n--;
+    }
+    bool added;
+    if (haskell_intern_add(seen, line, n, &added) == HASKELL_INTERN_ERROR) {
+      perror("failed to count");
+      res = 1;
+      break;
+    }
+    if (added) {
+      write_demangled(line, n);
+    }
+  }
+  free(line);
+  haskell_intern_free(seen);
+  return res;
+}
+
+// Parses a positive decimal count, with nothing before or after it
+// true signals an error
+static
+bool parse_count(const char *s, size_t *count) {
+  if (!(*s >= '0' && *s <= '9')) {
+    return true;
+  }
+  char *end;
+  errno = 0;
+  unsigned long long n = strtoull(s, &end, 10);
+  if (errno != 0 || *end != '\0' || n == 0 || n > SIZE_MAX) {
+    return true;
+  }
+  *count = n;
+  return false;
+}
+
+static
+int top_lines(size_t k, bool exact) {
+  // Roughly 100 bytes a symbol, so about 400 MB before estimating
+  size_t exact_limit = exact ? SIZE_MAX : (size_t) 1 << 22;
+  struct haskell_top_k *top = haskell_top_k_new(k, exact_limit);
+  if (top == NULL) {
+    perror("failed to create counter");
+    return 1;
+  }
+  char *line = NULL;
+  size_t line_len = 0;
+  int res = 0;
+  while (true) {
+    errno = 0;
+    ssize_t n = getline(&line, &line_len, input);
+    if (n <= 0) {
+      if (errno != 0) {
+        perror("failed to read input");
+        res = 1;
+      }
+      break;
+    }
+    if (line[n - 1] == '\n') {
+      n--;
+    }
+    if (haskell_top_k_add(top, line, n)) {
+      perror("failed to count");
+      res = 1;
+      break;
+    }
+  }
+  const struct haskell_top_k_entry *entries;
+  size_t count;
+  if (res == 0 && haskell_top_k_results(top, &entries, &count)) {
+    perror("failed to count");
+    res = 1;
+  }
+  if (res == 0) {
+    if (!haskell_top_k_is_exact(top)) {
+      fputs("too many distinct lines to count exactly: counts are estimates\n", stderr);
+    }
+    for (size_t i = 0; i < count; i++) {
+      printf("%7llu %s\n", (unsigned long long) entries[i].count, entries[i].name);
+    }
+  }
+  free(line);
+  haskell_top_k_free(top);
+  return res;
+}
+
+// All of an input's lines, without their newlines
+struct lines {
+  char *text;
+  const char **starts;
+  size_t *lens;
+  size_t count;
+};
+
+static
+void free_lines(struct lines *lines) {
+  free(lines->text);
+  free(lines->starts);
+  free(lines->lens);
+}
+
+// Reads the rest of a stream into a malloc'd buffer
+static
+char *read_all(FILE *in, size_t *len) {
+  *len = 0;
+  size_t capacity = 1 << 16;
+  char *text = malloc(capacity);
+  while (text != NULL) {
+    *len += fread(&text[*len], 1, capacity - *len, in);
+    if (*len < capacity) {
+      break;
+    }
+    capacity *= 2;
+    char *bigger = realloc(text, capacity);
+    if (bigger == NULL) {
+      free(text);
+    }
+    text = bigger;
+  }
+  if (text != NULL && ferror(in)) {
+    free(text);
+    return NULL;
+  }
+  return text;
+}
+
+static
+int read_lines(FILE *in, struct lines *lines) {
+  *lines = (struct lines) { 0 };
+  size_t len;
+  lines->text = read_all(in, &len);
+  if (lines->text == NULL) {
+    return -1;
+  }
+
+  size_t count = 0;
+  for (size_t i = 0; i < len; i++) {
+    count += lines->text[i] == '\n';
+  }
+  if (len > 0 && lines->text[len - 1] != '\n') {
+    count++;
+  }
+  lines->starts = malloc((count + 1) * sizeof(char *));
+  lines->lens = malloc((count + 1) * sizeof(size_t));
+  if (lines->starts == NULL || lines->lens == NULL) {
+    free_lines(lines);
+    return -1;
+  }
+  const char *p = lines->text;
+  const char *end = lines->text + len;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    if (nl == NULL) {
+      nl = end;
+    }
+    lines->starts[lines->count] = p;
+    lines->lens[lines->count] = nl - p;
+    lines->count++;
+    p = nl + 1;
+  }
+  return 0;
+}
+
+// Maps the rest of stdin, if it's a file that hasn't been decompressed.
+// Returns the mapping, and where the rest starts in it, or MAP_FAILED.
+static
+void *map_stdin(size_t *map_len, size_t *start) {
+  struct stat st;
+  if (input != stdin || fstat(STDIN_FILENO, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return MAP_FAILED;
+  }
+  off_t offset = ftello(stdin);
+  if (offset < 0 || offset > st.st_size) {
+    return MAP_FAILED;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+  if (map != MAP_FAILED) {
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    *map_len = st.st_size;
+    *start = offset;
+  }
+  return map;
+}
+
+// Filters a file mapped in one go, a terminal a line at a time, and
+// anything else in blocks of whole lines
+static
+int filter_text(void) {
+  size_t map_len;
+  size_t start;
+  void *map = map_stdin(&map_len, &start);
+  if (map != MAP_FAILED) {
+    int res = haskell_filter((char *) map + start, map_len - start, STDOUT_FILENO);
+    munmap(map, map_len);
+    if (res) {
+      perror("failed to write output");
+      return 1;
+    }
+    return 0;
+  }
+  bool tty = isatty(fileno(input));
+  size_t size = 1 << 20;
+  char *buf = malloc(size);
+  size_t len = 0;
+  int res = 0;
+  while (buf != NULL) {
+    size_t n;
+    if (tty) {
+      ssize_t line_len = getline(&buf, &size, input);
+      n = line_len > 0 ? line_len : 0;
+    } else {
+      n = fread(buf + len, 1, size - len, input);
+    }
+    if (n == 0 && ferror(input)) {
+      perror("failed to read input");
+      res = 1;
+      break;
+    }
+    len += n;
+    // Up to the end of the last whole line, or everything, at the end.
+    // getline reads whole lines.
+    size_t done = len;
+    if (n > 0 && !tty) {
+      while (done > 0 && buf[done - 1] != '\n') {
+        done--;
+      }
+    }
+    if (done == 0 && len == size) {
+      char *bigger = realloc(buf, size * 2);
+      if (bigger == NULL) {
+        perror("failed to read input");
+        res = 1;
+        break;
+      }
+      buf = bigger;
+      size *= 2;
+      continue;
+    }
+    if (done > 0 && haskell_filter(buf, done, STDOUT_FILENO)) {
+      perror("failed to write output");
+      res = 1;
+      break;
+    }
+    len -= done;
+    memmove(buf, buf + done, len);
+    if (n == 0) {
+      break;
+    }
+  }
+  if (buf == NULL) {
+    perror("failed to read input");
+    res = 1;
+  }
+  free(buf);
+  return res;
+}
+
+// Demangles every line into the file at `path`, written in place through a
+// mapping, by every thread
+static
+int demangle_to_file(const char *path) {
+  // Truncating the input would pull the pages out from under its mapping
+  struct stat in_st;
+  struct stat out_st;
+  if (
+    fstat(STDIN_FILENO, &in_st) == 0
+    && stat(path, &out_st) == 0
+    && in_st.st_dev == out_st.st_dev
+    && in_st.st_ino == out_st.st_ino
+  ) {
+    fprintf(stderr, "%s: can't write over the input\n", path);
+    return 1;
+  }
+  size_t map_len;
+  size_t start;
+  void *map = map_stdin(&map_len, &start);
+  char *text;
+  size_t len;
+  if (map != MAP_FAILED) {
+    text = (char *) map + start;
+    len = map_len - start;
+  } else {
+    text = read_all(input, &len);
+    if (text == NULL) {
+      perror("failed to read input");
+      return 1;
+    }
+  }
+  int res = 0;
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || haskell_demangle_lines_to_fd(text, len, 0, fd) || close(fd)) {
+    perror(path);
+    res = 1;
+  }
+  if (map != MAP_FAILED) {
+    munmap(map, map_len);
+  } else {
+    free(text);
+  }
+  return res;
+}
+
+static
+int write_columnar(const char *path) {
+  struct lines lines;
+  if (read_lines(input, &lines)) {
+    perror("failed to read input");
+    return 1;
+  }
+  struct haskell_batch batch;
+  if (haskell_demangle_batch_parallel(lines.starts, lines.lens, lines.count, &haskell_default_batch_options, &batch)) {
+    perror("failed to demangle");
+    free_lines(&lines);
+    return 1;
+  }
+  free_lines(&lines);
+  int res = 0;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || haskell_batch_write_columnar(&batch, fd) || close(fd)) {
+    perror(path);
+    res = 1;
+  }
+  haskell_batch_free(&batch);
+  return res;
+}
+
+static
+int write_trie(const char *path) {
+  struct lines lines;
+  if (read_lines(input, &lines)) {
+    perror("failed to read input");
+    return 1;
+  }
+  struct haskell_batch batch;
+  if (haskell_demangle_batch_parallel(lines.starts, lines.lens, lines.count, &haskell_default_batch_options, &batch)) {
+    perror("failed to demangle");
+    free_lines(&lines);
+    return 1;
+  }
+  free_lines(&lines);
+  int res = 0;
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || haskell_batch_write_trie(&batch, fd) || close(fd)) {
+    perror(path);
+    res = 1;
+  }
+  haskell_batch_free(&batch);
+  return res;
+}
+
+static
+int complete(const char *path) {
+  struct haskell_trie trie;
+  if (haskell_trie_open(path, &trie)) {
+    fprintf(stderr, "%s: not a trie file\n", path);
+    return 1;
+  }
+  struct lines lines;
+  if (read_lines(input, &lines)) {
+    perror("failed to read input");
+    haskell_trie_close(&trie);
+    return 1;
+  }
+  int res = 0;
+  for (size_t i = 0; i < lines.count && res == 0; i++) {
+    struct haskell_trie_iter it;
+    if (haskell_trie_iter_init(&it, &trie, lines.starts[i], lines.lens[i], true)) {
+      perror("failed to query");
+      res = 1;
+      break;
+    }
+    while (haskell_trie_iter_next(&it)) {
+      printf("%s %llu\n", it.name, (unsigned long long) it.count);
+    }
+    haskell_trie_iter_free(&it);
+  }
+  free_lines(&lines);
+  haskell_trie_close(&trie);
+  return res;
+}
+
+// Parses hex addresses, one per line
+static
+uint64_t *read_addresses(const struct lines *lines) {
+  uint64_t *addresses = malloc((lines->count + 1) * sizeof(uint64_t));
+  if (addresses == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < lines->count; i++) {
+    // The lines aren't NUL-terminated
+    char address[32] = { 0 };
+    memcpy(address, lines->starts[i], lines->lens[i] < 31 ? lines->lens[i] : 31);
+    addresses[i] = strtoull(address, NULL, 16);
+  }
+  return addresses;
+}
+
+// Writes "name (file:line)" for each symbol, leaving out what isn't known
+static
+void write_symbols(const struct haskell_dwarf_symbol *symbols, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    const struct haskell_dwarf_symbol *s = &symbols[i];
+    if (s->function != NULL) {
+      printf("%.*s", (int) s->function->name_len, s->function->name);
+    } else {
+      fputs("??", stdout);
+    }
+    if (s->file != NULL) {
+      printf(" (%.*s:%u)", (int) s->file_len, s->file, (unsigned) s->line);
+    }
+    putchar('\n');
+  }
+}
+
+static
+int symbolize(const char *path) {
+  struct haskell_dwarf_index index;
+  if (haskell_dwarf_index_open(path, 0, &index)) {
+    fprintf(stderr, "%s: can't read debug info or symbols\n", path);
+    return 1;
+  }
+  struct lines lines;
+  if (read_lines(input, &lines)) {
+    perror("failed to read input");
+    haskell_dwarf_index_close(&index);
+    return 1;
+  }
+  uint64_t *addresses = read_addresses(&lines);
+  struct haskell_dwarf_symbol *symbols = malloc((lines.count + 1) * sizeof(struct haskell_dwarf_symbol));
+  int res = 0;
+  if (addresses == NULL || symbols == NULL) {
+    perror("failed to symbolize");
+    res = 1;
+  } else {
+    haskell_dwarf_index_symbolize(&index, addresses, lines.count, symbols);
+    write_symbols(symbols, lines.count);
+  }
+  free(addresses);
+  free(symbols);
+  free_lines(&lines);
+  haskell_dwarf_index_close(&index);
+  return res;
+}
+
+static
+int symbolize_pid(const char *pid) {
+  struct lines lines;
+  if (read_lines(input, &lines)) {
+    perror("failed to read input");
+    return 1;
+  }
+  struct haskell_symbolizer *symbolizer = haskell_symbolizer_new();
+  uint64_t *addresses = read_addresses(&lines);
+  struct haskell_dwarf_symbol *symbols = malloc((lines.count + 1) * sizeof(struct haskell_dwarf_symbol));
+  int res = 0;
+  if (symbolizer == NULL || addresses == NULL || symbols == NULL) {
+    perror("failed to symbolize");
+    res = 1;
+  } else if (haskell_symbolizer_resolve(symbolizer, atoi(pid), addresses, lines.count, symbols)) {
+    fprintf(stderr, "%s: can't read the process's mappings\n", pid);
+    res = 1;
+  } else {
+    write_symbols(symbols, lines.count);
+  }
+  haskell_symbolizer_free(symbolizer);
+  free(addresses);
+  free(symbols);
+  free_lines(&lines);
+  return res;
+}
+
+static
+int list_dwarf(const char *path) {
+  struct haskell_dwarf_index index;
+  if (haskell_dwarf_index_open(path, 0, &index)) {
+    fprintf(stderr, "%s: can't read debug info or symbols\n", path);
+    return 1;
+  }
+  for (size_t i = 0; i < index.count; i++) {
+    const struct haskell_dwarf_function *f = &index.functions[i];
+    printf("%016llx %016llx %.*s\n", (unsigned long long) f->low_pc, (unsigned long long) f->high_pc, (int) f->name_len, f->name);
+  }
+  haskell_dwarf_index_close(&index);
+  return 0;
+}
+
+static
+int diff_symbols(const char *old_path, const char *new_path, bool normalize) {
+  struct haskell_symbol_diff_options options = haskell_default_symbol_diff_options;
+  options.normalize = normalize;
+  struct haskell_symbol_diff diff;
+  if (haskell_symbol_diff(old_path, new_path, &options, &diff)) {
+    fprintf(stderr, "can't read the symbol tables of %s and %s\n", old_path, new_path);
+    return 1;
+  }
+  for (size_t i = 0; i < diff.count; i++) {
+    const struct haskell_symbol_change *c = &diff.changes[i];
+    if (
+      i == 0
+      || c->module_len != c[-1].module_len
+      || memcmp(c->module, c[-1].module, c->module_len) != 0
+    ) {
+      if (c->module_len > 0) {
+        printf("%.*s\n", (int) c->module_len, c->module);
+      } else {
+        puts("(no module)");
+      }
+    }
+    // Names are shown without their module
+    const char *name = c->name;
+    size_t name_len = c->name_len;
+    if (c->module_len > 0 && name_len > c->module_len && memcmp(name, c->module, c->module_len) == 0) {
+      name += c->module_len + 1;
+      name_len -= c->module_len + 1;
+    }
+    switch (c->kind) {
+      case HASKELL_SYMBOL_ADDED:
+        printf("  + %.*s %llu\n", (int) name_len, name, (unsigned long long) c->new_size);
+        break;
+      case HASKELL_SYMBOL_REMOVED:
+        printf("  - %.*s %llu\n", (int) name_len, name, (unsigned long long) c->old_size);
+        break;
+      case HASKELL_SYMBOL_RESIZED:
+        printf(
+          "  ~ %.*s %llu -> %llu\n",
+          (int) name_len,
+          name,
+          (unsigned long long) c->old_size,
+          (unsigned long long) c->new_size
+        );
+        break;
+    }
+  }
+  haskell_symbol_diff_free(&diff);
+  return 0;
+}
+
+// Sums the profile given with the option, and the ones after the options
+static
+int ticky(const char *first, const char *const *rest, size_t rest_count, bool by_module) {
+  const char **paths = malloc((rest_count + 1) * sizeof(char *));
+  if (paths == NULL) {
+    perror("can't read ticky profiles");
+    return 1;
+  }
+  paths[0] = first;
+  memcpy(&paths[1], rest, rest_count * sizeof(char *));
+  struct haskell_ticky_options options = haskell_default_ticky_options;
+  options.by_module = by_module;
+  struct haskell_ticky report;
+  int res = haskell_ticky_merge(paths, rest_count + 1, &options, &report);
+  free(paths);
+  if (res) {
+    perror("can't read ticky profiles");
+    return 1;
+  }
+  printf("%12s %14s %14s  %s\n", "Entries", "Alloc", "Alloc'd", by_module ? "Module" : "Binder");
+  for (size_t i = 0; i < report.count; i++) {
+    const struct haskell_ticky_entry *e = &report.entries[i];
+    printf(
+      "%12llu %14llu %14llu  ",
+      (unsigned long long) e->entries,
+      (unsigned long long) e->alloc,
+      (unsigned long long) e->allocd
+    );
+    if (by_module && e->module_len == 0) {
+      puts("(no module)");
+    } else if (by_module) {
+      printf("%.*s\n", (int) e->module_len, e->module);
+    } else if (e->module_len > 0) {
+      printf("%.*s.%.*s\n", (int) e->module_len, e->module, (int) e->binder_len, e->binder);
+    } else {
+      printf("%.*s\n", (int) e->binder_len, e->binder);
+    }
+  }
+  haskell_ticky_free(&report);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  enum {
+    mode_lines,
+    mode_dict,
+    mode_dict_decode,
+    mode_unique,
+    mode_top,
+    mode_columnar,
+    mode_trie,
+    mode_complete,
+    mode_dwarf,
+    mode_symbolize,
+    mode_pid,
+    mode_perf,
+    mode_diff,
+    mode_filter,
+    mode_ticky,
+  } mode = mode_lines;
+  const char *path = NULL;
+  size_t top_k = 0;
+  bool normalize = true;
+  bool exact = false;
+  bool by_module = false;
+  const char *output = NULL;
+
+  static const struct option options[] = {
+    { "dict", no_argument, NULL, 'd' },
+    { "dict-decode", no_argument, NULL, 'D' },
+    { "unique", no_argument, NULL, 'u' },
+    { "top", required_argument, NULL, 'k' },
+    { "exact", no_argument, NULL, 'e' },
+    { "columnar", required_argument, NULL, 'c' },
+    { "trie", required_argument, NULL, 't' },
+    { "complete", required_argument, NULL, 'C' },
+    { "dwarf", required_argument, NULL, 'w' },
+    { "symbolize", required_argument, NULL, 's' },
+    { "pid", required_argument, NULL, 'P' },
+    { "perf", required_argument, NULL, 'p' },
+    { "diff", required_argument, NULL, 'f' },
+    { "no-normalize", no_argument, NULL, 'N' },
+    { "filter", no_argument, NULL, 'F' },
+    { "output", required_argument, NULL, 'o' },
+    { "ticky", required_argument, NULL, 'T' },
+    { "by-module", no_argument, NULL, 'M' },
+    { NULL, 0, NULL, 0 }
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "o:", options, NULL)) != -1) {
+    switch (opt) {
+      case 'd':
+        mode = mode_dict;
+        break;
+      case 'D':
+        mode = mode_dict_decode;
+        break;
+      case 'u':
+        mode = mode_unique;
+        break;
+      case 'k':
+        mode = mode_top;
+        if (parse_count(optarg, &top_k)) {
+          fprintf(stderr, "--top needs a positive count, not \"%s\"\n", optarg);
+          return 2;
+        }
+        break;
+      case 'e':
+        exact = true;
+        break;
+      case 'c':
+        mode = mode_columnar;
+        path = optarg;
+        break;
+      case 't':
+        mode = mode_trie;
+        path = optarg;
+        break;
+      case 'C':
+        mode = mode_complete;
+        path = optarg;
+        break;
+      case 'w':
+        mode = mode_dwarf;
+        path = optarg;
+        break;
+      case 's':
+        mode = mode_symbolize;
+        path = optarg;
+        break;
+      case 'P':
+        mode = mode_pid;
+        path = optarg;
+        break;
+      case 'p':
+        mode = mode_perf;
+        path = optarg;
+        break;
+      case 'f':
+        mode = mode_diff;
+        path = optarg;
+        break;
+      case 'N':
+        normalize = false;
+        break;
+      case 'F':
+        mode = mode_filter;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      case 'T':
+        mode = mode_ticky;
+        path = optarg;
+        break;
+      case 'M':
+        by_module = true;
+        break;
+      default:
+        return 2;
+    }
+  }
+
+  if (output != NULL && mode != mode_lines) {
+    fputs("-o can't be used with another mode\n", stderr);
+    return 2;
+  }
+
+  bool reads_stdin = mode != mode_dwarf && mode != mode_perf && mode != mode_diff
+    && mode != mode_ticky;
+  if (reads_stdin) {
+    input = haskell_open_input(stdin, 0);
+    if (input == NULL) {
+      if (errno == ENOTSUP) {
+        fputs("this build can't read compressed input\n", stderr);
+      } else {
+        perror("failed to read input");
+      }
+      return 1;
+    }
+  }
+
+  switch (mode) {
+    case mode_dict:
+      return dict_encode_lines();
+    case mode_dict_decode:
+      if (haskell_dict_decode(input, stdout)) {
+        fputs("malformed dictionary stream\n", stderr);
+        return 1;
+      }
+      return 0;
+    case mode_unique:
+      return unique_lines();
+    case mode_top:
+      return top_lines(top_k, exact);
+    case mode_columnar:
+      return write_columnar(path);
+    case mode_trie:
+      return write_trie(path);
+    case mode_complete:
+      return complete(path);
+    case mode_dwarf:
+      return list_dwarf(path);
+    case mode_symbolize:
+      return symbolize(path);
+    case mode_pid:
+      return symbolize_pid(path);
+    case mode_perf:
+      if (haskell_perf_fold(path, stdout)) {
+        fprintf(stderr, "%s: can't read perf data\n", path);
+        return 1;
+      }
+      return 0;
+    case mode_diff:
+      if (optind >= argc) {
+        fputs("--diff needs two files\n", stderr);
+        return 2;
+      }
+      return diff_symbols(path, argv[optind], normalize);
+    case mode_filter:
+      return filter_text();
+    case mode_ticky:
+      return ticky(path, (const char *const *) &argv[optind], argc - optind, by_module);
+    default:
+      return output != NULL ? demangle_to_file(output) : demangle_lines();
+  }
+}
@@ -0,0 +1,712 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Bulk operations that use threads.
+
+Sorting: each thread keys and sorts a run of the input, then runs are merged
+in pairs, in parallel, until one remains. Keys hold the first eight
+demangled bytes, so names are only decoded past that when their keys are
+equal.
+
+Batch demangling: each thread measures the exact demangled length of its
+share of the symbols, then a prefix sum over those gives every symbol its
+final offset, and each thread demangles straight into place. The output is
+allocated once, at exactly the right size. Symbols can be visited in order
+of address, so that reading them walks forward through the string table;
+the lengths and offsets are still laid out by index. With dedup, symbols
+are interned first, and only the distinct ones are demangled.
+
+Demangling lines of text to a file works the same way, a share of whole
+lines to a thread, except that only each share's total is measured. The
+file is then sized to the exact total, mapped, and each thread demangles
+its lines straight into its region of the mapping. Nothing passes through
+a stdio buffer, or a write.
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "demangle-ghc-internal.h"
+
+struct sort_entry {
+  uint64_t key;
+  const char *symbol;
+};
+
+struct sort_job {
+  struct sort_entry *src;
+  struct sort_entry *dst;
+  size_t start;
+  size_t middle;
+  size_t end;
+};
+
+static
+int sort_entry_cmp(const void *a, const void *b) {
+  const struct sort_entry *x = a;
+  const struct sort_entry *y = b;
+  if (x->key != y->key) {
+    return x->key < y->key ? -1 : 1;
+  }
+  return haskell_demangled_cmp(x->symbol, y->symbol);
+}
+
+static
+void *sort_run(void *arg) {
+  struct sort_job *job = arg;
+  for (size_t i = job->start; i < job->end; i++) {
+    job->src[i].key = haskell_demangled_key(job->src[i].symbol);
+  }
+  qsort(&job->src[job->start], job->end - job->start, sizeof(struct sort_entry), sort_entry_cmp);
+  return NULL;
+}
+
+static
+void *merge_runs(void *arg) {
+  struct sort_job *job = arg;
+  size_t i = job->start;
+  size_t j = job->middle;
+  size_t out = job->start;
+  while (i < job->middle && j < job->end) {
+    if (sort_entry_cmp(&job->src[j], &job->src[i]) < 0) {
+      job->dst[out++] = job->src[j++];
+    } else {
+      job->dst[out++] = job->src[i++];
+    }
+  }
+  memcpy(&job->dst[out], &job->src[i], (job->middle - i) * sizeof(struct sort_entry));
+  out += job->middle - i;
+  memcpy(&job->dst[out], &job->src[j], (job->end - j) * sizeof(struct sort_entry));
+  return NULL;
+}
+
+int
+haskell_run_jobs(void *(*fn)(void *), void *jobs, size_t job_size, size_t count)
+{
+  pthread_t *threads = malloc(count * sizeof(pthread_t));
+  if (threads == NULL) {
+    return -1;
+  }
+  size_t started = 1;
+  for (; started < count; started++) {
+    if (pthread_create(&threads[started], NULL, fn, (char *) jobs + started * job_size) != 0) {
+      break;
+    }
+  }
+  fn(jobs);
+  // If a thread couldn't be started, do its work here
+  for (size_t i = started; i < count; i++) {
+    fn((char *) jobs + i * job_size);
+  }
+  for (size_t i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  return 0;
+}
+
+unsigned
+haskell_default_threads(unsigned threads)
+{
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > 0 ? cpus : 1;
+  }
+  return threads;
+}
+
+int
+haskell_sort_demangled(const char **symbols, size_t count, unsigned threads)
+{
+  threads = haskell_default_threads(threads);
+  // Not worth a thread for fewer than this
+  const size_t min_run = 4096;
+  size_t runs = count / min_run;
+  if (runs > threads) {
+    runs = threads;
+  }
+  if (runs == 0) {
+    runs = 1;
+  }
+
+  struct sort_entry *entries = malloc(2 * count * sizeof(struct sort_entry));
+  struct sort_job *jobs = malloc(runs * sizeof(struct sort_job));
+  if (entries == NULL || jobs == NULL) {
+    free(entries);
+    free(jobs);
+    return -1;
+  }
+  struct sort_entry *src = entries;
+  struct sort_entry *dst = entries + count;
+  for (size_t i = 0; i < count; i++) {
+    src[i].symbol = symbols[i];
+  }
+
+  // Run boundaries, which merging keeps halving the number of
+  size_t *bounds = malloc((runs + 1) * sizeof(size_t));
+  if (bounds == NULL) {
+    free(entries);
+    free(jobs);
+    return -1;
+  }
+  for (size_t i = 0; i < runs; i++) {
+    bounds[i] = count * i / runs;
+    jobs[i] = (struct sort_job) {
+      .src = src,
+      .start = bounds[i],
+      .end = count * (i + 1) / runs
+    };
+  }
+  bounds[runs] = count;
+  int res = haskell_run_jobs(sort_run, jobs, sizeof(struct sort_job), runs);
+
+  while (res == 0 && runs > 1) {
+    size_t pairs = runs / 2;
+    for (size_t i = 0; i < pairs; i++) {
+      jobs[i] = (struct sort_job) {
+        .src = src,
+        .dst = dst,
+        .start = bounds[2 * i],
+        .middle = bounds[2 * i + 1],
+        .end = bounds[2 * i + 2]
+      };
+    }
+    res = haskell_run_jobs(merge_runs, jobs, sizeof(struct sort_job), pairs);
+    // An odd run out is carried over as it is
+    if (runs % 2 == 1) {
+      size_t start = bounds[runs - 1];
+      memcpy(&dst[start], &src[start], (count - start) * sizeof(struct sort_entry));
+    }
+    for (size_t i = 0; i <= pairs; i++) {
+      bounds[i] = bounds[2 * i < runs ? 2 * i : runs];
+    }
+    runs = (runs + 1) / 2;
+    bounds[runs] = count;
+    struct sort_entry *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+
+  if (res == 0) {
+    for (size_t i = 0; i < count; i++) {
+      symbols[i] = src[i].symbol;
+    }
+  }
+  free(bounds);
+  free(jobs);
+  free(entries);
+  return res;
+}
+
+const struct haskell_batch_options haskell_default_batch_options = {
+  .threads = 0,
+  .prefetch = 8,
+  .address_order = false,
+  .dedup = false
+};
+
+// Returns the indices of symbols, sorted by the symbols' addresses, using
+// an LSD radix sort on their offsets from the lowest.
+static
+size_t *address_order(const char *const *symbols, size_t count) {
+  struct keyed {
+    uintptr_t key;
+    size_t index;
+  };
+  struct keyed *keys = malloc(2 * count * sizeof(struct keyed));
+  size_t *order = malloc(count * sizeof(size_t));
+  if (keys == NULL || order == NULL) {
+    free(keys);
+    free(order);
+    return NULL;
+  }
+  uintptr_t min = UINTPTR_MAX;
+  uintptr_t max = 0;
+  for (size_t i = 0; i < count; i++) {
+    uintptr_t addr = (uintptr_t) symbols[i];
+    min = addr < min ? addr : min;
+    max = addr > max ? addr : max;
+  }
+  struct keyed *src = keys;
+  struct keyed *dst = keys + count;
+  for (size_t i = 0; i < count; i++) {
+    src[i] = (struct keyed) { (uintptr_t) symbols[i] - min, i };
+  }
+
+  enum { digit_bits = 11, buckets = 1 << digit_bits };
+  static_assert(buckets <= 4096, "histogram lives on the stack");
+  for (unsigned shift = 0; count > 0 && ((max - min) >> shift) != 0; shift += digit_bits) {
+    size_t histogram[buckets] = { 0 };
+    for (size_t i = 0; i < count; i++) {
+      histogram[(src[i].key >> shift) & (buckets - 1)]++;
+    }
+    size_t sum = 0;
+    for (size_t b = 0; b < buckets; b++) {
+      size_t n = histogram[b];
+      histogram[b] = sum;
+      sum += n;
+    }
+    for (size_t i = 0; i < count; i++) {
+      dst[histogram[(src[i].key >> shift) & (buckets - 1)]++] = src[i];
+    }
+    struct keyed *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+  for (size_t i = 0; i < count; i++) {
+    order[i] = src[i].index;
+  }
+  free(keys);
+  return order;
+}
+
+struct batch_job {
+  const char *const *symbols;
+  const size_t *lens;
+  struct haskell_batch *out;
+  // The symbols to visit are order[visit_start..visit_end), or
+  // visit_start..visit_end if there's no order
+  const size_t *order;
+  size_t visit_start;
+  size_t visit_end;
+  unsigned prefetch;
+  // The offsets this job places. A multiple of eight, so that each job has
+  // bytes of the bitmap to itself, when symbols are visited in order.
+  size_t start;
+  size_t end;
+  // Demangled bytes and nulls in this job's share, then where they start
+  size_t data_len;
+  size_t null_count;
+  size_t data_start;
+  int error;
+};
+
+static
+size_t symbol_len(const struct batch_job *job, size_t i) {
+  return job->lens == NULL ? strlen(job->symbols[i]) : job->lens[i];
+}
+
+static inline
+size_t visit(const struct batch_job *job, size_t k) {
+  return job->order == NULL ? k : job->order[k];
+}
+
+// Symbols are usually scattered through a large string table, so each
+// one is a cache miss, unless it's asked for a few symbols in advance.
+// This returns which symbol to ask for, or NULL. The prefetch itself has
+// to be in the loop: GCC counts a function that only prefetches as pure,
+// and drops calls to it.
+static inline
+const char *symbol_ahead(const struct batch_job *job, size_t k) {
+  if (job->prefetch == 0 || k + job->prefetch >= job->visit_end) {
+    return NULL;
+  }
+  return job->symbols[visit(job, k + job->prefetch)];
+}
+
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void) (p))
+#endif
+
+// First pass: exact lengths, which are parked in offsets[i + 1]
+static
+void *measure_symbols(void *arg) {
+  struct batch_job *job = arg;
+  struct haskell_batch *out = job->out;
+  for (size_t k = job->visit_start; k < job->visit_end; k++) {
+    const char *ahead = symbol_ahead(job, k);
+    if (ahead != NULL) {
+      PREFETCH(ahead);
+    }
+    size_t i = visit(job, k);
+    size_t len;
+    if (haskell_demangled_length(job->symbols[i], symbol_len(job, i), &haskell_default_limits, &len) == HASKELL_DEMANGLE_OK) {
+      if (job->order == NULL) {
+        out->validity[i / 8] |= 1 << (i % 8);
+      } else {
+        __atomic_fetch_or(&out->validity[i / 8], 1 << (i % 8), __ATOMIC_RELAXED);
+      }
+    } else {
+      // Nulls take up no space
+      len = 0;
+      job->null_count++;
+    }
+    out->offsets[i + 1] = len;
+  }
+  return NULL;
+}
+
+// Second pass, in two halves: sums this share's lengths, then, once every
+// share knows where it starts, turns them into offsets
+static
+void *sum_symbols(void *arg) {
+  struct batch_job *job = arg;
+  for (size_t i = job->start; i < job->end; i++) {
+    job->data_len += job->out->offsets[i + 1];
+  }
+  return NULL;
+}
+
+static
+void *place_symbols(void *arg) {
+  struct batch_job *job = arg;
+  int64_t offset = job->data_start;
+  for (size_t i = job->start; i < job->end; i++) {
+    offset += job->out->offsets[i + 1];
+    job->out->offsets[i + 1] = offset;
+  }
+  return NULL;
+}
+
+// Third pass: demangles each symbol into its slot
+static
+void *write_symbols(void *arg) {
+  struct batch_job *job = arg;
+  struct haskell_batch *out = job->out;
+  for (size_t k = job->visit_start; k < job->visit_end; k++) {
+    const char *ahead = symbol_ahead(job, k);
+    if (ahead != NULL) {
+      PREFETCH(ahead);
+    }
+    size_t i = visit(job, k);
+    if ((out->validity[i / 8] & (1 << (i % 8))) == 0) {
+      continue;
+    }
+    size_t slot = out->offsets[i + 1] - out->offsets[i];
+    size_t written;
+    enum haskell_demangle_error error = haskell_demangle_into(
+      job->symbols[i],
+      symbol_len(job, i),
+      &haskell_default_limits,
+      &out->data[out->offsets[i]],
+      slot,
+      &written
+    );
+    if (error != HASKELL_DEMANGLE_OK || written != slot) {
+      // The two passes disagree, which is a bug
+      job->error = -1;
+    }
+  }
+  return NULL;
+}
+
+// Interns the symbols, demangles the distinct ones, then turns the
+// entries' validity into the symbols'
+static
+int demangle_distinct(
+  const char *const *symbols,
+  const size_t *lens,
+  size_t count,
+  const struct haskell_batch_options *options,
+  struct haskell_batch *out
+) {
+  struct haskell_batch_options distinct_options = *options;
+  distinct_options.dedup = false;
+  // Interned strings are already back to back
+  distinct_options.address_order = false;
+  *out = (struct haskell_batch) { .count = count };
+
+  struct haskell_intern *table = haskell_intern_new();
+  uint32_t *indices = malloc(count * sizeof(uint32_t));
+  uint8_t *validity = calloc((count + 7) / 8, 1);
+  const char **distinct = NULL;
+  size_t *distinct_lens = NULL;
+  if (table == NULL || indices == NULL || validity == NULL) {
+    goto fail;
+  }
+  for (size_t i = 0; i < count; i++) {
+    size_t len = lens == NULL ? strlen(symbols[i]) : lens[i];
+    bool added;
+    indices[i] = haskell_intern_add(table, symbols[i], len, &added);
+    if (indices[i] == HASKELL_INTERN_ERROR) {
+      goto fail;
+    }
+  }
+  size_t entries = haskell_intern_count(table);
+  distinct = malloc(entries * sizeof(char *));
+  distinct_lens = malloc(entries * sizeof(size_t));
+  if ((distinct == NULL || distinct_lens == NULL) && entries > 0) {
+    goto fail;
+  }
+  for (size_t id = 0; id < entries; id++) {
+    distinct[id] = haskell_intern_get(table, id, &distinct_lens[id]);
+  }
+  if (haskell_demangle_batch_parallel(distinct, distinct_lens, entries, &distinct_options, out)) {
+    goto fail;
+  }
+
+  size_t null_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t id = indices[i];
+    if (out->validity[id / 8] & (1 << (id % 8))) {
+      validity[i / 8] |= 1 << (i % 8);
+    } else {
+      null_count++;
+    }
+  }
+  free(out->validity);
+  out->count = count;
+  out->null_count = null_count;
+  out->validity = validity;
+  out->indices = indices;
+  free(distinct);
+  free(distinct_lens);
+  haskell_intern_free(table);
+  return 0;
+
+fail:
+  free(indices);
+  free(validity);
+  free(distinct);
+  free(distinct_lens);
+  haskell_intern_free(table);
+  return -1;
+}
+
+int
+haskell_demangle_batch_parallel(
+  const char *const *symbols,
+  const size_t *lens,
+  size_t count,
+  const struct haskell_batch_options *options,
+  struct haskell_batch *out
+) {
+  if (options->dedup) {
+    return demangle_distinct(symbols, lens, count, options, out);
+  }
+  *out = (struct haskell_batch) { .count = count, .entries = count };
+  unsigned threads = haskell_default_threads(options->threads);
+  // Not worth a thread for fewer than this
+  const size_t min_share = 4096;
+  size_t shares = count / min_share;
+  if (shares > threads) {
+    shares = threads;
+  }
+  // With one share, measuring first only costs a second pass over the
+  // symbols, and the sequential batch is about three times as fast
+  if (shares <= 1) {
+    return haskell_demangle_batch(symbols, lens, count, out);
+  }
+
+  size_t *order = NULL;
+  if (options->address_order) {
+    order = address_order(symbols, count);
+    if (order == NULL) {
+      return -1;
+    }
+  }
+  struct batch_job *jobs = calloc(shares, sizeof(struct batch_job));
+  out->validity = calloc((count + 7) / 8, 1);
+  out->offsets = malloc((count + 1) * sizeof(int64_t));
+  if (jobs == NULL || out->validity == NULL || out->offsets == NULL) {
+    goto fail;
+  }
+  out->offsets[0] = 0;
+  for (size_t i = 0; i < shares; i++) {
+    size_t start = count * i / shares / 8 * 8;
+    size_t end = i + 1 == shares ? count : count * (i + 1) / shares / 8 * 8;
+    jobs[i] = (struct batch_job) {
+      .symbols = symbols,
+      .lens = lens,
+      .out = out,
+      .order = order,
+      .visit_start = start,
+      .visit_end = end,
+      .prefetch = options->prefetch,
+      .start = start,
+      .end = end
+    };
+  }
+
+  if (
+    haskell_run_jobs(measure_symbols, jobs, sizeof(struct batch_job), shares)
+    || haskell_run_jobs(sum_symbols, jobs, sizeof(struct batch_job), shares)
+  ) {
+    goto fail;
+  }
+  size_t data_len = 0;
+  for (size_t i = 0; i < shares; i++) {
+    jobs[i].data_start = data_len;
+    data_len += jobs[i].data_len;
+    out->null_count += jobs[i].null_count;
+  }
+  out->data_len = data_len;
+  out->data = malloc(data_len > 0 ? data_len : 1);
+  if (
+    out->data == NULL
+    || haskell_run_jobs(place_symbols, jobs, sizeof(struct batch_job), shares)
+    || haskell_run_jobs(write_symbols, jobs, sizeof(struct batch_job), shares)
+  ) {
+    goto fail;
+  }
+  for (size_t i = 0; i < shares; i++) {
+    if (jobs[i].error) {
+      goto fail;
+    }
+  }
+  free(jobs);
+  free(order);
+  return 0;
+
+fail:
+  free(jobs);
+  free(order);
+  haskell_batch_free(out);
+  return -1;
+}
+
+struct text_job {
+  const char *start;
+  const char *end;
+  // Output bytes in this job's lines, then where they go
+  size_t out_len;
+  char *out;
+  int error;
+};
+
+// Gives the next line, and how long it is without its newline
+static inline
+const char *next_line(const char *p, const char *end, size_t *len) {
+  const char *nl = memchr(p, '\n', end - p);
+  *len = (nl == NULL ? end : nl) - p;
+  return nl == NULL ? end : nl + 1;
+}
+
+static
+void *measure_text(void *arg) {
+  struct text_job *job = arg;
+  for (const char *p = job->start; p < job->end;) {
+    size_t len;
+    const char *next = next_line(p, job->end, &len);
+    size_t demangled;
+    if (haskell_demangled_length(p, len, &haskell_default_limits, &demangled) != HASKELL_DEMANGLE_OK) {
+      demangled = len;
+    }
+    job->out_len += demangled + (size_t) (next - p - len);
+    p = next;
+  }
+  return NULL;
+}
+
+static
+void *write_text(void *arg) {
+  struct text_job *job = arg;
+  char *out = job->out;
+  for (const char *p = job->start; p < job->end;) {
+    size_t len;
+    const char *next = next_line(p, job->end, &len);
+    size_t room = job->out + job->out_len - out;
+    size_t written;
+    enum haskell_demangle_error error = haskell_demangle_into(
+      p, len, &haskell_default_limits, out, room, &written
+    );
+    // Lines that don't demangle are written as they are, which only fits
+    // if measuring them fell back too
+    if (error != HASKELL_DEMANGLE_OK) {
+      if (len > room) {
+        job->error = -1;
+        return NULL;
+      }
+      memcpy(out, p, len);
+      written = len;
+    }
+    out += written;
+    if (next > p + len) {
+      if (out == job->out + job->out_len) {
+        job->error = -1;
+        return NULL;
+      }
+      *out++ = '\n';
+    }
+    p = next;
+  }
+  if (out != job->out + job->out_len) {
+    // The two passes disagree, which is a bug
+    job->error = -1;
+  }
+  return NULL;
+}
+
+int
+haskell_demangle_lines_to_fd(const char *text, size_t len, unsigned threads, int fd)
+{
+  threads = haskell_default_threads(threads);
+  // Not worth a thread for less than this
+  const size_t min_share = 1 << 16;
+  size_t shares = len / min_share;
+  if (shares > threads) {
+    shares = threads;
+  }
+  if (shares == 0) {
+    shares = 1;
+  }
+  struct text_job *jobs = calloc(shares, sizeof(struct text_job));
+  if (jobs == NULL) {
+    return -1;
+  }
+  // Shares end at line ends
+  const char *end = text + len;
+  const char *p = text;
+  for (size_t i = 0; i < shares; i++) {
+    const char *share_end = i + 1 == shares ? end : text + len * (i + 1) / shares;
+    if (share_end < p) {
+      share_end = p;
+    }
+    const char *nl = share_end < end ? memchr(share_end, '\n', end - share_end) : NULL;
+    if (share_end < end) {
+      share_end = nl == NULL ? end : nl + 1;
+    }
+    jobs[i] = (struct text_job) { .start = p, .end = share_end };
+    p = share_end;
+  }
+
+  int res = -1;
+  char *map = MAP_FAILED;
+  size_t out_len = 0;
+  if (haskell_run_jobs(measure_text, jobs, sizeof(struct text_job), shares)) {
+    goto done;
+  }
+  for (size_t i = 0; i < shares; i++) {
+    out_len += jobs[i].out_len;
+  }
+  if (ftruncate(fd, out_len)) {
+    goto done;
+  }
+  if (out_len == 0) {
+    res = 0;
+    goto done;
+  }
+  map = mmap(NULL, out_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    goto done;
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < shares; i++) {
+    jobs[i].out = map + offset;
+    offset += jobs[i].out_len;
+  }
+  if (haskell_run_jobs(write_text, jobs, sizeof(struct text_job), shares)) {
+    goto done;
+  }
+  res = 0;
+  for (size_t i = 0; i < shares; i++) {
+    if (jobs[i].error) {
+      errno = EINVAL;
+      res = -1;
+    }
+  }
+
+done:
+  if (map != MAP_FAILED) {
+    munmap(map, out_len);
+  }
+  free(jobs);
+  return res;
+}
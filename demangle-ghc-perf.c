@@ -0,0 +1,618 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Folded stacks straight from perf.data, instead of through `perf script`,
+a stack collapsing script, and the demangler.
+
+Only file-mode perf.data (the "PERFILE2" header, not a pipe) is read.
+Samples must all have the same sample_type. The records used are:
+
+  PERF_RECORD_COMM             a thread's name, the root of its stacks
+  PERF_RECORD_MMAP, MMAP2      which file each address range came from
+  PERF_RECORD_SAMPLE           the IP, or the callchain if there is one
+
+Everything else is skipped. A newer mapping replaces any older ones it
+overlaps, in the same process. Each mapped file's DWARF index is opened
+the first time one of its addresses is sampled, which falls back to the
+file's symbol table when it has no debug info. Addresses that aren't in a
+mapping, or in a function of its file, fold to "[unknown]", and so do
+threads without a name.
+
+Stacks are counted by sample, keyed on their thread's name and the
+functions they pass through, so a stack is only rendered once, however
+often it was sampled.
+*/
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "demangle-ghc.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "perf.data is read straight from memory, which must be little-endian"
+#endif
+
+#define PERF_MAGIC 0x32454c4946524550ull
+
+#define PERF_RECORD_MMAP 1
+#define PERF_RECORD_COMM 3
+#define PERF_RECORD_SAMPLE 9
+#define PERF_RECORD_MMAP2 10
+
+#define PERF_SAMPLE_IP (1u << 0)
+#define PERF_SAMPLE_TID (1u << 1)
+#define PERF_SAMPLE_TIME (1u << 2)
+#define PERF_SAMPLE_ADDR (1u << 3)
+#define PERF_SAMPLE_READ (1u << 4)
+#define PERF_SAMPLE_CALLCHAIN (1u << 5)
+#define PERF_SAMPLE_ID (1u << 6)
+#define PERF_SAMPLE_CPU (1u << 7)
+#define PERF_SAMPLE_PERIOD (1u << 8)
+#define PERF_SAMPLE_STREAM_ID (1u << 9)
+#define PERF_SAMPLE_IDENTIFIER (1u << 16)
+
+#define PERF_FORMAT_TOTAL_TIME_ENABLED (1u << 0)
+#define PERF_FORMAT_TOTAL_TIME_RUNNING (1u << 1)
+#define PERF_FORMAT_ID (1u << 2)
+#define PERF_FORMAT_GROUP (1u << 3)
+#define PERF_FORMAT_LOST (1u << 4)
+
+// Callchain entries from here up mark a switch between kernel and user
+// space, rather than being addresses
+#define PERF_CONTEXT_MAX ((uint64_t) -4095)
+
+// Kernel mappings are recorded under this pid
+#define KERNEL_PID UINT32_MAX
+
+#define UNKNOWN "[unknown]"
+
+struct perf_file_section {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct perf_file_header {
+  uint64_t magic;
+  uint64_t size;
+  uint64_t attr_size;
+  struct perf_file_section attrs;
+  struct perf_file_section data;
+  struct perf_file_section event_types;
+  uint64_t features[4];
+};
+
+struct perf_event_header {
+  uint32_t type;
+  uint16_t misc;
+  uint16_t size;
+};
+
+struct perf_map {
+  uint32_t pid;
+  uint64_t start;
+  uint64_t end;
+  uint64_t pgoff;
+  // ID of the file's name, in perf_state.files
+  uint32_t file;
+};
+
+struct perf_comm {
+  uint32_t tid;
+  // ID of the name, in perf_state.comms
+  uint32_t comm;
+};
+
+// A mapped file's index, opened the first time it's needed
+struct perf_elf {
+  enum { ELF_UNOPENED, ELF_FAILED, ELF_OPEN } state;
+  struct haskell_dwarf_index index;
+};
+
+struct perf_state {
+  // Sorted by pid, then start, and never overlapping within a pid
+  struct perf_map *maps;
+  size_t map_count;
+  size_t map_capacity;
+  // Sorted by tid
+  struct perf_comm *threads;
+  size_t thread_count;
+  size_t thread_capacity;
+  struct haskell_intern *comms;
+  struct haskell_intern *files;
+  // By file ID
+  struct perf_elf *elves;
+  size_t elf_count;
+  // Keys are a comm ID, then a function pointer per frame, root first,
+  // with NULL for unknown frames
+  struct haskell_intern *stacks;
+  uint64_t *counts;
+  size_t count_capacity;
+  // Scratch space for building keys
+  const void **frames;
+  size_t frame_capacity;
+};
+
+// Grows an array to hold at least `count` elements
+// true signals an error
+static
+bool reserve(void **array, size_t *capacity, size_t count, size_t size) {
+  if (count <= *capacity) {
+    return false;
+  }
+  size_t new_capacity = *capacity ? *capacity : 64;
+  while (new_capacity < count) {
+    new_capacity *= 2;
+  }
+  void *new_array = realloc(*array, new_capacity * size);
+  if (new_array == NULL) {
+    return true;
+  }
+  *array = new_array;
+  *capacity = new_capacity;
+  return false;
+}
+
+static
+int map_before(const struct perf_map *map, uint32_t pid, uint64_t start) {
+  return map->pid < pid || (map->pid == pid && map->start < start);
+}
+
+// The first map at or after (pid, start)
+static
+size_t map_search(const struct perf_state *st, uint32_t pid, uint64_t start) {
+  size_t lo = 0;
+  size_t hi = st->map_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (map_before(&st->maps[mid], pid, start)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// true signals an error
+static
+bool add_map(struct perf_state *st, struct perf_map map) {
+  if (map.end <= map.start) {
+    return false;
+  }
+  // Drop the older mappings this one overlaps
+  size_t first = map_search(st, map.pid, map.start);
+  if (first > 0 && st->maps[first - 1].pid == map.pid && st->maps[first - 1].end > map.start) {
+    first--;
+  }
+  size_t last = first;
+  while (last < st->map_count && st->maps[last].pid == map.pid && st->maps[last].start < map.end) {
+    last++;
+  }
+  if (reserve((void **) &st->maps, &st->map_capacity, st->map_count - (last - first) + 1, sizeof(struct perf_map))) {
+    return true;
+  }
+  memmove(&st->maps[first + 1], &st->maps[last], (st->map_count - last) * sizeof(struct perf_map));
+  st->maps[first] = map;
+  st->map_count = st->map_count - (last - first) + 1;
+  return false;
+}
+
+static
+const struct perf_map *find_map(const struct perf_state *st, uint32_t pid, uint64_t address) {
+  // The map after the last one starting at or before the address
+  size_t i = map_search(st, pid, address);
+  if (i < st->map_count && st->maps[i].pid == pid && st->maps[i].start == address) {
+    return &st->maps[i];
+  }
+  if (i > 0 && st->maps[i - 1].pid == pid && address < st->maps[i - 1].end) {
+    return &st->maps[i - 1];
+  }
+  return NULL;
+}
+
+static
+size_t thread_search(const struct perf_state *st, uint32_t tid) {
+  size_t lo = 0;
+  size_t hi = st->thread_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (st->threads[mid].tid < tid) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// true signals an error
+static
+bool set_comm(struct perf_state *st, uint32_t tid, const char *name, size_t len) {
+  bool added;
+  uint32_t comm = haskell_intern_add(st->comms, name, len, &added);
+  if (comm == HASKELL_INTERN_ERROR) {
+    return true;
+  }
+  size_t i = thread_search(st, tid);
+  if (i < st->thread_count && st->threads[i].tid == tid) {
+    st->threads[i].comm = comm;
+    return false;
+  }
+  if (reserve((void **) &st->threads, &st->thread_capacity, st->thread_count + 1, sizeof(struct perf_comm))) {
+    return true;
+  }
+  memmove(&st->threads[i + 1], &st->threads[i], (st->thread_count - i) * sizeof(struct perf_comm));
+  st->threads[i] = (struct perf_comm) { tid, comm };
+  st->thread_count++;
+  return false;
+}
+
+// The ID of a thread's name, or HASKELL_INTERN_ERROR
+static
+uint32_t find_comm(const struct perf_state *st, uint32_t tid) {
+  size_t i = thread_search(st, tid);
+  if (i < st->thread_count && st->threads[i].tid == tid) {
+    return st->threads[i].comm;
+  }
+  return HASKELL_INTERN_ERROR;
+}
+
+// The function containing a sampled address, or NULL
+static
+const struct haskell_dwarf_function *resolve(struct perf_state *st, uint32_t pid, uint64_t address) {
+  const struct perf_map *map = find_map(st, pid, address);
+  if (map == NULL) {
+    map = find_map(st, KERNEL_PID, address);
+  }
+  if (map == NULL || map->file >= st->elf_count) {
+    return NULL;
+  }
+  struct perf_elf *elf = &st->elves[map->file];
+  if (elf->state == ELF_UNOPENED) {
+    size_t len;
+    const char *name = haskell_intern_get(st->files, map->file, &len);
+    // Interned names aren't NUL-terminated
+    char *path = strndup(name, len);
+    elf->state = path != NULL && haskell_dwarf_index_open(path, 0, &elf->index) == 0 ? ELF_OPEN : ELF_FAILED;
+    free(path);
+  }
+  if (elf->state != ELF_OPEN) {
+    return NULL;
+  }
+  uint64_t file_address = haskell_dwarf_index_address(&elf->index, address - map->start + map->pgoff);
+  return haskell_dwarf_index_lookup(&elf->index, file_address);
+}
+
+// true signals an error
+static
+bool read_map(struct perf_state *st, const uint8_t *record, size_t size, bool mmap2) {
+  // pid, tid, addr, len, pgoff, then for MMAP2, a device and inode or a
+  // build ID, then prot and flags
+  size_t name_at = mmap2 ? 72 : 40;
+  if (size < name_at + 1) {
+    return true;
+  }
+  uint32_t pid;
+  uint64_t start, len, pgoff;
+  memcpy(&pid, record + 8, 4);
+  memcpy(&start, record + 16, 8);
+  memcpy(&len, record + 24, 8);
+  memcpy(&pgoff, record + 32, 8);
+  const char *name = (const char *) record + name_at;
+  const char *nul = memchr(name, '\0', size - name_at);
+  if (nul == NULL) {
+    return true;
+  }
+  bool added;
+  uint32_t file = haskell_intern_add(st->files, name, nul - name, &added);
+  if (file == HASKELL_INTERN_ERROR) {
+    return true;
+  }
+  if (added) {
+    struct perf_elf *elves = realloc(st->elves, (st->elf_count + 1) * sizeof(struct perf_elf));
+    if (elves == NULL) {
+      return true;
+    }
+    st->elves = elves;
+    st->elves[st->elf_count++] = (struct perf_elf) { .state = ELF_UNOPENED };
+  }
+  return add_map(st, (struct perf_map) { pid, start, start + len, pgoff, file });
+}
+
+// The size of a sample's PERF_SAMPLE_READ field
+static
+size_t read_size(uint64_t read_format, const uint8_t *p, const uint8_t *end) {
+  size_t value_size = 8 * (1 + !!(read_format & PERF_FORMAT_ID) + !!(read_format & PERF_FORMAT_LOST));
+  size_t times = 8 * (!!(read_format & PERF_FORMAT_TOTAL_TIME_ENABLED) + !!(read_format & PERF_FORMAT_TOTAL_TIME_RUNNING));
+  if ((read_format & PERF_FORMAT_GROUP) == 0) {
+    return value_size + times;
+  }
+  uint64_t nr;
+  if (end - p < 8) {
+    return SIZE_MAX;
+  }
+  memcpy(&nr, p, 8);
+  if (nr > (size_t) (end - p) / value_size) {
+    return SIZE_MAX;
+  }
+  return 8 + times + nr * value_size;
+}
+
+// true signals an error
+static
+bool read_sample(
+  struct perf_state *st,
+  const uint8_t *record,
+  size_t size,
+  uint64_t sample_type,
+  uint64_t read_format
+) {
+  const uint8_t *p = record + sizeof(struct perf_event_header);
+  const uint8_t *end = record + size;
+  uint64_t ip = 0;
+  uint32_t pid = UINT32_MAX;
+  uint32_t tid = UINT32_MAX;
+#define SKIP(n) do { \
+    size_t skip_ = (n); \
+    if ((size_t) (end - p) < skip_) { \
+      return true; \
+    } \
+    p += skip_; \
+  } while (0)
+  if (sample_type & PERF_SAMPLE_IDENTIFIER) {
+    SKIP(8);
+  }
+  if (sample_type & PERF_SAMPLE_IP) {
+    SKIP(8);
+    memcpy(&ip, p - 8, 8);
+  }
+  if (sample_type & PERF_SAMPLE_TID) {
+    SKIP(8);
+    memcpy(&pid, p - 8, 4);
+    memcpy(&tid, p - 4, 4);
+  }
+  SKIP(8 * (
+    !!(sample_type & PERF_SAMPLE_TIME)
+    + !!(sample_type & PERF_SAMPLE_ADDR)
+    + !!(sample_type & PERF_SAMPLE_ID)
+    + !!(sample_type & PERF_SAMPLE_STREAM_ID)
+    + !!(sample_type & PERF_SAMPLE_CPU)
+    + !!(sample_type & PERF_SAMPLE_PERIOD)
+  ));
+  if (sample_type & PERF_SAMPLE_READ) {
+    SKIP(read_size(read_format, p, end));
+  }
+  const uint8_t *chain = (const uint8_t *) &ip;
+  uint64_t chain_len = sample_type & PERF_SAMPLE_IP ? 1 : 0;
+  if (sample_type & PERF_SAMPLE_CALLCHAIN) {
+    SKIP(8);
+    memcpy(&chain_len, p - 8, 8);
+    if (chain_len > (size_t) (end - p) / 8) {
+      return true;
+    }
+    chain = p;
+  }
+#undef SKIP
+
+  // The callchain is innermost first, and keys are outermost first
+  if (reserve((void **) &st->frames, &st->frame_capacity, chain_len + 1, sizeof(void *))) {
+    return true;
+  }
+  st->frames[0] = (const void *) (uintptr_t) find_comm(st, tid);
+  size_t frame_count = 1;
+  for (uint64_t i = chain_len; i-- > 0; ) {
+    uint64_t address;
+    memcpy(&address, chain + i * 8, 8);
+    if (address >= PERF_CONTEXT_MAX) {
+      continue;
+    }
+    st->frames[frame_count++] = resolve(st, pid, address);
+  }
+  bool added;
+  uint32_t id = haskell_intern_add(st->stacks, (const char *) st->frames, frame_count * sizeof(void *), &added);
+  if (
+    id == HASKELL_INTERN_ERROR
+    || reserve((void **) &st->counts, &st->count_capacity, (size_t) id + 1, sizeof(uint64_t))
+  ) {
+    return true;
+  }
+  if (added) {
+    st->counts[id] = 0;
+  }
+  st->counts[id]++;
+  return false;
+}
+
+struct folded {
+  char *stack;
+  uint64_t count;
+};
+
+static
+int folded_cmp(const void *a, const void *b) {
+  return strcmp(((const struct folded *) a)->stack, ((const struct folded *) b)->stack);
+}
+
+// Renders each distinct stack, and writes them in order
+// true signals an error
+static
+bool write_folded(const struct perf_state *st, FILE *out) {
+  size_t count = haskell_intern_count(st->stacks);
+  struct folded *folded = calloc(count + 1, sizeof(struct folded));
+  if (folded == NULL) {
+    return true;
+  }
+  bool error = false;
+  for (size_t id = 0; id < count && !error; id++) {
+    size_t key_len;
+    const char *key = haskell_intern_get(st->stacks, id, &key_len);
+    size_t frame_count = key_len / sizeof(void *);
+    char *stack = NULL;
+    size_t stack_len = 0;
+    FILE *f = open_memstream(&stack, &stack_len);
+    if (f == NULL) {
+      error = true;
+      break;
+    }
+    const void *first;
+    memcpy(&first, key, sizeof(void *));
+    uint32_t comm = (uintptr_t) first;
+    if (comm == HASKELL_INTERN_ERROR) {
+      fputs(UNKNOWN, f);
+    } else {
+      size_t len;
+      const char *name = haskell_intern_get(st->comms, comm, &len);
+      fwrite(name, 1, len, f);
+    }
+    for (size_t i = 1; i < frame_count; i++) {
+      const struct haskell_dwarf_function *function;
+      memcpy(&function, key + i * sizeof(void *), sizeof(void *));
+      fputc(';', f);
+      if (function == NULL) {
+        fputs(UNKNOWN, f);
+      } else {
+        fwrite(function->name, 1, function->name_len, f);
+      }
+    }
+    error = fclose(f) != 0;
+    folded[id] = (struct folded) { stack, st->counts[id] };
+  }
+  if (!error) {
+    qsort(folded, count, sizeof(struct folded), folded_cmp);
+    for (size_t i = 0; i < count; i++) {
+      fprintf(out, "%s %llu\n", folded[i].stack, (unsigned long long) folded[i].count);
+    }
+    error = ferror(out);
+  }
+  for (size_t i = 0; i < count; i++) {
+    free(folded[i].stack);
+  }
+  free(folded);
+  return error;
+}
+
+static
+void free_state(struct perf_state *st) {
+  for (size_t i = 0; i < st->elf_count; i++) {
+    if (st->elves[i].state == ELF_OPEN) {
+      haskell_dwarf_index_close(&st->elves[i].index);
+    }
+  }
+  free(st->elves);
+  free(st->maps);
+  free(st->threads);
+  free(st->counts);
+  free(st->frames);
+  haskell_intern_free(st->comms);
+  haskell_intern_free(st->files);
+  haskell_intern_free(st->stacks);
+}
+
+static
+bool section_in(const struct perf_file_section *section, size_t len) {
+  return section->offset <= len && section->size <= len - section->offset;
+}
+
+int
+haskell_perf_fold(const char *path, FILE *out)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st_buf;
+  if (fstat(fd, &st_buf) != 0 || (size_t) st_buf.st_size < sizeof(struct perf_file_header)) {
+    close(fd);
+    return -1;
+  }
+  size_t len = st_buf.st_size;
+  const uint8_t *file = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    return -1;
+  }
+
+  struct perf_state st = { 0 };
+  st.comms = haskell_intern_new();
+  st.files = haskell_intern_new();
+  st.stacks = haskell_intern_new();
+  if (st.comms == NULL || st.files == NULL || st.stacks == NULL) {
+    goto fail;
+  }
+
+  struct perf_file_header header;
+  memcpy(&header, file, sizeof(header));
+  if (
+    header.magic != PERF_MAGIC
+    || header.attr_size < 48 + sizeof(struct perf_file_section)
+    || !section_in(&header.attrs, len)
+    || !section_in(&header.data, len)
+    || header.attrs.size < header.attr_size
+  ) {
+    goto fail;
+  }
+  // perf_event_attr: type, size, config, sample_period, sample_type,
+  // read_format, ...
+  uint64_t sample_type, read_format;
+  memcpy(&sample_type, file + header.attrs.offset + 24, 8);
+  memcpy(&read_format, file + header.attrs.offset + 32, 8);
+  for (uint64_t i = 1; i < header.attrs.size / header.attr_size; i++) {
+    uint64_t other;
+    memcpy(&other, file + header.attrs.offset + i * header.attr_size + 24, 8);
+    if (other != sample_type) {
+      goto fail;
+    }
+  }
+
+  const uint8_t *p = file + header.data.offset;
+  const uint8_t *end = p + header.data.size;
+  while ((size_t) (end - p) >= sizeof(struct perf_event_header)) {
+    struct perf_event_header event;
+    memcpy(&event, p, sizeof(event));
+    if (event.size < sizeof(event) || event.size > end - p) {
+      goto fail;
+    }
+    bool error = false;
+    switch (event.type) {
+      case PERF_RECORD_MMAP:
+      case PERF_RECORD_MMAP2:
+        error = read_map(&st, p, event.size, event.type == PERF_RECORD_MMAP2);
+        break;
+      case PERF_RECORD_COMM: {
+        // pid, tid, then the name
+        const char *name = (const char *) p + 16;
+        const char *nul = event.size > 16 ? memchr(name, '\0', event.size - 16) : NULL;
+        if (nul == NULL) {
+          error = true;
+          break;
+        }
+        uint32_t tid;
+        memcpy(&tid, p + 12, 4);
+        error = set_comm(&st, tid, name, nul - name);
+        break;
+      }
+      case PERF_RECORD_SAMPLE:
+        error = read_sample(&st, p, event.size, sample_type, read_format);
+        break;
+    }
+    if (error) {
+      goto fail;
+    }
+    p += event.size;
+  }
+  if (write_folded(&st, out)) {
+    goto fail;
+  }
+  free_state(&st);
+  munmap((void *) file, len);
+  return 0;
+
+fail:
+  free_state(&st);
+  munmap((void *) file, len);
+  return -1;
+}
@@ -0,0 +1,371 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Symbolization of running processes.
+
+For each process, the text of /proc/PID/maps is kept, along with its
+executable, file-backed mappings. Each call reads the text again, and
+only when it differs are the mappings parsed and resolved to files again.
+Reading it costs far less than the lookups it saves.
+
+Files are cached by device and inode, as the maps file gives them, and
+then by build ID, so the same binary in two containers, at two paths,
+shares one index. A mapping's file is opened by its path if that is still
+the same inode, and otherwise through /proc/PID/map_files, which also
+covers files that have since been deleted or replaced. Files are counted
+by the mappings that use them, and closed when none do. Files that can't
+be indexed are cached too, so they aren't read again.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "demangle-ghc.h"
+
+struct elf_entry {
+  bool ok;
+  struct haskell_dwarf_index index;
+  uint8_t build_id[HASKELL_BUILD_ID_MAX];
+  // Zero if the file has none, in which case it's never shared by it
+  size_t build_id_len;
+  unsigned major;
+  unsigned minor;
+  uint64_t inode;
+  // Mappings using this
+  size_t refs;
+};
+
+struct proc_mapping {
+  uint64_t start;
+  uint64_t end;
+  uint64_t offset;
+  struct elf_entry *elf;
+};
+
+struct proc_entry {
+  int pid;
+  char *maps;
+  size_t maps_len;
+  // Sorted by start, as the maps file is
+  struct proc_mapping *mappings;
+  size_t count;
+};
+
+struct haskell_symbolizer {
+  struct elf_entry **elves;
+  size_t elf_count;
+  struct proc_entry *procs;
+  size_t proc_count;
+};
+
+struct haskell_symbolizer *
+haskell_symbolizer_new(void)
+{
+  return calloc(1, sizeof(struct haskell_symbolizer));
+}
+
+static
+void release_elf(struct haskell_symbolizer *s, struct elf_entry *elf) {
+  if (--elf->refs > 0) {
+    return;
+  }
+  for (size_t i = 0; i < s->elf_count; i++) {
+    if (s->elves[i] == elf) {
+      s->elves[i] = s->elves[--s->elf_count];
+      break;
+    }
+  }
+  if (elf->ok) {
+    haskell_dwarf_index_close(&elf->index);
+  }
+  free(elf);
+}
+
+static
+void release_mappings(struct haskell_symbolizer *s, struct proc_entry *proc) {
+  for (size_t i = 0; i < proc->count; i++) {
+    release_elf(s, proc->mappings[i].elf);
+  }
+  free(proc->mappings);
+  proc->mappings = NULL;
+  proc->count = 0;
+}
+
+void
+haskell_symbolizer_forget(struct haskell_symbolizer *s, int pid)
+{
+  for (size_t i = 0; i < s->proc_count; i++) {
+    if (s->procs[i].pid == pid) {
+      release_mappings(s, &s->procs[i]);
+      free(s->procs[i].maps);
+      s->procs[i] = s->procs[--s->proc_count];
+      return;
+    }
+  }
+}
+
+void
+haskell_symbolizer_free(struct haskell_symbolizer *s)
+{
+  if (s == NULL) {
+    return;
+  }
+  while (s->proc_count > 0) {
+    haskell_symbolizer_forget(s, s->procs[0].pid);
+  }
+  free(s->procs);
+  free(s->elves);
+  free(s);
+}
+
+// Reads all of a file that can't be stat'd for its size
+static
+char *read_file(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  size_t capacity = 4096;
+  size_t used = 0;
+  char *buf = malloc(capacity);
+  while (buf != NULL) {
+    ssize_t n = read(fd, &buf[used], capacity - used);
+    if (n < 0) {
+      free(buf);
+      buf = NULL;
+      break;
+    }
+    if (n == 0) {
+      break;
+    }
+    used += n;
+    if (used == capacity) {
+      capacity *= 2;
+      char *grown = realloc(buf, capacity);
+      if (grown == NULL) {
+        free(buf);
+      }
+      buf = grown;
+    }
+  }
+  close(fd);
+  *len = used;
+  return buf;
+}
+
+// Finds or opens the file behind a mapping, taking a reference to it
+static
+struct elf_entry *acquire_elf(
+  struct haskell_symbolizer *s,
+  int pid,
+  const char *path,
+  uint64_t start,
+  uint64_t end,
+  unsigned major,
+  unsigned minor,
+  uint64_t inode
+) {
+  for (size_t i = 0; i < s->elf_count; i++) {
+    struct elf_entry *elf = s->elves[i];
+    if (elf->inode == inode && elf->major == major && elf->minor == minor) {
+      elf->refs++;
+      return elf;
+    }
+  }
+
+  // The path may name a different file by now
+  char map_file[64];
+  snprintf(map_file, sizeof(map_file), "/proc/%d/map_files/%llx-%llx", pid, (unsigned long long) start, (unsigned long long) end);
+  struct stat st;
+  if (
+    stat(path, &st) != 0
+    || st.st_ino != inode
+    || major(st.st_dev) != major
+    || minor(st.st_dev) != minor
+  ) {
+    path = map_file;
+  }
+
+  struct elf_entry *elf = calloc(1, sizeof(struct elf_entry));
+  if (elf == NULL) {
+    return NULL;
+  }
+  elf->major = major;
+  elf->minor = minor;
+  elf->inode = inode;
+  elf->refs = 1;
+  if (haskell_elf_build_id(path, elf->build_id, &elf->build_id_len) == 0) {
+    for (size_t i = 0; i < s->elf_count; i++) {
+      struct elf_entry *other = s->elves[i];
+      if (
+        other->build_id_len == elf->build_id_len
+        && memcmp(other->build_id, elf->build_id, elf->build_id_len) == 0
+      ) {
+        free(elf);
+        other->refs++;
+        return other;
+      }
+    }
+  } else {
+    elf->build_id_len = 0;
+  }
+  elf->ok = haskell_dwarf_index_open(path, 0, &elf->index) == 0;
+
+  struct elf_entry **elves = realloc(s->elves, (s->elf_count + 1) * sizeof(struct elf_entry *));
+  if (elves == NULL) {
+    if (elf->ok) {
+      haskell_dwarf_index_close(&elf->index);
+    }
+    free(elf);
+    return NULL;
+  }
+  s->elves = elves;
+  s->elves[s->elf_count++] = elf;
+  return elf;
+}
+
+// Parses a process's maps, resolving each executable, file-backed
+// mapping to its file
+// true signals an error
+static
+bool read_mappings(struct haskell_symbolizer *s, struct proc_entry *proc) {
+  size_t capacity = 0;
+  const char *line = proc->maps;
+  const char *end = proc->maps + proc->maps_len;
+  while (line < end) {
+    const char *nl = memchr(line, '\n', end - line);
+    if (nl == NULL) {
+      nl = end;
+    }
+    // start-end perms offset major:minor inode path
+    char text[4096 + 128];
+    size_t len = nl - line < (ptrdiff_t) sizeof(text) - 1 ? (size_t) (nl - line) : sizeof(text) - 1;
+    memcpy(text, line, len);
+    text[len] = '\0';
+    line = nl + 1;
+
+    unsigned long long start, map_end, offset, inode;
+    char perms[5];
+    unsigned major, minor;
+    int path_at = 0;
+    if (
+      sscanf(text, "%llx-%llx %4s %llx %x:%x %llu %n", &start, &map_end, perms, &offset, &major, &minor, &inode, &path_at) < 7
+      || path_at == 0
+      || perms[2] != 'x'
+      || inode == 0
+      || text[path_at] != '/'
+    ) {
+      continue;
+    }
+    char *path = &text[path_at];
+    // Deleted files are found through map_files instead
+    size_t path_len = strlen(path);
+    const char deleted[] = " (deleted)";
+    if (path_len > sizeof(deleted) - 1 && strcmp(&path[path_len - sizeof(deleted) + 1], deleted) == 0) {
+      path[path_len - sizeof(deleted) + 1] = '\0';
+    }
+
+    if (proc->count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      struct proc_mapping *mappings = realloc(proc->mappings, capacity * sizeof(struct proc_mapping));
+      if (mappings == NULL) {
+        return true;
+      }
+      proc->mappings = mappings;
+    }
+    struct elf_entry *elf = acquire_elf(s, proc->pid, path, start, map_end, major, minor, inode);
+    if (elf == NULL) {
+      return true;
+    }
+    proc->mappings[proc->count++] = (struct proc_mapping) { start, map_end, offset, elf };
+  }
+  return false;
+}
+
+// The process's entry, with its mappings up to date, or NULL
+static
+struct proc_entry *refresh(struct haskell_symbolizer *s, int pid) {
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+  size_t maps_len;
+  char *maps = read_file(path, &maps_len);
+  if (maps == NULL) {
+    return NULL;
+  }
+  struct proc_entry *proc = NULL;
+  for (size_t i = 0; i < s->proc_count; i++) {
+    if (s->procs[i].pid == pid) {
+      proc = &s->procs[i];
+    }
+  }
+  if (proc != NULL && proc->maps_len == maps_len && memcmp(proc->maps, maps, maps_len) == 0) {
+    free(maps);
+    return proc;
+  }
+  if (proc == NULL) {
+    struct proc_entry *procs = realloc(s->procs, (s->proc_count + 1) * sizeof(struct proc_entry));
+    if (procs == NULL) {
+      free(maps);
+      return NULL;
+    }
+    s->procs = procs;
+    proc = &s->procs[s->proc_count++];
+    *proc = (struct proc_entry) { .pid = pid };
+  }
+
+  // Take the new mappings' references before dropping the old ones, so
+  // that files still mapped aren't closed and opened again
+  struct proc_entry old = *proc;
+  *proc = (struct proc_entry) { .pid = pid, .maps = maps, .maps_len = maps_len };
+  bool error = read_mappings(s, proc);
+  release_mappings(s, &old);
+  free(old.maps);
+  if (error) {
+    haskell_symbolizer_forget(s, pid);
+    return NULL;
+  }
+  return proc;
+}
+
+int
+haskell_symbolizer_resolve(
+  struct haskell_symbolizer *s,
+  int pid,
+  const uint64_t *addresses,
+  size_t count,
+  struct haskell_dwarf_symbol *out
+) {
+  struct proc_entry *proc = refresh(s, pid);
+  if (proc == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    out[i] = (struct haskell_dwarf_symbol) { 0 };
+    // The last mapping starting at or before the address
+    size_t lo = 0;
+    size_t hi = proc->count;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (proc->mappings[mid].start <= addresses[i]) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo == 0) {
+      continue;
+    }
+    const struct proc_mapping *m = &proc->mappings[lo - 1];
+    if (addresses[i] >= m->end || !m->elf->ok) {
+      continue;
+    }
+    uint64_t address = haskell_dwarf_index_address(&m->elf->index, addresses[i] - m->start + m->offset);
+    haskell_dwarf_index_symbolize(&m->elf->index, &address, 1, &out[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,454 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Front-coded store of demangled names.
+
+Names are sorted, deduplicated, and cut into blocks. Within a block, each
+name after the first is written as how many bytes it shares with the one
+before, then the rest:
+
+  head   varint prefix ID (zero for none, or n for prefix n - 1)
+         varint suffix length, suffix bytes
+  other  varint shared length
+         varint suffix length, suffix bytes
+
+All varints are unsigned LEB128. The block offsets are the sparse index:
+a lookup binary searches the blocks' heads, then scans one block, and so
+is O(log n).
+
+Heads can't be front coded against each other without losing random
+access, so with the prefix dictionary, each head's leading module path
+(up to a '.' or '_' it shares with a neighbouring head) is replaced by
+the ID of that prefix.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "demangle-ghc-internal.h"
+
+const struct haskell_store_options haskell_default_store_options = {
+  .block_size = 16,
+  .prefix_dictionary = true
+};
+
+// Prefixes shorter than this aren't worth an entry
+#define MIN_PREFIX 4
+
+struct haskell_store {
+  uint8_t *data;
+  size_t data_len;
+  // Where each block starts in data, and then where the data ends
+  uint64_t *blocks;
+  size_t block_count;
+  size_t count;
+  unsigned block_size;
+  // The longest name, so that iterators never need to grow
+  size_t max_len;
+  // NULL without the prefix dictionary
+  struct haskell_intern *prefixes;
+};
+
+int
+haskell_name_cmp(const void *a, const void *b)
+{
+  const struct haskell_name *x = a;
+  const struct haskell_name *y = b;
+  size_t len = x->len < y->len ? x->len : y->len;
+  int cmp = memcmp(x->str, y->str, len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  return (x->len > y->len) - (x->len < y->len);
+}
+
+struct haskell_name *
+haskell_sorted_names(const struct haskell_batch *batch, size_t *count, size_t *max_len)
+{
+  struct haskell_name *names = malloc((batch->count + 1) * sizeof(struct haskell_name));
+  if (names == NULL) {
+    return NULL;
+  }
+  size_t n = 0;
+  *max_len = 0;
+  for (size_t i = 0; i < batch->count; i++) {
+    names[n].str = haskell_batch_get(batch, i, &names[n].len);
+    if (names[n].str != NULL) {
+      if (names[n].len > *max_len) {
+        *max_len = names[n].len;
+      }
+      n++;
+    }
+  }
+  qsort(names, n, sizeof(struct haskell_name), haskell_name_cmp);
+  size_t unique = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (unique == 0 || haskell_name_cmp(&names[unique - 1], &names[i]) != 0) {
+      names[unique++] = names[i];
+    }
+  }
+  *count = unique;
+  return names;
+}
+
+static
+size_t common_prefix(const struct haskell_name *a, const struct haskell_name *b) {
+  size_t len = a->len < b->len ? a->len : b->len;
+  size_t i = 0;
+  while (i < len && a->str[i] == b->str[i]) {
+    i++;
+  }
+  return i;
+}
+
+// Shortens a shared prefix to end just after a module path separator
+static
+size_t module_prefix(const struct haskell_name *name, size_t shared) {
+  while (shared > 0 && name->str[shared - 1] != '.' && name->str[shared - 1] != '_') {
+    shared--;
+  }
+  return shared;
+}
+
+bool
+haskell_out_reserve(struct haskell_out_buf *out, size_t n)
+{
+  if (out->capacity - out->len >= n) {
+    return false;
+  }
+  size_t capacity = out->capacity ? out->capacity : 4096;
+  while (capacity - out->len < n) {
+    capacity *= 2;
+  }
+  uint8_t *data = realloc(out->data, capacity);
+  if (data == NULL) {
+    return true;
+  }
+  out->data = data;
+  out->capacity = capacity;
+  return false;
+}
+
+void
+haskell_out_varint(struct haskell_out_buf *out, uint64_t n)
+{
+  do {
+    uint8_t byte = n & 0x7F;
+    n >>= 7;
+    out->data[out->len++] = byte | (n != 0 ? 0x80 : 0);
+  } while (n != 0);
+}
+
+// Within a store, so never past its end
+static
+uint64_t get_varint(const uint8_t **p) {
+  uint64_t n = 0;
+  for (unsigned shift = 0; ; shift += 7) {
+    uint8_t byte = *(*p)++;
+    n |= (uint64_t) (byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return n;
+    }
+  }
+}
+
+// true signals an error
+static
+bool put_name(struct haskell_out_buf *out, uint64_t first, const char *suffix, size_t len) {
+  if (haskell_out_reserve(out, 20 + len)) {
+    return true;
+  }
+  haskell_out_varint(out, first);
+  haskell_out_varint(out, len);
+  memcpy(&out->data[out->len], suffix, len);
+  out->len += len;
+  return false;
+}
+
+struct haskell_store *
+haskell_store_build(const struct haskell_batch *batch, const struct haskell_store_options *options)
+{
+  struct haskell_store *store = calloc(1, sizeof(struct haskell_store));
+  size_t count = 0;
+  struct haskell_name *names = store != NULL ? haskell_sorted_names(batch, &count, &store->max_len) : NULL;
+  struct haskell_out_buf out = { 0 };
+  if (store == NULL || names == NULL) {
+    goto fail;
+  }
+  store->block_size = options->block_size > 0 ? options->block_size : 16;
+  store->count = count;
+
+  store->block_count = (count + store->block_size - 1) / store->block_size;
+  store->blocks = malloc((store->block_count + 1) * sizeof(uint64_t));
+  if (store->blocks == NULL) {
+    goto fail;
+  }
+  if (options->prefix_dictionary) {
+    store->prefixes = haskell_intern_new();
+    if (store->prefixes == NULL) {
+      goto fail;
+    }
+  }
+
+  for (size_t b = 0; b < store->block_count; b++) {
+    store->blocks[b] = out.len;
+    size_t start = b * store->block_size;
+    size_t end = start + store->block_size < count ? start + store->block_size : count;
+
+    const struct haskell_name *head = &names[start];
+    size_t prefix_len = 0;
+    uint64_t prefix_id = 0;
+    if (store->prefixes != NULL) {
+      // The longer of what it shares with the heads either side
+      size_t before = b > 0 ? common_prefix(head, &names[start - store->block_size]) : 0;
+      size_t after = end < count ? common_prefix(head, &names[end]) : 0;
+      prefix_len = module_prefix(head, before > after ? before : after);
+      if (prefix_len >= MIN_PREFIX) {
+        bool added;
+        uint32_t id = haskell_intern_add(store->prefixes, head->str, prefix_len, &added);
+        if (id == HASKELL_INTERN_ERROR) {
+          goto fail;
+        }
+        prefix_id = (uint64_t) id + 1;
+      } else {
+        prefix_len = 0;
+      }
+    }
+    if (put_name(&out, prefix_id, head->str + prefix_len, head->len - prefix_len)) {
+      goto fail;
+    }
+    for (size_t i = start + 1; i < end; i++) {
+      size_t shared = common_prefix(&names[i - 1], &names[i]);
+      if (put_name(&out, shared, names[i].str + shared, names[i].len - shared)) {
+        goto fail;
+      }
+    }
+  }
+  store->blocks[store->block_count] = out.len;
+  // Give back what doubling over-allocated
+  store->data = out.len > 0 ? realloc(out.data, out.len) : out.data;
+  if (store->data == NULL) {
+    store->data = out.data;
+  }
+  store->data_len = out.len;
+  free(names);
+  return store;
+
+fail:
+  free(names);
+  free(out.data);
+  haskell_store_free(store);
+  return NULL;
+}
+
+void
+haskell_store_free(struct haskell_store *store)
+{
+  if (store == NULL) {
+    return;
+  }
+  free(store->data);
+  free(store->blocks);
+  haskell_intern_free(store->prefixes);
+  free(store);
+}
+
+size_t
+haskell_store_count(const struct haskell_store *store)
+{
+  return store->count;
+}
+
+size_t
+haskell_store_size(const struct haskell_store *store)
+{
+  size_t size = sizeof(struct haskell_store) + store->data_len + (store->block_count + 1) * sizeof(uint64_t);
+  if (store->prefixes != NULL) {
+    for (size_t i = 0; i < haskell_intern_count(store->prefixes); i++) {
+      size_t len;
+      haskell_intern_get(store->prefixes, i, &len);
+      size += len;
+    }
+  }
+  return size;
+}
+
+// A block's head, as its dictionary prefix and the rest
+struct head {
+  const char *prefix;
+  size_t prefix_len;
+  const char *suffix;
+  size_t suffix_len;
+  // Where the block's next name starts
+  const uint8_t *next;
+};
+
+static
+struct head read_head(const struct haskell_store *store, size_t block) {
+  struct head head = { "", 0, NULL, 0, NULL };
+  const uint8_t *p = &store->data[store->blocks[block]];
+  uint64_t prefix_id = get_varint(&p);
+  if (prefix_id != 0) {
+    head.prefix = haskell_intern_get(store->prefixes, prefix_id - 1, &head.prefix_len);
+  }
+  head.suffix_len = get_varint(&p);
+  head.suffix = (const char *) p;
+  head.next = p + head.suffix_len;
+  return head;
+}
+
+// Compares a name with a block's head, without putting the head together
+static
+int head_cmp(const char *name, size_t len, const struct head *head) {
+  size_t n = len < head->prefix_len ? len : head->prefix_len;
+  int cmp = memcmp(name, head->prefix, n);
+  if (cmp != 0) {
+    return cmp;
+  }
+  if (len < head->prefix_len) {
+    return -1;
+  }
+  struct haskell_name rest = { name + head->prefix_len, len - head->prefix_len };
+  struct haskell_name suffix = { head->suffix, head->suffix_len };
+  return haskell_name_cmp(&rest, &suffix);
+}
+
+int
+haskell_store_iter_init(struct haskell_store_iter *it, const struct haskell_store *store, size_t rank)
+{
+  *it = (struct haskell_store_iter) { .store = store, .next = rank };
+  it->name = malloc(store->max_len + 1);
+  if (it->name == NULL) {
+    return -1;
+  }
+  if (rank >= store->count) {
+    it->next = store->count;
+    return 0;
+  }
+  // Decode up to the name before `rank`, so the next call yields it
+  size_t block = rank / store->block_size;
+  struct head head = read_head(store, block);
+  memcpy(it->name, head.prefix, head.prefix_len);
+  memcpy(it->name + head.prefix_len, head.suffix, head.suffix_len);
+  it->len = head.prefix_len + head.suffix_len;
+  it->p = head.next;
+  it->next = block * store->block_size + 1;
+  it->name[it->len] = '\0';
+  // The head is ready to be yielded without decoding
+  it->pending = rank == block * store->block_size;
+  while (!it->pending && it->next < rank) {
+    haskell_store_iter_next(it);
+  }
+  return 0;
+}
+
+bool
+haskell_store_iter_next(struct haskell_store_iter *it)
+{
+  const struct haskell_store *store = it->store;
+  if (it->pending) {
+    it->pending = false;
+    return true;
+  }
+  if (it->next >= store->count) {
+    return false;
+  }
+  if (it->next % store->block_size == 0) {
+    struct head head = read_head(store, it->next / store->block_size);
+    memcpy(it->name, head.prefix, head.prefix_len);
+    memcpy(it->name + head.prefix_len, head.suffix, head.suffix_len);
+    it->len = head.prefix_len + head.suffix_len;
+    it->p = head.next;
+  } else {
+    size_t shared = get_varint(&it->p);
+    size_t suffix_len = get_varint(&it->p);
+    memcpy(it->name + shared, it->p, suffix_len);
+    it->p += suffix_len;
+    it->len = shared + suffix_len;
+  }
+  it->name[it->len] = '\0';
+  it->next++;
+  return true;
+}
+
+void
+haskell_store_iter_free(struct haskell_store_iter *it)
+{
+  free(it->name);
+  it->name = NULL;
+}
+
+bool
+haskell_store_find(const struct haskell_store *store, const char *name, size_t len, size_t *rank)
+{
+  if (store->count == 0) {
+    return false;
+  }
+  // The last block whose head is at or before the name
+  size_t lo = 0;
+  size_t hi = store->block_count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    struct head head = read_head(store, mid);
+    if (head_cmp(name, len, &head) >= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return false;
+  }
+  size_t block = lo - 1;
+  struct head head = read_head(store, block);
+  if (head_cmp(name, len, &head) == 0) {
+    *rank = block * store->block_size;
+    return true;
+  }
+
+  // Scan the block, tracking how much of the name the current entry
+  // matches, so nothing needs decoding into a buffer
+  size_t matched = common_prefix(
+    &(struct haskell_name) { name, len },
+    &(struct haskell_name) { head.prefix, head.prefix_len }
+  );
+  if (matched == head.prefix_len) {
+    matched += common_prefix(
+      &(struct haskell_name) { name + head.prefix_len, len - head.prefix_len },
+      &(struct haskell_name) { head.suffix, head.suffix_len }
+    );
+  }
+  const uint8_t *p = head.next;
+  size_t end = (block + 1) * store->block_size;
+  if (end > store->count) {
+    end = store->count;
+  }
+  for (size_t i = block * store->block_size + 1; i < end; i++) {
+    size_t shared = get_varint(&p);
+    size_t suffix_len = get_varint(&p);
+    const char *suffix = (const char *) p;
+    p += suffix_len;
+    if (shared > matched) {
+      // This entry agrees with the last one where the name didn't, so it
+      // can't match either
+      continue;
+    }
+    if (shared < matched) {
+      // Entries only grow from here, and this one is already past the name
+      return false;
+    }
+    size_t extra = common_prefix(
+      &(struct haskell_name) { name + shared, len - shared },
+      &(struct haskell_name) { suffix, suffix_len }
+    );
+    matched = shared + extra;
+    if (matched == len && extra == suffix_len) {
+      *rank = i;
+      return true;
+    }
+    if (extra < suffix_len && (matched == len || (unsigned char) suffix[extra] > (unsigned char) name[matched])) {
+      return false;
+    }
+  }
+  return false;
+}
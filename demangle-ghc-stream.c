@@ -0,0 +1,143 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Streaming demangling, of input that arrives in chunks of any size, such as
+reads from a socket, a name per line.
+
+haskell_stream is a state machine: it's given a chunk, then asked for
+records until it says it needs the next one, and it can be left at that
+point for as long as the caller likes, so an event loop, or a coroutine
+(see demangle-ghc.hpp), can drive any number of streams from one thread.
+
+A line that lies within a chunk is demangled straight from it. Only a
+line that straddles chunks is copied, its start carried over into the
+stream's own buffer until its end arrives. Names are demangled into a
+second buffer, reused from record to record, so once the two have grown
+to fit the longest line, records cost no allocation at all.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "demangle-ghc.h"
+
+void
+haskell_stream_init(struct haskell_stream *s)
+{
+  *s = (struct haskell_stream) { 0 };
+}
+
+void
+haskell_stream_free(struct haskell_stream *s)
+{
+  free(s->carry);
+  free(s->out);
+  *s = (struct haskell_stream) { 0 };
+}
+
+void
+haskell_stream_feed(struct haskell_stream *s, const char *chunk, size_t len)
+{
+  s->chunk = chunk;
+  s->chunk_len = len;
+  s->pos = 0;
+}
+
+void
+haskell_stream_finish(struct haskell_stream *s)
+{
+  s->chunk_len = 0;
+  s->pos = 0;
+  s->finished = true;
+}
+
+// true signals an error
+static
+bool grow(char **buf, size_t *capacity, size_t len) {
+  if (len <= *capacity) {
+    return false;
+  }
+  size_t capacity_ = *capacity ? *capacity : 256;
+  while (capacity_ < len) {
+    capacity_ *= 2;
+  }
+  char *bigger = realloc(*buf, capacity_);
+  if (bigger == NULL) {
+    return true;
+  }
+  *buf = bigger;
+  *capacity = capacity_;
+  return false;
+}
+
+// true signals an error
+static
+bool carry(struct haskell_stream *s, const char *data, size_t len) {
+  if (grow(&s->carry, &s->carry_capacity, s->carry_len + len)) {
+    return true;
+  }
+  memcpy(s->carry + s->carry_len, data, len);
+  s->carry_len += len;
+  return false;
+}
+
+// Fills in a record for the line
+// true signals an error
+static
+bool demangle_record(struct haskell_stream *s, const char *line, size_t len, struct haskell_stream_record *record) {
+  *record = (struct haskell_stream_record) { line, len, NULL, 0 };
+  size_t written;
+  enum haskell_demangle_error error = haskell_demangle_into(
+    line, len, &haskell_default_limits, s->out, s->out_capacity, &written
+  );
+  if (error == HASKELL_DEMANGLE_TOO_LONG) {
+    size_t needed;
+    error = haskell_demangled_length(line, len, &haskell_default_limits, &needed);
+    if (error == HASKELL_DEMANGLE_OK) {
+      if (grow(&s->out, &s->out_capacity, needed)) {
+        return true;
+      }
+      error = haskell_demangle_into(line, len, &haskell_default_limits, s->out, s->out_capacity, &written);
+    }
+  }
+  if (error == HASKELL_DEMANGLE_OK) {
+    // Never NULL, even for an empty name
+    record->demangled = s->out != NULL ? s->out : line;
+    record->demangled_len = written;
+  }
+  return false;
+}
+
+enum haskell_stream_status
+haskell_stream_next(struct haskell_stream *s, struct haskell_stream_record *record)
+{
+  // The last record was the carried line
+  if (s->carry_done) {
+    s->carry_len = 0;
+    s->carry_done = false;
+  }
+  if (s->pos < s->chunk_len) {
+    const char *start = s->chunk + s->pos;
+    size_t left = s->chunk_len - s->pos;
+    const char *nl = memchr(start, '\n', left);
+    if (nl == NULL) {
+      s->pos = s->chunk_len;
+      return carry(s, start, left) ? HASKELL_STREAM_ERROR : HASKELL_STREAM_NEED_INPUT;
+    }
+    size_t len = nl - start;
+    s->pos += len + 1;
+    if (s->carry_len == 0) {
+      return demangle_record(s, start, len, record) ? HASKELL_STREAM_ERROR : HASKELL_STREAM_RECORD;
+    }
+    if (carry(s, start, len)) {
+      return HASKELL_STREAM_ERROR;
+    }
+  } else if (!s->finished) {
+    return HASKELL_STREAM_NEED_INPUT;
+  } else if (s->carry_len == 0) {
+    return HASKELL_STREAM_END;
+  }
+  // A line that straddled chunks, or the last, unterminated one
+  s->carry_done = true;
+  return demangle_record(s, s->carry, s->carry_len, record) ? HASKELL_STREAM_ERROR : HASKELL_STREAM_RECORD;
+}
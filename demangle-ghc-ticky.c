@@ -0,0 +1,576 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Ticky-ticky profiles, as written by a program built with -ticky and run
+with +RTS -r.
+
+The part read is the table of counters, one row per closure, after the
+header line naming the "Entries", "Alloc" and "STG Name" columns:
+
+      Entries      Alloc    Alloc'd  Non-void Arguments      STG Name
+  -------------------------------------------------------------------
+           12        480          0   1 L                    Main_zdwgo_info
+
+Rows are summed per binder, or per module, across all the files given.
+Names are taken apart into their module and binder. Z-encoded names are
+split at their literal '_'s, as haskell_demangle_binder splits them, into
+a unit, if the first component is lower case or has a version, then the
+module and the binder, so the unit before, and the unique and kind of
+closure after, are dropped. GHC's own
+text form, "unit:Data.Map.insert{v r2Lx} (fun)", is split at the last
+'.' that ends a module component, after the unit, and cut at the first '{'
+or space.
+
+Each thread takes files one at a time, maps them, and adds their rows to
+tables of its own. Names repeat, within a file and between runs, so the
+first table maps each distinct name, as written, to its binder, and
+nothing is demangled twice on a thread. The threads' totals are merged at
+the end.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "demangle-ghc-internal.h"
+
+const struct haskell_ticky_options haskell_default_ticky_options = {
+  .threads = 0,
+  .by_module = false
+};
+
+struct counters {
+  uint64_t entries;
+  uint64_t alloc;
+  uint64_t allocd;
+};
+
+// A table of keys, "module\0binder", each with its totals
+struct totals {
+  struct haskell_intern *keys;
+  struct counters *counters;
+  size_t capacity;
+};
+
+struct haskell_ticky_state {
+  struct totals totals;
+};
+
+struct ticky_job {
+  const char *const *paths;
+  size_t count;
+  // The next file to take, shared by all jobs
+  size_t *next;
+  bool by_module;
+  // Each distinct name as written, and its key in `totals`
+  struct haskell_intern *names;
+  uint32_t *name_keys;
+  size_t name_capacity;
+  struct totals totals;
+  char *key;
+  size_t key_capacity;
+  int error;
+};
+
+/*
+Totals
+*/
+
+static
+void free_totals(struct totals *t) {
+  haskell_intern_free(t->keys);
+  free(t->counters);
+}
+
+// Returns the key's ID, or HASKELL_INTERN_ERROR
+static
+uint32_t add_key(struct totals *t, const char *key, size_t len) {
+  bool added;
+  uint32_t id = haskell_intern_add(t->keys, key, len, &added);
+  if (id == HASKELL_INTERN_ERROR || !added) {
+    return id;
+  }
+  if (id >= t->capacity) {
+    size_t capacity = t->capacity ? t->capacity * 2 : 256;
+    struct counters *counters = realloc(t->counters, capacity * sizeof(struct counters));
+    if (counters == NULL) {
+      return HASKELL_INTERN_ERROR;
+    }
+    t->counters = counters;
+    t->capacity = capacity;
+  }
+  t->counters[id] = (struct counters) { 0 };
+  return id;
+}
+
+/*
+Names
+*/
+
+// true signals an error
+static
+bool reserve_key(struct ticky_job *job, size_t len) {
+  if (len <= job->key_capacity) {
+    return false;
+  }
+  char *key = realloc(job->key, len);
+  if (key == NULL) {
+    return true;
+  }
+  job->key = key;
+  job->key_capacity = len;
+  return false;
+}
+
+// Appends a z-encoded component, demangled, or as it is if it doesn't
+// demangle
+// true signals an error
+static
+bool put_decoded(struct ticky_job *job, size_t *at, const char *s, size_t len) {
+  if (len == 0) {
+    return false;
+  }
+  size_t demangled;
+  if (haskell_demangled_length(s, len, &haskell_default_limits, &demangled) == HASKELL_DEMANGLE_OK) {
+    if (reserve_key(job, *at + demangled)) {
+      return true;
+    }
+    size_t written;
+    enum haskell_demangle_error error =
+      haskell_demangle_into(s, len, &haskell_default_limits, job->key + *at, demangled, &written);
+    if (error == HASKELL_DEMANGLE_OK) {
+      *at += written;
+      return false;
+    }
+  }
+  // Doesn't demangle, so it's kept as it is
+  if (reserve_key(job, *at + len)) {
+    return true;
+  }
+  memcpy(job->key + *at, s, len);
+  *at += len;
+  return false;
+}
+
+// true signals an error
+static
+bool put_plain(struct ticky_job *job, size_t *at, const char *s, size_t len) {
+  if (reserve_key(job, *at + len)) {
+    return true;
+  }
+  memcpy(job->key + *at, s, len);
+  *at += len;
+  return false;
+}
+
+// Whether what's before a name's first ':' is a unit, such as "main" or
+// "QuickCheck-2.14.3-AbC", rather than part of a qualified operator, such
+// as the "Main." of "Main.:+", or the "Main.+" of "Main.+:"
+static
+bool is_text_unit(const char *s, size_t len) {
+  if (len == 0 || s[len - 1] == '.') {
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    char c = s[i];
+    if (!(
+      (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+      || c == '-' || c == '.' || c == '_'
+    )) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Builds a name's key in job->key, returning its length, or SIZE_MAX if
+// memory ran out
+static
+size_t name_key(struct ticky_job *job, const char *name, size_t len) {
+  const char *module = name;
+  size_t module_len = 0;
+  const char *binder = name;
+  size_t binder_len = len;
+  bool zencoded = memchr(name, '.', len) == NULL && memchr(name, ':', len) == NULL;
+  if (zencoded) {
+    struct haskell_name_parts parts;
+    if (haskell_split_name(name, len, &parts)) {
+      module = name + parts.module_start;
+      module_len = parts.module_end - parts.module_start;
+      binder = name + parts.binder_start;
+      binder_len = parts.binder_end - parts.binder_start;
+    }
+  } else {
+    // Past the unit, then up to the last '.' after a module component
+    const char *colon = memchr(name, ':', len);
+    if (colon != NULL && is_text_unit(name, colon - name)) {
+      len -= colon + 1 - name;
+      name = colon + 1;
+    }
+    const char *end = name + len;
+    const char *p = name;
+    while (p < end && *p >= 'A' && *p <= 'Z') {
+      const char *module_end = memchr(p, '.', end - p);
+      if (module_end == NULL || module_end + 1 == end) {
+        break;
+      }
+      module = name;
+      module_len = module_end - name;
+      p = module_end + 1;
+    }
+    binder = p;
+    binder_len = end - p;
+  }
+
+  size_t at = 0;
+  if (zencoded) {
+    if (put_decoded(job, &at, module, module_len)) {
+      return SIZE_MAX;
+    }
+  } else if (put_plain(job, &at, module, module_len)) {
+    return SIZE_MAX;
+  }
+  if (put_plain(job, &at, "", 1)) {
+    return SIZE_MAX;
+  }
+  if (job->by_module) {
+    return at;
+  }
+  if (zencoded) {
+    if (put_decoded(job, &at, binder, binder_len)) {
+      return SIZE_MAX;
+    }
+  } else if (put_plain(job, &at, binder, binder_len)) {
+    return SIZE_MAX;
+  }
+  return at;
+}
+
+// The key of a name, as written, from the memo, or added to it
+static
+uint32_t name_id(struct ticky_job *job, const char *name, size_t len) {
+  bool added;
+  uint32_t id = haskell_intern_add(job->names, name, len, &added);
+  if (id == HASKELL_INTERN_ERROR) {
+    return id;
+  }
+  if (!added) {
+    return job->name_keys[id];
+  }
+  if (id >= job->name_capacity) {
+    size_t capacity = job->name_capacity ? job->name_capacity * 2 : 256;
+    uint32_t *keys = realloc(job->name_keys, capacity * sizeof(uint32_t));
+    if (keys == NULL) {
+      return HASKELL_INTERN_ERROR;
+    }
+    job->name_keys = keys;
+    job->name_capacity = capacity;
+  }
+  size_t key_len = name_key(job, name, len);
+  if (key_len == SIZE_MAX) {
+    return HASKELL_INTERN_ERROR;
+  }
+  job->name_keys[id] = add_key(&job->totals, job->key, key_len);
+  return job->name_keys[id];
+}
+
+/*
+Reading
+*/
+
+static
+const char *skip_spaces(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  return p;
+}
+
+// true signals a malformed number
+static
+bool get_number(const char **p, const char *end, uint64_t *n) {
+  *p = skip_spaces(*p, end);
+  if (*p == end || **p < '0' || **p > '9') {
+    return true;
+  }
+  *n = 0;
+  for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+    *n = *n * 10 + (**p - '0');
+  }
+  return false;
+}
+
+static
+bool contains(const char *line, size_t len, const char *word) {
+  return memmem(line, len, word, strlen(word)) != NULL;
+}
+
+// Adds the rows of the counters table in the file
+// true signals an error
+static
+bool read_ticky(struct ticky_job *job, const char *text, size_t len) {
+  const char *end = text + len;
+  const char *p = text;
+  bool in_table = false;
+  bool found = false;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    const char *line_end = nl == NULL ? end : nl;
+    const char *line = p;
+    p = nl == NULL ? end : nl + 1;
+    if (!in_table) {
+      size_t line_len = line_end - line;
+      if (contains(line, line_len, "Entries") && contains(line, line_len, "Alloc") && contains(line, line_len, "STG Name")) {
+        in_table = true;
+        found = true;
+      }
+      continue;
+    }
+    const char *q = skip_spaces(line, line_end);
+    if (q == line_end) {
+      // A blank line ends the table
+      in_table = false;
+      continue;
+    }
+    if (*q == '-') {
+      continue;
+    }
+    struct counters row;
+    uint64_t args;
+    if (
+      get_number(&q, line_end, &row.entries)
+      || get_number(&q, line_end, &row.alloc)
+      || get_number(&q, line_end, &row.allocd)
+      || get_number(&q, line_end, &args)
+    ) {
+      continue;
+    }
+    q = skip_spaces(q, line_end);
+    if (args > 0) {
+      // The arguments' kinds
+      while (q < line_end && *q != ' ' && *q != '\t') {
+        q++;
+      }
+      q = skip_spaces(q, line_end);
+    }
+    const char *name = q;
+    while (q < line_end && *q != ' ' && *q != '\t' && *q != '{') {
+      q++;
+    }
+    if (q == name) {
+      continue;
+    }
+    uint32_t id = name_id(job, name, q - name);
+    if (id == HASKELL_INTERN_ERROR) {
+      return true;
+    }
+    struct counters *c = &job->totals.counters[id];
+    c->entries += row.entries;
+    c->alloc += row.alloc;
+    c->allocd += row.allocd;
+  }
+  if (!found) {
+    errno = EINVAL;
+  }
+  return !found;
+}
+
+// true signals an error
+static
+bool read_file(struct ticky_job *job, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return true;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return true;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    errno = EINVAL;
+    return true;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return true;
+  }
+  bool error = read_ticky(job, map, st.st_size);
+  munmap(map, st.st_size);
+  return error;
+}
+
+static
+void *read_files(void *arg) {
+  struct ticky_job *job = arg;
+  while (true) {
+    size_t i = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->count) {
+      break;
+    }
+    if (read_file(job, job->paths[i])) {
+      job->error = errno ? errno : EINVAL;
+      // The other jobs stop at their next file
+      __atomic_store_n(job->next, job->count, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  return NULL;
+}
+
+static
+int entry_cmp(const void *a, const void *b) {
+  const struct haskell_ticky_entry *x = a;
+  const struct haskell_ticky_entry *y = b;
+  if (x->alloc != y->alloc) {
+    return x->alloc > y->alloc ? -1 : 1;
+  }
+  if (x->entries != y->entries) {
+    return x->entries > y->entries ? -1 : 1;
+  }
+  size_t len = x->module_len < y->module_len ? x->module_len : y->module_len;
+  int cmp = memcmp(x->module, y->module, len);
+  if (cmp != 0 || x->module_len != y->module_len) {
+    return cmp != 0 ? cmp : x->module_len < y->module_len ? -1 : 1;
+  }
+  len = x->binder_len < y->binder_len ? x->binder_len : y->binder_len;
+  cmp = memcmp(x->binder, y->binder, len);
+  if (cmp != 0 || x->binder_len != y->binder_len) {
+    return cmp != 0 ? cmp : x->binder_len < y->binder_len ? -1 : 1;
+  }
+  return 0;
+}
+
+int
+haskell_ticky_merge(
+  const char *const *paths,
+  size_t count,
+  const struct haskell_ticky_options *options,
+  struct haskell_ticky *out
+) {
+  *out = (struct haskell_ticky) { 0 };
+  unsigned threads = haskell_default_threads(options->threads);
+  size_t shares = count < threads ? count : threads;
+  if (shares == 0) {
+    shares = 1;
+  }
+  size_t next = 0;
+  struct ticky_job *jobs = calloc(shares, sizeof(struct ticky_job));
+  struct haskell_ticky_state *state = calloc(1, sizeof(struct haskell_ticky_state));
+  int error = ENOMEM;
+  if (jobs == NULL || state == NULL) {
+    goto fail;
+  }
+  state->totals.keys = haskell_intern_new();
+  if (state->totals.keys == NULL) {
+    goto fail;
+  }
+  for (size_t i = 0; i < shares; i++) {
+    jobs[i] = (struct ticky_job) {
+      .paths = paths,
+      .count = count,
+      .next = &next,
+      .by_module = options->by_module,
+      .names = haskell_intern_new(),
+      .totals = { .keys = haskell_intern_new() }
+    };
+    if (jobs[i].names == NULL || jobs[i].totals.keys == NULL) {
+      goto fail;
+    }
+  }
+  if (haskell_run_jobs(read_files, jobs, sizeof(struct ticky_job), shares)) {
+    goto fail;
+  }
+  for (size_t i = 0; i < shares; i++) {
+    if (jobs[i].error) {
+      error = jobs[i].error;
+      goto fail;
+    }
+  }
+
+  // The threads' totals, merged
+  struct totals *totals = &state->totals;
+  for (size_t i = 0; i < shares; i++) {
+    struct totals *t = &jobs[i].totals;
+    for (uint32_t id = 0; id < haskell_intern_count(t->keys); id++) {
+      size_t len;
+      const char *key = haskell_intern_get(t->keys, id, &len);
+      uint32_t merged = add_key(totals, key, len);
+      if (merged == HASKELL_INTERN_ERROR) {
+        goto fail;
+      }
+      totals->counters[merged].entries += t->counters[id].entries;
+      totals->counters[merged].alloc += t->counters[id].alloc;
+      totals->counters[merged].allocd += t->counters[id].allocd;
+    }
+  }
+
+  size_t entries = haskell_intern_count(totals->keys);
+  out->entries = malloc((entries + 1) * sizeof(struct haskell_ticky_entry));
+  if (out->entries == NULL) {
+    goto fail;
+  }
+  for (uint32_t id = 0; id < entries; id++) {
+    size_t len;
+    const char *key = haskell_intern_get(totals->keys, id, &len);
+    size_t module_len = (const char *) memchr(key, '\0', len) - key;
+    out->entries[id] = (struct haskell_ticky_entry) {
+      .module = key,
+      .module_len = module_len,
+      .binder = key + module_len + 1,
+      .binder_len = len - module_len - 1,
+      .entries = totals->counters[id].entries,
+      .alloc = totals->counters[id].alloc,
+      .allocd = totals->counters[id].allocd
+    };
+  }
+  qsort(out->entries, entries, sizeof(struct haskell_ticky_entry), entry_cmp);
+  out->count = entries;
+  out->state = state;
+  for (size_t i = 0; i < shares; i++) {
+    haskell_intern_free(jobs[i].names);
+    free(jobs[i].name_keys);
+    free_totals(&jobs[i].totals);
+    free(jobs[i].key);
+  }
+  free(jobs);
+  return 0;
+
+fail:
+  if (jobs != NULL) {
+    for (size_t i = 0; i < shares; i++) {
+      haskell_intern_free(jobs[i].names);
+      free(jobs[i].name_keys);
+      free_totals(&jobs[i].totals);
+      free(jobs[i].key);
+    }
+  }
+  free(jobs);
+  if (state != NULL) {
+    free_totals(&state->totals);
+  }
+  free(state);
+  free(out->entries);
+  *out = (struct haskell_ticky) { 0 };
+  errno = error;
+  return -1;
+}
+
+void
+haskell_ticky_free(struct haskell_ticky *ticky)
+{
+  if (ticky->state != NULL) {
+    free_totals(&ticky->state->totals);
+  }
+  free(ticky->state);
+  free(ticky->entries);
+  *ticky = (struct haskell_ticky) { 0 };
+}
@@ -0,0 +1,386 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Most frequent symbols in a stream.
+
+Symbols are counted in their mangled form, and only the winners are
+demangled, when the results are asked for.
+
+Counting starts out exact, in an intern table with a count per ID. Once
+the table holds more distinct symbols than the caller allows, the counts
+move into a count-min sketch, and the table is freed. The sketch is a few
+rows of counters, each symbol adding to one counter per row, picked by
+its hash. Its estimate of a count is the smallest of its counters, which
+can only overcount, and is updated conservatively: only counters below
+the new estimate are raised, which overcounts less.
+
+In sketch mode, the candidates are kept in a min-heap of K entries,
+keyed by their estimates, with a small hash table from symbol to heap
+position. A symbol whose estimate beats the heap's smallest replaces it.
+Memory is the sketch, plus K symbols, however long the stream.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "demangle-ghc.h"
+
+// 4 rows of 2^18 counters: 8 MiB, with an expected overcount under a
+// millionth of the stream per row
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH ((size_t) 1 << 18)
+
+struct tracked {
+  uint64_t hash;
+  char *str;
+  size_t len;
+  uint64_t count;
+  // Where this entry is in `slots`
+  size_t slot;
+};
+
+struct haskell_top_k {
+  size_t k;
+  size_t exact_limit;
+  // NULL once in sketch mode
+  struct haskell_intern *exact;
+  uint64_t *exact_counts;
+  size_t exact_capacity;
+  uint64_t *sketch;
+  // Min-heap on count
+  struct tracked *heap;
+  size_t heap_len;
+  // Heap position + 1 of each tracked symbol, zero for empty
+  size_t *slots;
+  size_t slot_mask;
+  struct haskell_top_k_entry *results;
+  size_t result_count;
+};
+
+static
+uint64_t symbol_hash(const char *str, size_t len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) str[i]) * 0x100000001b3;
+  }
+  hash ^= hash >> 32;
+  hash *= 0xd6e8feb86659fd93;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+struct haskell_top_k *
+haskell_top_k_new(size_t k, size_t exact_limit)
+{
+  // So that the heap's size, and twice k in slots, can't overflow
+  if (k > SIZE_MAX / 2 / sizeof(struct tracked)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  struct haskell_top_k *t = calloc(1, sizeof(struct haskell_top_k));
+  if (t == NULL) {
+    return NULL;
+  }
+  t->k = k > 0 ? k : 1;
+  t->exact_limit = exact_limit;
+  size_t slot_count = 16;
+  while (slot_count < t->k * 2) {
+    slot_count *= 2;
+  }
+  t->slot_mask = slot_count - 1;
+  t->exact = haskell_intern_new();
+  t->heap = malloc(t->k * sizeof(struct tracked));
+  t->slots = calloc(slot_count, sizeof(size_t));
+  if (t->exact == NULL || t->heap == NULL || t->slots == NULL) {
+    haskell_top_k_free(t);
+    return NULL;
+  }
+  return t;
+}
+
+static
+void free_results(struct haskell_top_k *t) {
+  for (size_t i = 0; i < t->result_count; i++) {
+    free(t->results[i].name);
+  }
+  free(t->results);
+  t->results = NULL;
+  t->result_count = 0;
+}
+
+static
+void clear_heap(struct haskell_top_k *t) {
+  for (size_t i = 0; i < t->heap_len; i++) {
+    free(t->heap[i].str);
+  }
+  t->heap_len = 0;
+  memset(t->slots, 0, (t->slot_mask + 1) * sizeof(size_t));
+}
+
+void
+haskell_top_k_free(struct haskell_top_k *t)
+{
+  if (t == NULL) {
+    return;
+  }
+  if (t->heap != NULL && t->slots != NULL) {
+    clear_heap(t);
+  }
+  free_results(t);
+  haskell_intern_free(t->exact);
+  free(t->exact_counts);
+  free(t->sketch);
+  free(t->heap);
+  free(t->slots);
+  free(t);
+}
+
+bool
+haskell_top_k_is_exact(const struct haskell_top_k *t)
+{
+  return t->exact != NULL;
+}
+
+/*
+Heap
+*/
+
+// The slot holding the symbol, or the empty one it would go in
+static
+size_t find_slot(const struct haskell_top_k *t, uint64_t hash, const char *str, size_t len) {
+  size_t i = hash & t->slot_mask;
+  for (; t->slots[i] != 0; i = (i + 1) & t->slot_mask) {
+    const struct tracked *e = &t->heap[t->slots[i] - 1];
+    if (e->hash == hash && e->len == len && memcmp(e->str, str, len) == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+// Empties a slot, shifting back the entries after it that would
+// otherwise be cut off from their home slots
+static
+void remove_slot(struct haskell_top_k *t, size_t i) {
+  size_t mask = t->slot_mask;
+  size_t j = i;
+  while (true) {
+    j = (j + 1) & mask;
+    if (t->slots[j] == 0) {
+      break;
+    }
+    size_t home = t->heap[t->slots[j] - 1].hash & mask;
+    // Can it move back to i, without passing its home?
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      t->slots[i] = t->slots[j];
+      t->heap[t->slots[i] - 1].slot = i;
+      i = j;
+    }
+  }
+  t->slots[i] = 0;
+}
+
+static
+void heap_set(struct haskell_top_k *t, size_t i, struct tracked e) {
+  t->heap[i] = e;
+  t->slots[e.slot] = i + 1;
+}
+
+static
+void sift_up(struct haskell_top_k *t, size_t i) {
+  struct tracked e = t->heap[i];
+  while (i > 0 && t->heap[(i - 1) / 2].count > e.count) {
+    heap_set(t, i, t->heap[(i - 1) / 2]);
+    i = (i - 1) / 2;
+  }
+  heap_set(t, i, e);
+}
+
+static
+void sift_down(struct haskell_top_k *t, size_t i) {
+  struct tracked e = t->heap[i];
+  while (true) {
+    size_t child = 2 * i + 1;
+    if (child >= t->heap_len) {
+      break;
+    }
+    if (child + 1 < t->heap_len && t->heap[child + 1].count < t->heap[child].count) {
+      child++;
+    }
+    if (t->heap[child].count >= e.count) {
+      break;
+    }
+    heap_set(t, i, t->heap[child]);
+    i = child;
+  }
+  heap_set(t, i, e);
+}
+
+// Tracks a symbol with the given count, if it makes the cut
+// true signals an error
+static
+bool offer(struct haskell_top_k *t, uint64_t hash, const char *str, size_t len, uint64_t count) {
+  size_t slot = find_slot(t, hash, str, len);
+  if (t->slots[slot] != 0) {
+    size_t i = t->slots[slot] - 1;
+    t->heap[i].count = count;
+    sift_down(t, i);
+    return false;
+  }
+  if (t->heap_len == t->k && count <= t->heap[0].count) {
+    return false;
+  }
+  char *copy = malloc(len + 1);
+  if (copy == NULL) {
+    return true;
+  }
+  memcpy(copy, str, len);
+  if (t->heap_len == t->k) {
+    // Replace the smallest
+    free(t->heap[0].str);
+    remove_slot(t, t->heap[0].slot);
+    slot = find_slot(t, hash, str, len);
+    t->heap[0] = (struct tracked) { hash, copy, len, count, slot };
+    t->slots[slot] = 1;
+    sift_down(t, 0);
+  } else {
+    size_t i = t->heap_len++;
+    t->heap[i] = (struct tracked) { hash, copy, len, count, slot };
+    t->slots[slot] = i + 1;
+    sift_up(t, i);
+  }
+  return false;
+}
+
+/*
+Counting
+*/
+
+// Adds to a symbol's counters, returning its new estimate
+static
+uint64_t sketch_add(uint64_t *sketch, uint64_t hash, uint64_t n) {
+  // Each row's counter, from two halves of the hash
+  size_t at[SKETCH_DEPTH];
+  uint64_t step = (hash >> 32) | 1;
+  uint64_t estimate = UINT64_MAX;
+  for (size_t r = 0; r < SKETCH_DEPTH; r++) {
+    at[r] = r * SKETCH_WIDTH + ((hash + r * step) & (SKETCH_WIDTH - 1));
+    if (sketch[at[r]] < estimate) {
+      estimate = sketch[at[r]];
+    }
+  }
+  estimate += n;
+  for (size_t r = 0; r < SKETCH_DEPTH; r++) {
+    if (sketch[at[r]] < estimate) {
+      sketch[at[r]] = estimate;
+    }
+  }
+  return estimate;
+}
+
+// Moves the exact counts into the sketch and the heap
+// true signals an error
+static
+bool to_sketch(struct haskell_top_k *t) {
+  t->sketch = calloc(SKETCH_DEPTH * SKETCH_WIDTH, sizeof(uint64_t));
+  if (t->sketch == NULL) {
+    return true;
+  }
+  clear_heap(t);
+  for (size_t id = 0; id < haskell_intern_count(t->exact); id++) {
+    size_t len;
+    const char *str = haskell_intern_get(t->exact, id, &len);
+    uint64_t hash = symbol_hash(str, len);
+    sketch_add(t->sketch, hash, t->exact_counts[id]);
+    if (offer(t, hash, str, len, t->exact_counts[id])) {
+      return true;
+    }
+  }
+  haskell_intern_free(t->exact);
+  free(t->exact_counts);
+  t->exact = NULL;
+  t->exact_counts = NULL;
+  return false;
+}
+
+int
+haskell_top_k_add(struct haskell_top_k *t, const char *symbol, size_t len)
+{
+  if (t->exact != NULL) {
+    bool added;
+    uint32_t id = haskell_intern_add(t->exact, symbol, len, &added);
+    if (id == HASKELL_INTERN_ERROR) {
+      return -1;
+    }
+    if (id >= t->exact_capacity) {
+      size_t capacity = t->exact_capacity ? t->exact_capacity * 2 : 1024;
+      uint64_t *counts = realloc(t->exact_counts, capacity * sizeof(uint64_t));
+      if (counts == NULL) {
+        return -1;
+      }
+      t->exact_counts = counts;
+      t->exact_capacity = capacity;
+    }
+    if (added) {
+      t->exact_counts[id] = 0;
+    }
+    t->exact_counts[id]++;
+    if (haskell_intern_count(t->exact) > t->exact_limit && to_sketch(t)) {
+      return -1;
+    }
+    return 0;
+  }
+  uint64_t hash = symbol_hash(symbol, len);
+  uint64_t estimate = sketch_add(t->sketch, hash, 1);
+  return offer(t, hash, symbol, len, estimate) ? -1 : 0;
+}
+
+static
+int entry_cmp(const void *a, const void *b) {
+  const struct haskell_top_k_entry *x = a;
+  const struct haskell_top_k_entry *y = b;
+  if (x->count != y->count) {
+    return x->count > y->count ? -1 : 1;
+  }
+  return strcmp(x->name, y->name);
+}
+
+int
+haskell_top_k_results(
+  struct haskell_top_k *t,
+  const struct haskell_top_k_entry **entries,
+  size_t *count
+) {
+  free_results(t);
+  if (t->exact != NULL) {
+    clear_heap(t);
+    for (size_t id = 0; id < haskell_intern_count(t->exact); id++) {
+      size_t len;
+      const char *str = haskell_intern_get(t->exact, id, &len);
+      if (offer(t, symbol_hash(str, len), str, len, t->exact_counts[id])) {
+        return -1;
+      }
+    }
+  }
+  t->results = malloc((t->heap_len + 1) * sizeof(struct haskell_top_k_entry));
+  if (t->results == NULL) {
+    return -1;
+  }
+  for (size_t i = 0; i < t->heap_len; i++) {
+    const struct tracked *e = &t->heap[i];
+    // Symbols that don't demangle are given as they are
+    char *name = haskell_demangle_n(e->str, e->len);
+    if (name == NULL) {
+      name = strndup(e->str, e->len);
+    }
+    if (name == NULL) {
+      return -1;
+    }
+    t->results[t->result_count++] = (struct haskell_top_k_entry) { name, e->count };
+  }
+  qsort(t->results, t->result_count, sizeof(struct haskell_top_k_entry), entry_cmp);
+  *entries = t->results;
+  *count = t->result_count;
+  return 0;
+}
@@ -0,0 +1,431 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Autocomplete index over demangled names, as a memory-mappable radix trie.
+
+The file is a fixed header, then the trie's nodes. All integers are
+little-endian.
+
+  offset  size  field
+       0     8  magic, "GHCDMTRI"
+       8     4  version, 1
+      12     4  zero
+      16     8  count of names
+      24     8  length of the longest name
+      32     8  file offset of the nodes
+      40     8  length of the nodes
+      48    16  zero
+
+The nodes are written in preorder, so each subtree is contiguous and
+queries touch only the pages on their path and their matches. Node
+offsets are from the start of the nodes, and varints are unsigned LEB128.
+
+  varint  label length, then the label's bytes
+  varint  names in the subtree
+  varint  children << 1 | 1 if a name ends here
+  bytes   each child's first label byte, ascending
+  u32     each child's offset
+
+Every node but the root has a non-empty label, and every child comes
+after its parent, so even a corrupt file can't make a query loop or
+recurse more than the longest name deep.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "demangle-ghc-internal.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Trie headers are written straight from memory, which must be little-endian"
+#endif
+
+#define TRIE_MAGIC "GHCDMTRI"
+#define TRIE_VERSION 1
+#define TRIE_HEADER_SIZE 64
+
+struct trie_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t zero;
+  uint64_t count;
+  uint64_t max_len;
+  uint64_t nodes_offset;
+  uint64_t nodes_len;
+  uint64_t padding[2];
+};
+
+_Static_assert(sizeof(struct trie_header) == TRIE_HEADER_SIZE, "header layout");
+
+// Writes the subtree of the sorted names [lo, hi), which all share their
+// first `depth` bytes. Recurses once per node on a path, so no deeper
+// than the longest name.
+// true signals an error
+static
+bool write_node(struct haskell_out_buf *out, const struct haskell_name *names, size_t lo, size_t hi, size_t depth) {
+  // Sorted, so what the first and last share, they all do
+  size_t end = depth;
+  if (hi > lo) {
+    const struct haskell_name *first = &names[lo];
+    const struct haskell_name *last = &names[hi - 1];
+    while (end < first->len && end < last->len && first->str[end] == last->str[end]) {
+      end++;
+    }
+  }
+  bool terminal = hi > lo && names[lo].len == end;
+
+  size_t children = 0;
+  for (size_t i = lo + terminal; i < hi; i++) {
+    if (i == lo + terminal || names[i].str[end] != names[i - 1].str[end]) {
+      children++;
+    }
+  }
+
+  size_t label_len = end - depth;
+  if (haskell_out_reserve(out, 30 + label_len + children * 5)) {
+    return true;
+  }
+  haskell_out_varint(out, label_len);
+  if (label_len > 0) {
+    memcpy(&out->data[out->len], names[lo].str + depth, label_len);
+    out->len += label_len;
+  }
+  haskell_out_varint(out, hi - lo);
+  haskell_out_varint(out, children << 1 | terminal);
+  for (size_t i = lo + terminal; i < hi; i++) {
+    if (i == lo + terminal || names[i].str[end] != names[i - 1].str[end]) {
+      out->data[out->len++] = names[i].str[end];
+    }
+  }
+  // Filled in as each child is written
+  size_t offsets = out->len;
+  out->len += children * sizeof(uint32_t);
+
+  size_t child = 0;
+  size_t start = lo + terminal;
+  for (size_t i = start; i < hi; i++) {
+    if (i + 1 < hi && names[i + 1].str[end] == names[start].str[end]) {
+      continue;
+    }
+    if (out->len > UINT32_MAX) {
+      errno = EFBIG;
+      return true;
+    }
+    uint32_t offset = out->len;
+    memcpy(&out->data[offsets + child * sizeof(uint32_t)], &offset, sizeof(offset));
+    if (write_node(out, names, start, i + 1, end)) {
+      return true;
+    }
+    child++;
+    start = i + 1;
+  }
+  return false;
+}
+
+int
+haskell_batch_write_trie(const struct haskell_batch *batch, int fd)
+{
+  size_t unique;
+  size_t max_len;
+  struct haskell_name *names = haskell_sorted_names(batch, &unique, &max_len);
+  struct haskell_out_buf out = { 0 };
+  if (names == NULL) {
+    return -1;
+  }
+
+  int res = -1;
+  if (write_node(&out, names, 0, unique, 0)) {
+    goto done;
+  }
+  struct trie_header header = {
+    .magic = TRIE_MAGIC,
+    .version = TRIE_VERSION,
+    .count = unique,
+    .max_len = max_len,
+    .nodes_offset = TRIE_HEADER_SIZE,
+    .nodes_len = out.len
+  };
+  const uint8_t *parts[] = { (const uint8_t *) &header, out.data };
+  size_t lens[] = { sizeof(header), out.len };
+  for (size_t i = 0; i < 2; i++) {
+    size_t written = 0;
+    while (written < lens[i]) {
+      ssize_t n = write(fd, parts[i] + written, lens[i] - written);
+      if (n < 0 && errno != EINTR) {
+        goto done;
+      }
+      written += n > 0 ? (size_t) n : 0;
+    }
+  }
+  res = 0;
+
+done:
+  free(names);
+  free(out.data);
+  return res;
+}
+
+int
+haskell_trie_open(const char *path, struct haskell_trie *trie)
+{
+  memset(trie, 0, sizeof(*trie));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (uint64_t) st.st_size < TRIE_HEADER_SIZE) {
+    close(fd);
+    return -1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  const struct trie_header *header = map;
+  uint64_t size = st.st_size;
+  if (
+    memcmp(header->magic, TRIE_MAGIC, 8) != 0
+    || header->version != TRIE_VERSION
+    || header->nodes_offset > size
+    || header->nodes_len > size - header->nodes_offset
+    || header->nodes_len == 0
+    || header->max_len > size
+  ) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+  trie->map = map;
+  trie->map_len = st.st_size;
+  trie->nodes = (const uint8_t *) map + header->nodes_offset;
+  trie->nodes_len = header->nodes_len;
+  trie->count = header->count;
+  trie->max_len = header->max_len;
+  return 0;
+}
+
+void
+haskell_trie_close(struct haskell_trie *trie)
+{
+  if (trie->map != NULL) {
+    munmap(trie->map, trie->map_len);
+  }
+  memset(trie, 0, sizeof(*trie));
+}
+
+// A node, read with every bound checked
+struct node {
+  const uint8_t *label;
+  size_t label_len;
+  uint64_t count;
+  bool terminal;
+  size_t children;
+  const uint8_t *first_bytes;
+  const uint8_t *offsets;
+};
+
+// true signals an error
+static
+bool read_varint(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+  *value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    if (*p == end) {
+      return true;
+    }
+    uint8_t byte = *(*p)++;
+    *value |= (uint64_t) (byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// true signals an error
+static
+bool read_node(const struct haskell_trie *trie, size_t offset, struct node *node) {
+  const uint8_t *end = trie->nodes + trie->nodes_len;
+  const uint8_t *p = trie->nodes + offset;
+  uint64_t label_len, flags;
+  if (read_varint(&p, end, &label_len) || label_len > (uint64_t) (end - p)) {
+    return true;
+  }
+  node->label = p;
+  node->label_len = label_len;
+  p += label_len;
+  if (read_varint(&p, end, &node->count) || read_varint(&p, end, &flags)) {
+    return true;
+  }
+  node->terminal = flags & 1;
+  node->children = flags >> 1;
+  if (node->children > 256 || node->children * (1 + sizeof(uint32_t)) > (uint64_t) (end - p)) {
+    return true;
+  }
+  node->first_bytes = p;
+  node->offsets = p + node->children;
+  return false;
+}
+
+// The offset of a node's child, which must come after the node
+// true signals an error
+static
+bool child_offset(const struct haskell_trie *trie, size_t parent, const struct node *node, size_t i, size_t *offset) {
+  uint32_t child;
+  memcpy(&child, node->offsets + i * sizeof(uint32_t), sizeof(child));
+  *offset = child;
+  return child <= parent || child >= trie->nodes_len;
+}
+
+static
+bool is_separator(char c) {
+  return c == '.' || c == '_';
+}
+
+// Enters the node at the top of the stack: appends its label to the
+// name, and decides what, if anything, it yields.
+// true signals an error
+static
+bool enter(struct haskell_trie_iter *it) {
+  struct haskell_trie_frame *frame = &it->stack[it->depth - 1];
+  struct node node;
+  if (
+    read_node(it->trie, frame->offset, &node)
+    || node.label_len > it->trie->max_len - frame->name_len
+    || (it->depth > 1 && node.label_len == 0)
+  ) {
+    return true;
+  }
+  // Where the query ends within the label, the two agree
+  memcpy(it->name + frame->name_len, node.label, node.label_len);
+  it->len = frame->name_len + node.label_len;
+  frame->next_child = 0;
+  frame->children = node.children;
+  frame->yield = false;
+
+  if (it->module_path) {
+    // Cut at the first separator past the query
+    size_t from = frame->name_len > it->query_len ? frame->name_len : it->query_len;
+    for (size_t i = from; i < it->len; i++) {
+      if (is_separator(it->name[i])) {
+        it->len = i + 1;
+        it->count = node.count;
+        frame->children = 0;
+        frame->yield = true;
+        return false;
+      }
+    }
+  }
+  if (node.terminal) {
+    it->count = 1;
+    frame->yield = true;
+  }
+  return false;
+}
+
+int
+haskell_trie_iter_init(
+  struct haskell_trie_iter *it,
+  const struct haskell_trie *trie,
+  const char *prefix,
+  size_t len,
+  bool module_path
+) {
+  *it = (struct haskell_trie_iter) { .trie = trie, .query_len = len, .module_path = module_path };
+  it->name = malloc(trie->max_len + 1);
+  it->stack = malloc((trie->max_len + 2) * sizeof(struct haskell_trie_frame));
+  if (it->name == NULL || it->stack == NULL) {
+    haskell_trie_iter_free(it);
+    return -1;
+  }
+  if (len > trie->max_len) {
+    return 0;
+  }
+  memcpy(it->name, prefix, len);
+
+  // Walk down to the node where the prefix ends
+  size_t offset = 0;
+  size_t depth = 0;
+  while (true) {
+    struct node node;
+    if (read_node(trie, offset, &node)) {
+      return 0;
+    }
+    size_t n = len - depth < node.label_len ? len - depth : node.label_len;
+    if (memcmp(prefix + depth, node.label, n) != 0) {
+      return 0;
+    }
+    if (depth + node.label_len >= len) {
+      it->total = node.count;
+      it->stack[0] = (struct haskell_trie_frame) { .offset = offset, .name_len = depth };
+      it->depth = 1;
+      it->fresh = true;
+      return 0;
+    }
+    depth += node.label_len;
+    const uint8_t *child = memchr(node.first_bytes, (uint8_t) prefix[depth], node.children);
+    if (child == NULL) {
+      return 0;
+    }
+    size_t parent = offset;
+    if (child_offset(trie, parent, &node, child - node.first_bytes, &offset)) {
+      return 0;
+    }
+  }
+}
+
+bool
+haskell_trie_iter_next(struct haskell_trie_iter *it)
+{
+  while (it->depth > 0) {
+    struct haskell_trie_frame *frame = &it->stack[it->depth - 1];
+    if (it->fresh) {
+      it->fresh = false;
+      if (enter(it)) {
+        it->depth = 0;
+        return false;
+      }
+      if (frame->yield) {
+        it->name[it->len] = '\0';
+        return true;
+      }
+      continue;
+    }
+    if (frame->next_child == frame->children) {
+      it->depth--;
+      continue;
+    }
+    struct node node;
+    size_t offset;
+    if (
+      read_node(it->trie, frame->offset, &node)
+      || child_offset(it->trie, frame->offset, &node, frame->next_child, &offset)
+      || it->depth > it->trie->max_len
+    ) {
+      it->depth = 0;
+      return false;
+    }
+    frame->next_child++;
+    it->stack[it->depth++] = (struct haskell_trie_frame) {
+      .offset = offset,
+      .name_len = frame->name_len + node.label_len
+    };
+    it->fresh = true;
+  }
+  return false;
+}
+
+void
+haskell_trie_iter_free(struct haskell_trie_iter *it)
+{
+  free(it->name);
+  free(it->stack);
+  it->name = NULL;
+  it->stack = NULL;
+}
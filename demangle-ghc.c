@@ -27,10 +27,14 @@ appreciated.
 
 
 #include <ctype.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "demangle-ghc-internal.h"
+
 /*
 Demangles symbol names produced by the GHC haskell compiler.
 See https://gitlab.haskell.org/ghc/ghc/wikis/commentary/compiler/symbol-names
@@ -73,6 +77,8 @@ struct str_buf {
   size_t capacity;
   size_t length;
   char *data;
+  // Set when data belongs to the caller, and mustn't be reallocated
+  bool fixed;
 };
 
 enum result {
@@ -83,12 +89,18 @@ enum result {
 static
 enum result str_buf_push(struct str_buf *restrict buf, char c) {
   if (buf->length == buf->capacity) {
+    if (buf->fixed) {
+      return failure;
+    }
     // capacity := 1.5x
-    buf->capacity += buf->capacity / 2;
-    buf->data = realloc(buf->data, buf->capacity);
-    if (buf->data == NULL) {
+    size_t capacity = buf->capacity + buf->capacity / 2;
+    // On failure, data is left as it was, for the caller to free
+    char *data = realloc(buf->data, capacity);
+    if (data == NULL) {
       return failure;
     }
+    buf->data = data;
+    buf->capacity = capacity;
   }
   buf->data[buf->length++] = c;
   return success;
@@ -101,15 +113,19 @@ enum result str_buf_reserve(struct str_buf *restrict buf, size_t amt) {
   const size_t new_len = buf->length + amt;
   size_t capacity = buf->capacity;
   if (new_len > capacity) {
+    if (buf->fixed) {
+      return failure;
+    }
     if (new_len > capacity + capacity / 2) {
       capacity = new_len;
     } else {
       capacity += capacity / 2;
     }
-    buf->data = realloc(buf->data, capacity);
-    if (buf->data == NULL) {
+    char *data = realloc(buf->data, capacity);
+    if (data == NULL) {
       return failure;
     }
+    buf->data = data;
     buf->capacity = capacity;
   }
   return success;
@@ -127,61 +143,342 @@ enum result str_buf_push_str(struct str_buf *restrict buf, const char *str) {
   return success;
 }
 
+// Writes up to four bytes to out, returning how many
+// zero signals an error
+static
+size_t utf8_encode(uint32_t char_code, char *restrict out) {
+  if (char_code <= 0x7F) {
+    // Plain ASCII
+    out[0] = char_code;
+    return 1;
+  } else if (char_code <= 0x7FF) {
+    out[0] = ((char_code >> 6) & 0x1F) | 0xC0;
+    out[1] = ((char_code >> 0) & 0x3F) | 0x80;
+    return 2;
+  } else if (char_code <= 0xFFFF) {
+    out[0] = ((char_code >> 12) & 0x0F) | 0xE0;
+    out[1] = ((char_code >>  6) & 0x3F) | 0x80;
+    out[2] = ((char_code >>  0) & 0x3F) | 0x80;
+    return 3;
+  } else if (char_code <= 0x10FFFF) {
+    out[0] = ((char_code >> 18) & 0x07) | 0xF0;
+    out[1] = ((char_code >> 12) & 0x3F) | 0x80;
+    out[2] = ((char_code >>  6) & 0x3F) | 0x80;
+    out[3] = ((char_code >>  0) & 0x3F) | 0x80;
+    return 4;
+  }
+  return 0;
+}
+
+static inline
+size_t utf8_length(uint32_t char_code) {
+  return 1 + (char_code > 0x7F) + (char_code > 0x7FF) + (char_code > 0xFFFF);
+}
+
 // true signals an error
 static
 enum result str_buf_push_char_code(struct str_buf *restrict buf, uint32_t char_code) {
+  char bytes[4];
+  size_t len = utf8_encode(char_code, bytes);
+  if (len == 0) {
+    return failure;
+  }
   // This may look like up to three bytes too many, but GHC loves adding
   // suffixes to symbol names (_bytes, _info, _closure, _slow, _fast,
   // _srt, _str, _tbl, _btm, etc.)
   // In 99.9% of cases any overallocation will end up being used.
-  if (str_buf_reserve(buf, 4)) {
-    return failure;
-  }
-#define PUSH(c) buf->data[buf->length++] = c
-  if (char_code <= 0x7F) {
-    // Plain ASCII
-    PUSH(char_code);
-  } else if (char_code <= 0x7FF) {
-    PUSH(((char_code >> 6) & 0x1F) | 0xC0);
-    PUSH(((char_code >> 0) & 0x3F) | 0x80);
-  } else if (char_code <= 0xFFFF) {
-    PUSH(((char_code >> 12) & 0x0F) | 0xE0);
-    PUSH(((char_code >>  6) & 0x3F) | 0x80);
-    PUSH(((char_code >>  0) & 0x3F) | 0x80);
-  } else if (char_code <= 0x10FFFF) {
-    PUSH(((char_code >> 18) & 0x07) | 0xF0);
-    PUSH(((char_code >> 12) & 0x3F) | 0x80);
-    PUSH(((char_code >>  6) & 0x3F) | 0x80);
-    PUSH(((char_code >>  0) & 0x3F) | 0x80);
-  } else {
+  if (str_buf_reserve(buf, buf->fixed ? len : 4)) {
     return failure;
   }
+  memcpy(&buf->data[buf->length], bytes, len);
+  buf->length += len;
   return success;
-#undef PUSH
 }
 
+#if defined(__GNUC__) && defined(__BYTE_ORDER__)
+#define HAVE_SWAR 1
+
+#define ONES 0x0101010101010101ull
+#define HIGHS 0x8080808080808080ull
+// High bit set in each byte of x that is zero, exact up to the first
+#define SWAR_ZERO(x) (((x) - ONES) & ~(x) & HIGHS)
+// High bit set in each byte of x that is > m and < n, for ASCII x
+#define SWAR_BETWEEN(x, m, n) \
+  ((ONES * (127 + (n)) - ((x) & ONES * 127)) & ~(x) & (((x) & ONES * 127) + ONES * (127 - (m))) & HIGHS)
+
+// Encodes a code point as UTF-8, in the low bytes of the result, first
+// byte lowest, without branching on its length.
+static inline
+uint32_t utf8_encode_word(uint32_t char_code, size_t *len) {
+  *len = 1 + (char_code > 0x7F) + (char_code > 0x7FF) + (char_code > 0xFFFF);
+  // Six bits per byte, as if it were four bytes long
+  uint32_t spread =
+    ((char_code >> 18) & 0x07)
+    | ((char_code >> 12) & 0x3F) << 8
+    | ((char_code >> 6) & 0x3F) << 16
+    | (char_code & 0x3F) << 24;
+  static const uint32_t markers[5] = { 0, 0, 0x80C0, 0x8080E0, 0x808080F0 };
+  uint32_t word = spread >> (8 * (4 - *len));
+  // ASCII has a seventh bit
+  word |= *len == 1 ? char_code : markers[*len];
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap32(word);
+#endif
+  return word;
+}
+
+/*
+Decodes a run of "z<hex>U" escapes, starting at the first hex digit of the
+first, and returns where it stopped: at the start of an escape it couldn't
+decode, or just after the run. If that's `p`, it decoded nothing. It stops
+before the output passes `limit`. Returns NULL if memory ran out, when
+whatever it decoded is left in buf, to be thrown away.
+
+Each escape's hex digits are validated and converted eight bytes at a time,
+and each code point is encoded without branching on its length. Anything
+unusual, including errors and escapes near the end of the input, is left to
+the byte at a time loop.
+*/
+static
+const char *decode_char_codes(struct str_buf *restrict buf, const char *p, const char *end, size_t limit) {
+  const char *digits = p;
+  const char *stop = p;
+  while (end - digits >= 8) {
+    uint64_t word;
+    memcpy(&word, digits, 8);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    uint64_t u = SWAR_ZERO(word ^ (ONES * 'U'));
+    if (u == 0) {
+      break;
+    }
+    // Number of hex digits, GHC uses at most seven
+    size_t n = __builtin_ctzll(u) / 8;
+    uint64_t mask = n == 0 ? 0 : ~0ull >> (64 - 8 * n);
+    uint64_t hex = SWAR_BETWEEN(word, '0' - 1, '9' + 1) | SWAR_BETWEEN(word, 'a' - 1, 'f' + 1);
+    if (n == 0 || (hex & mask) != (HIGHS & mask)) {
+      break;
+    }
+
+    // '0' - '9' -> 0 - 9, 'a' - 'f' -> 10 - 15
+    uint64_t nibbles = ((word & ONES * 0x0F) + ((word >> 6) & ONES) * 9) & mask;
+    // The first digit is the most significant, move it to the top
+    nibbles = __builtin_bswap64(nibbles) >> (64 - 8 * n);
+    nibbles = (nibbles | (nibbles >> 4)) & 0x00FF00FF00FF00FFull;
+    nibbles = (nibbles | (nibbles >> 8)) & 0x0000FFFF0000FFFFull;
+    nibbles = (nibbles | (nibbles >> 16)) & 0x00000000FFFFFFFFull;
+    uint32_t char_code = nibbles;
+    if (char_code > 0x10FFFF) {
+      break;
+    }
+
+    // Anything near the limit is left to the byte at a time loop, which
+    // checks it exactly
+    if (limit - buf->length < 4) {
+      break;
+    }
+    // A caller's buffer can't grow, so its last few bytes are left to the
+    // byte at a time loop too
+    if (buf->capacity - buf->length < 4) {
+      if (buf->fixed) {
+        break;
+      }
+      if (str_buf_reserve(buf, 4)) {
+        return NULL;
+      }
+    }
+    // Writes four bytes, any extra are overwritten by what comes next
+    size_t len;
+    uint32_t utf8 = utf8_encode_word(char_code, &len);
+    memcpy(&buf->data[buf->length], &utf8, 4);
+    buf->length += len;
+
+    stop = digits + n + 1;
+    if (end - stop < 2 || stop[0] != 'z' || (unsigned) (stop[1] - '0') > 9) {
+      break;
+    }
+    digits = stop + 1;
+  }
+  return stop;
+}
+
+// The character a two character escape at p stands for, or '\0' if it
+// isn't one
+static inline
+char simple_escape(const char *p, const char *end) {
+  if (end - p < 2) {
+    return '\0';
+  }
+  char d = p[1];
+  if (p[0] == 'z' && d >= 'a' && d <= 'z') {
+    return z_chars[d - 'a'];
+  } else if (p[0] == 'Z' && d >= 'C' && d <= 'Z') {
+    return Z_chars[d - 'C'];
+  }
+  return '\0';
+}
+
+/*
+Decodes a symbol made of plain characters and two character escapes, which
+most short GHC labels are, into `out`, which must have room for the whole
+input. Plain runs are found eight bytes at a time, and copied as words.
+Returns how many bytes it wrote, or -1 if it meets anything else, which
+demangle_span should deal with.
+*/
+static
+ptrdiff_t decode_simple(char *restrict out, const char *p, const char *end) {
+  char *const out_start = out;
+  for (;;) {
+    while (end - p >= 8) {
+      uint64_t word;
+      memcpy(&word, p, 8);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+      uint64_t le = __builtin_bswap64(word);
+#else
+      uint64_t le = word;
+#endif
+      uint64_t stops = SWAR_ZERO(le ^ (ONES * 'z')) | SWAR_ZERO(le ^ (ONES * 'Z')) | SWAR_ZERO(le);
+      // The output never gets ahead of the input, so this fits
+      memcpy(out, p, 8);
+      if (stops == 0) {
+        out += 8;
+        p += 8;
+        continue;
+      }
+      size_t n = __builtin_ctzll(stops) / 8;
+      out += n;
+      p += n;
+      break;
+    }
+    while (p < end && *p != 'z' && *p != 'Z' && *p != '\0') {
+      *out++ = *p++;
+    }
+    if (p == end || *p == '\0') {
+      return out - out_start;
+    }
+    char decoded = simple_escape(p, end);
+    if (decoded == '\0') {
+      return -1;
+    }
+    *out++ = decoded;
+    p += 2;
+  }
+}
+
+// Like decode_simple, but only counts the bytes it would write
+static
+ptrdiff_t measure_simple(const char *p, const char *end) {
+  const char *const start = p;
+  size_t escapes = 0;
+  for (;;) {
+    while (end - p >= 8) {
+      uint64_t word;
+      memcpy(&word, p, 8);
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+      uint64_t le = __builtin_bswap64(word);
+#else
+      uint64_t le = word;
+#endif
+      uint64_t stops = SWAR_ZERO(le ^ (ONES * 'z')) | SWAR_ZERO(le ^ (ONES * 'Z')) | SWAR_ZERO(le);
+      if (stops == 0) {
+        p += 8;
+        continue;
+      }
+      p += __builtin_ctzll(stops) / 8;
+      break;
+    }
+    while (p < end && *p != 'z' && *p != 'Z' && *p != '\0') {
+      p++;
+    }
+    if (p == end || *p == '\0') {
+      return (p - start) - escapes;
+    }
+    if (simple_escape(p, end) == '\0') {
+      return -1;
+    }
+    escapes++;
+    p += 2;
+  }
+}
+
+#undef ONES
+#undef HIGHS
+#undef SWAR_ZERO
+#undef SWAR_BETWEEN
+#endif
+
 // The longest symbol name produced by GHC in a large shared library
 // I tested, was 163 bytes long. The demangled output was 145 bytes.
 #define DEFAULT_BUF_SIZE 160
 
+// GHC itself won't make tuples with more than 64 fields
+#define DEFAULT_MAX_ARITY 1024
+
+const struct haskell_demangle_limits haskell_default_limits = {
+  .max_output = 0,
+  .max_arity = DEFAULT_MAX_ARITY,
+  .max_expansion = 0
+};
+
+// Tuples, boxed and unboxed, including "(# #)" for Z1H, are the only
+// escapes that demangle to more bytes than they take up, so checking them
+// before reserving space bounds the output.
+static
+enum haskell_demangle_error check_tuple(
+  const struct haskell_demangle_limits *restrict limits,
+  uint32_t arity,
+  size_t out_len,
+  size_t in_len
+) {
+  if (limits->max_arity != 0 && arity > limits->max_arity) {
+    return HASKELL_DEMANGLE_TOO_MANY_FIELDS;
+  }
+  if (limits->max_output != 0 && out_len > limits->max_output) {
+    return HASKELL_DEMANGLE_TOO_LONG;
+  }
+  if (
+    limits->max_expansion != 0
+    && in_len < SIZE_MAX / limits->max_expansion
+    && out_len > limits->max_expansion * in_len
+  ) {
+    return HASKELL_DEMANGLE_TOO_EXPANSIVE;
+  }
+  return HASKELL_DEMANGLE_OK;
+}
+
 #define PEEK c
-#define ADVANCE c = (*mangled++)
+#define ADVANCE c = (mangled == end ? '\0' : *mangled++)
 #define EXPECT(c) if (PEEK != (c)) { goto fail; }
 #define EXPECT_BETWEEN(start, end) if (PEEK < (start) || PEEK > (end)) { goto fail; }
-#define PUSH(c) if (str_buf_push(&buf, (c)) == failure) goto fail;
-#define PUSH_STR(s) if (str_buf_push_str(&buf, (s)) == failure) goto fail;
-#define PUSH_CHAR_CODE(code) if (str_buf_push_char_code(&buf, (code)) == failure) goto fail;
-#define RESERVE(n) if (str_buf_reserve(&buf, (n)) == failure) goto fail;
-
-char *
-haskell_demangle(const char *mangled)
-{
-  struct str_buf buf = {
-    .capacity = DEFAULT_BUF_SIZE,
-    .length = 0,
-    .data = malloc(DEFAULT_BUF_SIZE)
-  };
+#define NO_MEMORY { error = HASKELL_DEMANGLE_NO_MEMORY; goto fail; }
+// Checked before anything's written, so the output never passes the limit
+#define LIMIT(n) if ((n) > limit - buf->length) { error = HASKELL_DEMANGLE_TOO_LONG; goto fail; }
+#define PUSH(c) LIMIT(1) if (str_buf_push(buf, (c)) == failure) NO_MEMORY
+#define PUSH_STR(s) LIMIT(strlen(s)) if (str_buf_push_str(buf, (s)) == failure) NO_MEMORY
+#define PUSH_CHAR_CODE(code) LIMIT(utf8_length(code)) if (str_buf_push_char_code(buf, (code)) == failure) NO_MEMORY
+#define RESERVE(n) LIMIT(n) if (str_buf_reserve(buf, (n)) == failure) NO_MEMORY
+#define CHECK_TUPLE(n) { \
+    enum haskell_demangle_error tuple_error = check_tuple(limits, arity, buf->length - start + (n), end - begin); \
+    if (tuple_error != HASKELL_DEMANGLE_OK) { error = tuple_error; goto fail; } \
+  } \
+  RESERVE(n);
 
+// Demangles [mangled, end) onto the end of buf.
+static
+enum haskell_demangle_error demangle_span(
+  struct str_buf *restrict buf,
+  const char *mangled,
+  const char *end,
+  const struct haskell_demangle_limits *restrict limits
+) {
+  enum haskell_demangle_error error = HASKELL_DEMANGLE_INVALID;
+  const char *begin = mangled;
+  const size_t start = buf->length;
+  // Where the output has to stop
+  const size_t limit = limits->max_output == 0 || limits->max_output > SIZE_MAX - start
+    ? SIZE_MAX
+    : start + limits->max_output;
   char c;
   ADVANCE;
 
@@ -192,6 +489,17 @@ haskell_demangle(const char *mangled)
         // Parses hex code, but if it starts with 'a' - 'z',
         // it will always be prefixed by a '0'.
         if (isdigit(PEEK)) {
+#ifdef HAVE_SWAR
+          const char *next = decode_char_codes(buf, mangled - 1, end, limit);
+          if (next == NULL) {
+            NO_MEMORY
+          }
+          if (next != mangled - 1) {
+            mangled = next;
+            ADVANCE;
+            continue;
+          }
+#endif
           uint32_t char_code = 0;
           do {
             char_code *= 16;
@@ -200,6 +508,9 @@ haskell_demangle(const char *mangled)
             } else {
               char_code += 10 + PEEK - 'a';
             }
+            if (char_code > 0x10FFFF) {
+              goto fail;
+            }
             ADVANCE;
           } while (isxdigit(PEEK));
           EXPECT('U');
@@ -220,6 +531,9 @@ haskell_demangle(const char *mangled)
         if (isdigit(PEEK)) {
           uint32_t arity = 0;
           do {
+            if (arity > (UINT32_MAX - 9) / 10) {
+              goto fail;
+            }
             arity *= 10;
             arity += PEEK - '0';
             ADVANCE;
@@ -230,19 +544,19 @@ haskell_demangle(const char *mangled)
               switch (arity) {
                 case 0:
                   RESERVE(2);
-                  buf.data[buf.length++] = '(';
-                  buf.data[buf.length++] = ')';
+                  buf->data[buf->length++] = '(';
+                  buf->data[buf->length++] = ')';
                   continue;
                 case 1:
                   goto fail;
                 default:
                   // Two for "()", and one per comma
-                  RESERVE(arity + 1);
-                  buf.data[buf.length++] = '(';
+                  CHECK_TUPLE((size_t) arity + 1);
+                  buf->data[buf->length++] = '(';
                   for (size_t i = 1; i < arity; i++) {
-                    buf.data[buf.length++] = ',';
+                    buf->data[buf->length++] = ',';
                   }
-                  buf.data[buf.length++] = ')';
+                  buf->data[buf->length++] = ')';
                   continue;
               }
               continue;
@@ -252,18 +566,21 @@ haskell_demangle(const char *mangled)
                 case 0:
                   goto fail;
                 case 1:
-                  PUSH_STR("(# #)");
+                  // The unboxed unit, "(# #)", is longer than its escape
+                  CHECK_TUPLE(5);
+                  memcpy(&buf->data[buf->length], "(# #)", 5);
+                  buf->length += 5;
                   continue;
                 default:
                   // Four for "(##)", and one per comma
-                  RESERVE(arity + 3);
-                  buf.data[buf.length++] = '(';
-                  buf.data[buf.length++] = '#';
+                  CHECK_TUPLE((size_t) arity + 3);
+                  buf->data[buf->length++] = '(';
+                  buf->data[buf->length++] = '#';
                   for (size_t i = 1; i < arity; i++) {
-                    buf.data[buf.length++] = ',';
+                    buf->data[buf->length++] = ',';
                   }
-                  buf.data[buf.length++] = '#';
-                  buf.data[buf.length++] = ')';
+                  buf->data[buf->length++] = '#';
+                  buf->data[buf->length++] = ')';
                   continue;
               }
               continue;
@@ -282,12 +599,7 @@ haskell_demangle(const char *mangled)
         }
         continue;
       case '\0':
-        PUSH('\0');
-        char *res = realloc(buf.data, buf.length);
-        if (res == NULL) {
-          goto fail;
-        }
-        return res;
+        return HASKELL_DEMANGLE_OK;
       default:
         PUSH(PEEK);
         ADVANCE;
@@ -295,7 +607,881 @@ haskell_demangle(const char *mangled)
     }
   }
 
+fail:
+  return error;
+}
+
+#undef PEEK
+#undef ADVANCE
+#undef EXPECT
+#undef EXPECT_BETWEEN
+#undef NO_MEMORY
+#undef LIMIT
+#undef PUSH
+#undef PUSH_STR
+#undef PUSH_CHAR_CODE
+#undef RESERVE
+#undef CHECK_TUPLE
+
+// Demangles [mangled, end) into a fresh NUL-terminated string
+static
+char *demangle_to_str(
+  const char *mangled,
+  const char *end,
+  const struct haskell_demangle_limits *limits,
+  enum haskell_demangle_error *error
+) {
+  struct str_buf buf = {
+    .capacity = DEFAULT_BUF_SIZE,
+    .length = 0,
+    .data = malloc(DEFAULT_BUF_SIZE)
+  };
+  if (buf.data == NULL) {
+    *error = HASKELL_DEMANGLE_NO_MEMORY;
+    return NULL;
+  }
+  *error = demangle_span(&buf, mangled, end, limits);
+  if (*error == HASKELL_DEMANGLE_OK && str_buf_push(&buf, '\0')) {
+    *error = HASKELL_DEMANGLE_NO_MEMORY;
+  }
+  if (*error != HASKELL_DEMANGLE_OK) {
+    free(buf.data);
+    return NULL;
+  }
+  char *res = realloc(buf.data, buf.length);
+  if (res == NULL) {
+    *error = HASKELL_DEMANGLE_NO_MEMORY;
+    free(buf.data);
+  }
+  return res;
+}
+
+char *
+haskell_demangle(const char *mangled)
+{
+  enum haskell_demangle_error error;
+  return demangle_to_str(mangled, mangled + strlen(mangled), &haskell_default_limits, &error);
+}
+
+char *
+haskell_demangle_n(const char *mangled, size_t len)
+{
+  enum haskell_demangle_error error;
+  return demangle_to_str(mangled, mangled + len, &haskell_default_limits, &error);
+}
+
+char *
+haskell_demangle_limited(
+  const char *mangled,
+  size_t len,
+  const struct haskell_demangle_limits *limits,
+  enum haskell_demangle_error *error
+) {
+  return demangle_to_str(mangled, mangled + len, limits, error);
+}
+
+const char *
+haskell_demangle_strerror(enum haskell_demangle_error error)
+{
+  switch (error) {
+    case HASKELL_DEMANGLE_OK:
+      return "success";
+    case HASKELL_DEMANGLE_INVALID:
+      return "not a valid z-encoded name";
+    case HASKELL_DEMANGLE_NO_MEMORY:
+      return "out of memory";
+    case HASKELL_DEMANGLE_TOO_LONG:
+      return "demangled name is too long";
+    case HASKELL_DEMANGLE_TOO_MANY_FIELDS:
+      return "tuple has too many fields";
+    case HASKELL_DEMANGLE_TOO_EXPANSIVE:
+      return "demangled name is too long for its input";
+  }
+  return "unknown error";
+}
+
+// Symbols are taken in groups, so that space for the whole group can be
+// reserved at once
+#define BATCH_LANES 16
+
+// Demangles one symbol of a batch onto the end of its data
+// true signals an error
+static
+enum result demangle_lane(
+  struct str_buf *restrict buf,
+  const char *mangled,
+  size_t len,
+  struct haskell_batch *out,
+  size_t i
+) {
+  size_t start = buf->length;
+  enum haskell_demangle_error error = HASKELL_DEMANGLE_INVALID;
+#ifdef HAVE_SWAR
+  if (buf->capacity - buf->length >= len) {
+    ptrdiff_t written = decode_simple(&buf->data[buf->length], mangled, mangled + len);
+    if (written >= 0) {
+      buf->length += written;
+      error = HASKELL_DEMANGLE_OK;
+    }
+  }
+#endif
+  if (error != HASKELL_DEMANGLE_OK) {
+    error = demangle_span(buf, mangled, mangled + len, &haskell_default_limits);
+  }
+  if (error == HASKELL_DEMANGLE_OK) {
+    out->validity[i / 8] |= 1 << (i % 8);
+  } else if (error == HASKELL_DEMANGLE_NO_MEMORY) {
+    return failure;
+  } else {
+    // Nulls take up no space
+    buf->length = start;
+    out->null_count++;
+  }
+  out->offsets[i + 1] = buf->length;
+  return success;
+}
+
+int
+haskell_demangle_batch(
+  const char *const *symbols,
+  const size_t *lens,
+  size_t count,
+  struct haskell_batch *out
+) {
+  *out = (struct haskell_batch) { .count = count };
+  struct str_buf buf = {
+    .capacity = count * 32 > DEFAULT_BUF_SIZE ? count * 32 : DEFAULT_BUF_SIZE,
+    .length = 0,
+  };
+  buf.data = malloc(buf.capacity);
+  out->validity = calloc((count + 7) / 8, 1);
+  out->offsets = malloc((count + 1) * sizeof(int64_t));
+  if (buf.data == NULL || out->validity == NULL || out->offsets == NULL) {
+    goto fail;
+  }
+
+  out->offsets[0] = 0;
+  for (size_t group = 0; group < count; group += BATCH_LANES) {
+    size_t lanes = count - group < BATCH_LANES ? count - group : BATCH_LANES;
+    size_t lane_lens[BATCH_LANES];
+    size_t total = 0;
+    for (size_t lane = 0; lane < lanes; lane++) {
+      size_t i = group + lane;
+#ifdef __GNUC__
+      // Symbols are usually scattered through a large string table, so
+      // start fetching the next group's while this one is decoded
+      if (i + BATCH_LANES < count) {
+        __builtin_prefetch(symbols[i + BATCH_LANES]);
+      }
+#endif
+      lane_lens[lane] = lens == NULL ? strlen(symbols[i]) : lens[i];
+      total += lane_lens[lane];
+    }
+    // Enough for every lane that takes the fast path
+    if (str_buf_reserve(&buf, total)) {
+      goto fail;
+    }
+    for (size_t lane = 0; lane < lanes; lane++) {
+      size_t i = group + lane;
+      if (demangle_lane(&buf, symbols[i], lane_lens[lane], out, i)) {
+        goto fail;
+      }
+    }
+  }
+  out->data = buf.data;
+  out->data_len = buf.length;
+  out->entries = count;
+  return 0;
+
+fail:
+  free(buf.data);
+  haskell_batch_free(out);
+  return -1;
+}
+
+void
+haskell_batch_free(struct haskell_batch *batch)
+{
+  free(batch->validity);
+  free(batch->offsets);
+  free(batch->data);
+  free(batch->indices);
+  *batch = (struct haskell_batch) { 0 };
+}
+
+const char *
+haskell_batch_get(const struct haskell_batch *batch, size_t i, size_t *len)
+{
+  if ((batch->validity[i / 8] & (1 << (i % 8))) == 0) {
+    return NULL;
+  }
+  size_t entry = batch->indices == NULL ? i : batch->indices[i];
+  *len = batch->offsets[entry + 1] - batch->offsets[entry];
+  return &batch->data[batch->offsets[entry]];
+}
+
+// Suffixes GHC appends to the names of a binder's closures and tables
+static
+const char *const binder_suffixes[] = {
+  "_con_info",
+  "_con_entry",
+  "_static_info",
+  "_info",
+  "_closure",
+  "_entry",
+  "_slow",
+  "_fast",
+  "_srt",
+  "_str",
+  "_bytes",
+  "_tbl",
+  "_btm",
+  "_ret",
+  "_dsp",
+};
+
+// Whether a component is a unit ID. The main package's symbols have no
+// unit, so a unit is told apart from a module by being lower case, as the
+// wired-in units ("base", "ghczmprim") are, or by having a version, as
+// every other unit does ("QuickCheckzm2zi14zi3zmAbC").
+static
+bool is_unit(const char *s, size_t len) {
+  if (*s >= 'a' && *s <= 'z') {
+    return true;
+  }
+  for (size_t i = 0; i + 2 < len; i++) {
+    if (s[i] != 'z' && s[i] != 'Z') {
+      continue;
+    }
+    if (s[i] == 'z' && s[i + 1] == 'm' && s[i + 2] >= '0' && s[i + 2] <= '9') {
+      return true;
+    }
+    // Skip the escape's second character
+    i++;
+  }
+  return false;
+}
+
+bool
+haskell_is_unique(const char *s, size_t len)
+{
+  if (len < 2 || s[0] < 'a' || s[0] > 'y') {
+    return false;
+  }
+  bool digit = false;
+  for (size_t i = 1; i < len; i++) {
+    if (s[i] >= '0' && s[i] <= '9') {
+      digit = true;
+    } else if (!((s[i] >= 'a' && s[i] <= 'y') || (s[i] >= 'A' && s[i] <= 'Y'))) {
+      return false;
+    }
+  }
+  return digit;
+}
+
+bool
+haskell_split_name(const char *name, size_t len, struct haskell_name_parts *parts)
+{
+  const char *end = name + len;
+  const char *first_end = memchr(name, '_', len);
+  if (first_end == NULL) {
+    return false;
+  }
+  const char *module = name;
+  if (
+    memchr(first_end + 1, '_', end - first_end - 1) != NULL
+    && is_unit(name, first_end - name)
+  ) {
+    module = first_end + 1;
+  }
+  const char *module_end = memchr(module, '_', end - module);
+  if (!(*module >= 'A' && *module <= 'Z') || module_end == NULL || module_end + 1 == end) {
+    return false;
+  }
+  const char *binder = module_end + 1;
+  const char *binder_end = memchr(binder, '_', end - binder);
+  *parts = (struct haskell_name_parts) {
+    .unit_len = module == name ? 0 : first_end - name,
+    .module_start = module - name,
+    .module_end = module_end - name,
+    .binder_start = binder - name,
+    .binder_end = (binder_end == NULL ? end : binder_end) - name
+  };
+  return true;
+}
+
+char *
+haskell_demangle_binder(const char *mangled)
+{
+  enum haskell_demangle_error error;
+  const char *end = mangled + strlen(mangled);
+
+  for (size_t i = 0; i < sizeof(binder_suffixes) / sizeof(binder_suffixes[0]); i++) {
+    size_t len = strlen(binder_suffixes[i]);
+    if ((size_t) (end - mangled) > len && memcmp(end - len, binder_suffixes[i], len) == 0) {
+      end -= len;
+      break;
+    }
+  }
+
+  // The binder comes straight after the module, before any unique
+  struct haskell_name_parts parts;
+  if (haskell_split_name(mangled, end - mangled, &parts)) {
+    return demangle_to_str(mangled + parts.binder_start, mangled + parts.binder_end, &haskell_default_limits, &error);
+  }
+
+  // No module, so the binder's the last component, unless that's a local
+  // binder's unique, as in "sat_s1Abc"
+  const char *start = end;
+  while (start > mangled && start[-1] != '_') {
+    start--;
+  }
+  if (start > mangled && haskell_is_unique(start, end - start)) {
+    end = start - 1;
+    start = end;
+    while (start > mangled && start[-1] != '_') {
+      start--;
+    }
+  }
+  if (start > mangled) {
+    return demangle_to_str(start, end, &haskell_default_limits, &error);
+  }
+
+  // No module component, but this may still be a qualified name, such as
+  // "DataziMapziinsertWith". A "zi" is only a '.' if it's preceded by an
+  // even number of 'z's, otherwise its 'z' closes a "zz".
+  // Leave at least one character after the "zi"
+  size_t i = end - mangled >= 3 ? end - mangled - 2 : 0;
+  while (i-- > 0) {
+    if (mangled[i] != 'z' || mangled[i + 1] != 'i') {
+      continue;
+    }
+    size_t run = i;
+    while (run > 0 && mangled[run - 1] == 'z') {
+      run--;
+    }
+    if ((i - run) % 2 == 0) {
+      start = &mangled[i + 2];
+      break;
+    }
+    i = run;
+  }
+  return demangle_to_str(start, end, &haskell_default_limits, &error);
+}
+/*
+A decoder that yields one demangled byte at a time, so that names can be
+compared without demangling them up front.
+
+If an escape is malformed, the decoder passes the rest of the input through
+as it is, so that every string has a well defined place in the order.
+Tuples wider than the default limit count as malformed, so comparing two
+names never walks billions of commas.
+*/
+struct lazy_decoder {
+  const char *mangled;
+  // NULL for NUL-terminated input
+  const char *end;
+  bool raw;
+  // Wider tuples are malformed
+  uint32_t max_arity;
+  // Output of the last escape: bytes, then commas, then tail
+  uint8_t pos;
+  uint8_t len;
+  char bytes[6];
+  uint32_t commas;
+  const char *tail;
+};
+
+static
+void lazy_decoder_init(struct lazy_decoder *d, const char *mangled, const char *end) {
+  *d = (struct lazy_decoder) {
+    .mangled = mangled,
+    .end = end,
+    .max_arity = DEFAULT_MAX_ARITY,
+    .tail = ""
+  };
+}
+
+#define AT(p) ((p) == d->end ? '\0' : *(p))
+
+// Decodes the escape at d->mangled into the decoder's output
+// true signals an error
+static
+enum result lazy_decoder_escape(struct lazy_decoder *restrict d) {
+  const char *p = d->mangled;
+  char kind = *p++;
+  char c = AT(p);
+  d->pos = 0;
+  d->len = 0;
+  if (kind == 'z') {
+    if (isdigit(c)) {
+      uint32_t char_code = 0;
+      do {
+        char_code *= 16;
+        if (c <= '9') {
+          char_code += c - '0';
+        } else {
+          char_code += 10 + c - 'a';
+        }
+        if (char_code > 0x10FFFF) {
+          return failure;
+        }
+        p++;
+        c = AT(p);
+      } while (isxdigit(c));
+      if (c != 'U') {
+        return failure;
+      }
+      d->len = utf8_encode(char_code, d->bytes);
+      if (d->len == 0) {
+        return failure;
+      }
+    } else if (c >= 'a' && c <= 'z' && z_chars[c - 'a'] != '\0') {
+      d->bytes[d->len++] = z_chars[c - 'a'];
+    } else {
+      return failure;
+    }
+  } else if (isdigit(c)) {
+    uint32_t arity = 0;
+    do {
+      if (arity > (UINT32_MAX - 9) / 10) {
+        return failure;
+      }
+      arity *= 10;
+      arity += c - '0';
+      p++;
+      c = AT(p);
+    } while (isdigit(c));
+    if (arity > d->max_arity) {
+      return failure;
+    }
+    if (c == 'T' && arity == 0) {
+      memcpy(d->bytes, "()", d->len = 2);
+    } else if (c == 'T' && arity > 1) {
+      d->bytes[d->len++] = '(';
+      d->commas = arity - 1;
+      d->tail = ")";
+    } else if (c == 'H' && arity == 1) {
+      memcpy(d->bytes, "(# #)", d->len = 5);
+    } else if (c == 'H' && arity > 1) {
+      memcpy(d->bytes, "(#", d->len = 2);
+      d->commas = arity - 1;
+      d->tail = "#)";
+    } else {
+      return failure;
+    }
+  } else if (c >= 'C' && c <= 'Z' && Z_chars[c - 'C'] != '\0') {
+    d->bytes[d->len++] = Z_chars[c - 'C'];
+  } else {
+    return failure;
+  }
+  d->mangled = p + 1;
+  return success;
+}
+
+// Returns the next demangled byte, or -1 at the end of the input
+static inline
+int lazy_decoder_next(struct lazy_decoder *restrict d) {
+  for (;;) {
+    if (d->pos < d->len) {
+      return (unsigned char) d->bytes[d->pos++];
+    }
+    if (d->commas > 0) {
+      d->commas--;
+      return ',';
+    }
+    if (*d->tail != '\0') {
+      return (unsigned char) *d->tail++;
+    }
+    char c = AT(d->mangled);
+    if (c == '\0') {
+      return -1;
+    }
+    if (d->raw || (c != 'z' && c != 'Z')) {
+      d->mangled++;
+      return (unsigned char) c;
+    }
+    if (lazy_decoder_escape(d)) {
+      d->raw = true;
+    }
+  }
+}
+
+#undef AT
+
+int
+haskell_demangled_cmp(const char *a, const char *b)
+{
+  struct lazy_decoder da;
+  struct lazy_decoder db;
+  lazy_decoder_init(&da, a, NULL);
+  lazy_decoder_init(&db, b, NULL);
+  for (;;) {
+    int ca = lazy_decoder_next(&da);
+    int cb = lazy_decoder_next(&db);
+    if (ca != cb) {
+      return ca < cb ? -1 : 1;
+    }
+    if (ca < 0) {
+      return 0;
+    }
+  }
+}
+
+uint64_t
+haskell_demangled_key(const char *mangled)
+{
+  struct lazy_decoder d;
+  lazy_decoder_init(&d, mangled, NULL);
+  uint64_t key = 0;
+  for (int i = 0; i < 8; i++) {
+    int c = lazy_decoder_next(&d);
+    key <<= 8;
+    if (c >= 0) {
+      key |= c;
+    }
+  }
+  return key;
+}
+
+enum haskell_demangle_error
+haskell_demangled_length(
+  const char *mangled,
+  size_t len,
+  const struct haskell_demangle_limits *limits,
+  size_t *out_len
+) {
+  const char *end = mangled + len;
+#ifdef HAVE_SWAR
+  ptrdiff_t simple = measure_simple(mangled, end);
+  if (simple >= 0) {
+    if (limits->max_output != 0 && (size_t) simple > limits->max_output) {
+      return HASKELL_DEMANGLE_TOO_LONG;
+    }
+    *out_len = simple;
+    return HASKELL_DEMANGLE_OK;
+  }
+#endif
+  // This mirrors demangle_span's checks, in the same order, so that the
+  // two always agree
+  const size_t limit = limits->max_output == 0 ? SIZE_MAX : limits->max_output;
+  struct lazy_decoder d;
+  lazy_decoder_init(&d, mangled, end);
+  // check_tuple applies the caller's limit, with its own error
+  d.max_arity = UINT32_MAX;
+  size_t length = 0;
+  while (d.mangled != end && *d.mangled != '\0') {
+    char c = *d.mangled;
+    if (c != 'z' && c != 'Z') {
+      if (length == limit) {
+        return HASKELL_DEMANGLE_TOO_LONG;
+      }
+      length++;
+      d.mangled++;
+      continue;
+    }
+    const char *escape = d.mangled;
+    if (lazy_decoder_escape(&d)) {
+      return HASKELL_DEMANGLE_INVALID;
+    }
+    size_t escape_len = d.len + d.commas + strlen(d.tail);
+    // Tuples, and "(# #)", which is longer than its escape
+    if (d.commas > 0 || escape_len > (size_t) (d.mangled - escape)) {
+      enum haskell_demangle_error error = check_tuple(limits, d.commas + 1, length + escape_len, len);
+      if (error != HASKELL_DEMANGLE_OK) {
+        return error;
+      }
+    }
+    if (escape_len > limit - length) {
+      return HASKELL_DEMANGLE_TOO_LONG;
+    }
+    length += escape_len;
+    d.commas = 0;
+    d.tail = "";
+  }
+  *out_len = length;
+  return HASKELL_DEMANGLE_OK;
+}
+
+enum haskell_demangle_error
+haskell_demangle_into(
+  const char *mangled,
+  size_t len,
+  const struct haskell_demangle_limits *limits,
+  char *out,
+  size_t out_len,
+  size_t *written
+) {
+#ifdef HAVE_SWAR
+  // decode_simple needs room for the whole input, which an exactly sized
+  // buffer only has if there are no escapes, so it goes through scratch
+  // space otherwise
+  char scratch[DEFAULT_BUF_SIZE * 2];
+  char *dst = out_len >= len ? out : len <= sizeof(scratch) ? scratch : NULL;
+  if (dst != NULL) {
+    ptrdiff_t n = decode_simple(dst, mangled, mangled + len);
+    if (
+      n >= 0
+      && (size_t) n <= out_len
+      && (limits->max_output == 0 || (size_t) n <= limits->max_output)
+    ) {
+      if (dst == scratch) {
+        memcpy(out, scratch, n);
+      }
+      *written = n;
+      return HASKELL_DEMANGLE_OK;
+    }
+  }
+#endif
+  struct str_buf buf = {
+    .capacity = out_len,
+    .length = 0,
+    .data = out,
+    .fixed = true
+  };
+  enum haskell_demangle_error error = demangle_span(&buf, mangled, mangled + len, limits);
+  // Nothing is allocated, so running out of space just means it's too long
+  if (error == HASKELL_DEMANGLE_NO_MEMORY) {
+    error = HASKELL_DEMANGLE_TOO_LONG;
+  }
+  *written = buf.length;
+  return error;
+}
+
+// Decodes one UTF-8 sequence, returning its length, or zero if it's invalid.
+static
+size_t utf8_decode(const unsigned char *s, uint32_t *char_code) {
+  size_t len;
+  uint32_t code;
+  if (s[0] < 0x80) {
+    *char_code = s[0];
+    return 1;
+  } else if ((s[0] & 0xE0) == 0xC0) {
+    len = 2;
+    code = s[0] & 0x1F;
+  } else if ((s[0] & 0xF0) == 0xE0) {
+    len = 3;
+    code = s[0] & 0x0F;
+  } else if ((s[0] & 0xF8) == 0xF0) {
+    len = 4;
+    code = s[0] & 0x07;
+  } else {
+    return 0;
+  }
+  for (size_t i = 1; i < len; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+    code = (code << 6) | (s[i] & 0x3F);
+  }
+  *char_code = code;
+  return len;
+}
+
+// z-encodes `str`, the inverse of haskell_demangle.
+// Tuples aren't recognised, as this is only used for module names.
+// true signals an error
+static
+enum result str_buf_push_encoded(struct str_buf *restrict buf, const char *str) {
+  const unsigned char *s = (const unsigned char *) str;
+  while (*s != '\0') {
+    uint32_t char_code;
+    size_t len = utf8_decode(s, &char_code);
+    if (len == 0) {
+      return failure;
+    }
+    s += len;
+    if (char_code < 0x80 && isalnum(char_code) && char_code != 'z' && char_code != 'Z') {
+      if (str_buf_push(buf, char_code)) {
+        return failure;
+      }
+      continue;
+    }
+    char escape[12] = { 0 };
+    for (size_t i = 0; i < sizeof(z_chars) && escape[0] == '\0'; i++) {
+      if (char_code < 0x80 && z_chars[i] == (char) char_code) {
+        escape[0] = 'z';
+        escape[1] = 'a' + i;
+      }
+    }
+    for (size_t i = 0; i < sizeof(Z_chars) && escape[0] == '\0'; i++) {
+      if (char_code < 0x80 && Z_chars[i] == (char) char_code) {
+        escape[0] = 'Z';
+        escape[1] = 'C' + i;
+      }
+    }
+    if (escape[0] == '\0') {
+      // Hex codes that would start with 'a' - 'f' get a leading '0'
+      char hex[9];
+      snprintf(hex, sizeof(hex), "%x", char_code);
+      snprintf(escape, sizeof(escape), "z%s%sU", isdigit(hex[0]) ? "" : "0", hex);
+    }
+    if (str_buf_push_str(buf, escape)) {
+      return failure;
+    }
+  }
+  return success;
+}
+
+// Encoded names only contain ASCII letters and digits
+#define TRIE_FANOUT 62
+
+struct trie_node {
+  uint32_t child[TRIE_FANOUT];
+  bool terminal;
+};
+
+struct haskell_module_filter {
+  bool match_all;
+  size_t node_count;
+  size_t node_capacity;
+  struct trie_node *nodes;
+};
+
+static inline
+int trie_slot(unsigned char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'A' && c <= 'Z') {
+    return c - 'A' + 10;
+  }
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a' + 36;
+  }
+  return -1;
+}
+
+static
+enum result module_filter_insert(struct haskell_module_filter *filter, const char *encoded, size_t len) {
+  uint32_t node = 0;
+  for (size_t i = 0; i < len; i++) {
+    int slot = trie_slot(encoded[i]);
+    if (slot < 0) {
+      return failure;
+    }
+    if (filter->nodes[node].child[slot] == 0) {
+      if (filter->node_count == filter->node_capacity) {
+        size_t capacity = filter->node_capacity * 2;
+        struct trie_node *nodes = realloc(filter->nodes, capacity * sizeof(struct trie_node));
+        if (nodes == NULL) {
+          return failure;
+        }
+        filter->nodes = nodes;
+        filter->node_capacity = capacity;
+      }
+      memset(&filter->nodes[filter->node_count], 0, sizeof(struct trie_node));
+      filter->nodes[node].child[slot] = filter->node_count++;
+    }
+    node = filter->nodes[node].child[slot];
+  }
+  filter->nodes[node].terminal = true;
+  return success;
+}
+
+struct haskell_module_filter *
+haskell_module_filter_new(const char *const *prefixes, size_t count)
+{
+  struct haskell_module_filter *filter = calloc(1, sizeof(struct haskell_module_filter));
+  struct str_buf buf = {
+    .capacity = DEFAULT_BUF_SIZE,
+    .length = 0,
+    .data = malloc(DEFAULT_BUF_SIZE)
+  };
+  if (filter == NULL || buf.data == NULL) {
+    goto fail;
+  }
+  filter->node_capacity = 64;
+  filter->nodes = calloc(filter->node_capacity, sizeof(struct trie_node));
+  if (filter->nodes == NULL) {
+    goto fail;
+  }
+  // The root
+  filter->node_count = 1;
+
+  for (size_t i = 0; i < count; i++) {
+    buf.length = 0;
+    if (str_buf_push_encoded(&buf, prefixes[i])) {
+      goto fail;
+    }
+    // "GHC." means the same as "GHC"
+    while (buf.length >= 2 && memcmp(&buf.data[buf.length - 2], "zi", 2) == 0) {
+      buf.length -= 2;
+    }
+    if (buf.length == 0) {
+      filter->match_all = true;
+      continue;
+    }
+    if (module_filter_insert(filter, buf.data, buf.length)) {
+      goto fail;
+    }
+  }
+  free(buf.data);
+  return filter;
+
 fail:
   free(buf.data);
+  haskell_module_filter_free(filter);
   return NULL;
 }
+
+bool
+haskell_module_filter_matches(const struct haskell_module_filter *filter, const char *mangled)
+{
+  if (filter->match_all) {
+    return true;
+  }
+
+  // Symbols look like <unit>_<module>_<name>_<suffix>, but the unit is left
+  // out for the main package. Unit ids are lower case or contain a '-'
+  // (zm), module names are neither.
+  const char *s = mangled;
+  bool unit = !(*s >= 'A' && *s <= 'Z');
+  while (*s != '_' && *s != '\0' && !unit) {
+    if (*s == 'z' || *s == 'Z') {
+      if (s[1] == '\0') {
+        return false;
+      }
+      unit = s[0] == 'z' && s[1] == 'm';
+      s += 2;
+    } else {
+      s++;
+    }
+  }
+  if (unit) {
+    while (*s != '_') {
+      if (*s == '\0') {
+        return false;
+      }
+      s++;
+    }
+    s++;
+  } else {
+    s = mangled;
+  }
+
+  // Escapes in the prefixes are aligned with those in the symbol, so a 'zi'
+  // straight after a matched prefix is always a module separator.
+  const struct trie_node *node = &filter->nodes[0];
+  for (;;) {
+    if (node->terminal && (*s == '_' || *s == '\0' || (s[0] == 'z' && s[1] == 'i'))) {
+      return true;
+    }
+    int slot = trie_slot(*s);
+    if (slot < 0 || node->child[slot] == 0) {
+      return false;
+    }
+    node = &filter->nodes[node->child[slot]];
+    s++;
+  }
+}
+
+void
+haskell_module_filter_free(struct haskell_module_filter *filter)
+{
+  if (filter == NULL) {
+    return;
+  }
+  free(filter->nodes);
+  free(filter);
+}
@@ -0,0 +1,777 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+Public interface of demangle-ghc.c.
+See https://gitlab.haskell.org/ghc/ghc/wikis/commentary/compiler/symbol-names
+*/
+
+#ifndef DEMANGLE_GHC_H
+#define DEMANGLE_GHC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Returns a malloc'd, NUL-terminated demangled copy of `mangled`,
+// or NULL if it isn't a valid z-encoded name.
+char *haskell_demangle(const char *mangled);
+
+// Like haskell_demangle, for the `len` bytes at `mangled`, which needn't be
+// NUL-terminated.
+char *haskell_demangle_n(const char *mangled, size_t len);
+
+// Like haskell_demangle, but only decodes the binder's name, leaving out the
+// unit, the module, a local binder's unique, and GHC's suffix:
+// "base_GHCziBase_map_info" -> "map", "Main_zdwgo_r1Ab_info" -> "$wgo".
+// The name is split at its literal '_'s, so nothing but the binder is
+// decoded.
+char *haskell_demangle_binder(const char *mangled);
+
+/*
+Limits, for demangling untrusted input.
+
+The output length is checked before every write, and tuples, including
+the unboxed unit "(# #)", before any space is reserved for them, so memory
+use is bounded by the input's length and these. Zero means no limit.
+*/
+struct haskell_demangle_limits {
+  // In bytes, excluding the NUL terminator
+  size_t max_output;
+  // Fields in a tuple
+  uint32_t max_arity;
+  // Output bytes per input byte, checked at each tuple, since they're the
+  // only escapes longer demangled than mangled
+  uint32_t max_expansion;
+};
+
+enum haskell_demangle_error {
+  HASKELL_DEMANGLE_OK = 0,
+  HASKELL_DEMANGLE_INVALID,
+  HASKELL_DEMANGLE_NO_MEMORY,
+  HASKELL_DEMANGLE_TOO_LONG,
+  HASKELL_DEMANGLE_TOO_MANY_FIELDS,
+  HASKELL_DEMANGLE_TOO_EXPANSIVE,
+};
+
+// What everything else uses: tuples of up to 1024 fields, and nothing else.
+extern const struct haskell_demangle_limits haskell_default_limits;
+
+// Like haskell_demangle_n, but with the given limits. On failure, returns
+// NULL, and sets `error` to say why.
+char *haskell_demangle_limited(
+  const char *mangled,
+  size_t len,
+  const struct haskell_demangle_limits *limits,
+  enum haskell_demangle_error *error
+);
+
+const char *haskell_demangle_strerror(enum haskell_demangle_error error);
+
+/*
+Batch demangling.
+
+Results are laid out like an Arrow LargeUtf8 array: a validity bitmap (bit
+i, least significant first, is set if symbol i demangled), count + 1
+offsets, and the demangled names back to back, without NUL terminators.
+Symbols that fail to demangle are null, and take up no space.
+
+A deduplicated batch is dictionary encoded instead: offsets and data hold
+one entry per distinct symbol, and symbol i's name is entry indices[i].
+The validity bitmap and null_count are still per symbol.
+*/
+struct haskell_batch {
+  size_t count;
+  size_t null_count;
+  uint8_t *validity;
+  int64_t *offsets;
+  char *data;
+  size_t data_len;
+  // NULL unless deduplicated, when symbol i is entry i
+  uint32_t *indices;
+  // How many names offsets and data hold
+  size_t entries;
+};
+
+// `lens` may be NULL, if the symbols are NUL-terminated.
+// Returns zero on success, or -1 if memory ran out.
+int haskell_demangle_batch(
+  const char *const *symbols,
+  const size_t *lens,
+  size_t count,
+  struct haskell_batch *out
+);
+
+void haskell_batch_free(struct haskell_batch *batch);
+
+// Symbol i's demangled name, which isn't NUL-terminated, or NULL if it's
+// null.
+const char *haskell_batch_get(const struct haskell_batch *batch, size_t i, size_t *len);
+
+// prefetch and address_order only apply when the symbols are shared out
+// between threads. When the batch falls back to haskell_demangle_batch,
+// they're ignored.
+struct haskell_batch_options {
+  // Zero means one per CPU
+  unsigned threads;
+  // How many symbols ahead to prefetch, zero for none
+  unsigned prefetch;
+  // Visit symbols in order of address, rather than the order given, which
+  // helps when they're scattered through a large string table. The
+  // results are the same.
+  bool address_order;
+  // Demangle each distinct symbol once, and give the batch indices. Every
+  // symbol is hashed first, which costs about as much as demangling it,
+  // so this only pays off when a small set of symbols repeats many times,
+  // as a profile's samples of its hot functions do. With mostly distinct
+  // symbols, it's slower.
+  bool dedup;
+};
+
+// Every thread there is, prefetching eight symbols ahead, without dedup
+extern const struct haskell_batch_options haskell_default_batch_options;
+
+// Like haskell_demangle_batch, using threads. Each symbol's exact length is
+// measured first, so the output is allocated once, and each thread
+// demangles straight into its final place. With one thread, or fewer than
+// 8192 symbols, there's nothing to share out, and the symbols, deduplicated
+// if asked for, are handed to haskell_demangle_batch instead, without
+// prefetching or address order.
+int haskell_demangle_batch_parallel(
+  const char *const *symbols,
+  const size_t *lens,
+  size_t count,
+  const struct haskell_batch_options *options,
+  struct haskell_batch *out
+);
+
+// Demangles `text`, a name per line, into the file `fd`, which must be
+// open for reading and writing, using threads (zero means one per CPU).
+// Lines that don't demangle are written as they are. The file is sized to
+// fit exactly, mapped, and written in place, a region per thread. Returns
+// 0, or -1 with errno set.
+int haskell_demangle_lines_to_fd(const char *text, size_t len, unsigned threads, int fd);
+
+// The exact number of bytes haskell_demangle_limited would produce, without
+// producing them.
+enum haskell_demangle_error haskell_demangled_length(
+  const char *mangled,
+  size_t len,
+  const struct haskell_demangle_limits *limits,
+  size_t *out_len
+);
+
+// Demangles into a caller's buffer, without allocating. If the output
+// doesn't fit, fails with HASKELL_DEMANGLE_TOO_LONG.
+enum haskell_demangle_error haskell_demangle_into(
+  const char *mangled,
+  size_t len,
+  const struct haskell_demangle_limits *limits,
+  char *out,
+  size_t out_len,
+  size_t *written
+);
+
+/*
+Columnar output file, holding a batch's buffers as they are, so that it
+can be mmap'd without parsing. The layout is described in
+demangle-ghc-columnar.c.
+*/
+
+// Returns zero on success, or -1 with errno set. Deduplicated batches
+// can't be written, and fail with EINVAL.
+int haskell_batch_write_columnar(const struct haskell_batch *batch, int fd);
+
+struct haskell_columnar {
+  void *map;
+  size_t map_len;
+  // Points into the mapping, and must not be passed to haskell_batch_free
+  struct haskell_batch batch;
+};
+
+// Maps a columnar file. Returns zero on success, or -1 if it can't be
+// mapped, or isn't a columnar file.
+int haskell_columnar_open(const char *path, struct haskell_columnar *col);
+
+void haskell_columnar_close(struct haskell_columnar *col);
+
+/*
+Function index from DWARF debug info, for symbolizing addresses in
+programs built with -g. See demangle-ghc-dwarf.c for what's supported.
+*/
+struct haskell_intern;
+
+struct haskell_dwarf_function {
+  uint64_t low_pc;
+  // One past the end
+  uint64_t high_pc;
+  // Demangled, unless it isn't z-encoded. Not NUL-terminated.
+  const char *name;
+  size_t name_len;
+};
+
+// A row of the line table, which holds from its address up to the next
+// row's. A file of UINT32_MAX marks a gap with no line information.
+struct haskell_dwarf_line {
+  uint64_t address;
+  uint32_t file;
+  uint32_t line;
+};
+
+struct haskell_dwarf_index {
+  void *map;
+  size_t map_len;
+  // Sorted by low_pc
+  struct haskell_dwarf_function *functions;
+  size_t count;
+  // Holds the demangled names
+  struct haskell_batch names;
+  // Sorted by address
+  struct haskell_dwarf_line *lines;
+  size_t line_count;
+  // Source file names, by ID
+  struct haskell_intern *files;
+};
+
+struct haskell_dwarf_symbol {
+  // NULL if no function contains the address
+  const struct haskell_dwarf_function *function;
+  // NULL if there's no line information for it. Not NUL-terminated.
+  const char *file;
+  size_t file_len;
+  uint32_t line;
+};
+
+// Maps an ELF file, and indexes its subprograms, demangling their names
+// with up to `threads` threads (zero means one per CPU). A file without
+// debug info is indexed from its function symbols. Returns zero on
+// success, or -1 if the file can't be mapped, or has neither debug info
+// nor a symbol table that can be read.
+int haskell_dwarf_index_open(const char *path, unsigned threads, struct haskell_dwarf_index *index);
+
+// The function containing `address`, or NULL
+const struct haskell_dwarf_function *
+haskell_dwarf_index_lookup(const struct haskell_dwarf_index *index, uint64_t address);
+
+// The address an offset into the file is loaded at, going by its PT_LOAD
+// segments, for turning a sampled address into one the index knows about
+uint64_t haskell_dwarf_index_address(const struct haskell_dwarf_index *index, uint64_t file_offset);
+
+// Finds the function and source location of each address
+void haskell_dwarf_index_symbolize(
+  const struct haskell_dwarf_index *index,
+  const uint64_t *addresses,
+  size_t count,
+  struct haskell_dwarf_symbol *out
+);
+
+void haskell_dwarf_index_close(struct haskell_dwarf_index *index);
+
+#define HASKELL_BUILD_ID_MAX 64
+
+// Reads the GNU build ID note of an ELF file, into `id`, which must have
+// room for HASKELL_BUILD_ID_MAX bytes. Returns zero on success, or -1 if
+// the file can't be read, or has no build ID.
+int haskell_elf_build_id(const char *path, uint8_t *id, size_t *len);
+
+/*
+Symbolization of running processes, through /proc/PID/maps.
+
+Each mapped ELF file's DWARF index is opened once, and shared by every
+mapping of it, in every process, and by files elsewhere with the same
+build ID. A process's mappings are re-read on every call, and only
+resolved again when they've changed. Indexes no mapping uses any more
+are closed.
+*/
+struct haskell_symbolizer;
+
+struct haskell_symbolizer *haskell_symbolizer_new(void);
+
+void haskell_symbolizer_free(struct haskell_symbolizer *symbolizer);
+
+// Finds the function and source location of addresses in process `pid`.
+// Returns zero on success, or -1 if its mappings can't be read, or memory
+// runs out.
+int haskell_symbolizer_resolve(
+  struct haskell_symbolizer *symbolizer,
+  int pid,
+  const uint64_t *addresses,
+  size_t count,
+  struct haskell_dwarf_symbol *out
+);
+
+// Drops what's kept for a process, such as one that has exited
+void haskell_symbolizer_forget(struct haskell_symbolizer *symbolizer, int pid);
+
+/*
+Folded stacks from a perf.data file, as written by `perf record -g`, one
+"comm;outer;...;inner count" line per distinct stack, sorted. Mapped files
+are symbolized through their DWARF indexes, which are opened once each.
+See demangle-ghc-perf.c for what's supported.
+*/
+
+// Returns zero on success, or -1 if the file can't be read, isn't a
+// perf.data file, or memory runs out.
+int haskell_perf_fold(const char *path, FILE *out);
+
+/*
+Diff of the symbol tables of two ELF files, such as two builds of a
+program, by demangled name. See demangle-ghc-diff.c for how names are
+normalized.
+*/
+struct haskell_symbol_diff_options {
+  // Zero means one per CPU
+  unsigned threads;
+  // Drop unit ID hashes and the uniques of local binders
+  bool normalize;
+};
+
+// Every thread there is, normalizing
+extern const struct haskell_symbol_diff_options haskell_default_symbol_diff_options;
+
+enum haskell_symbol_change_kind {
+  HASKELL_SYMBOL_ADDED,
+  HASKELL_SYMBOL_REMOVED,
+  HASKELL_SYMBOL_RESIZED,
+};
+
+struct haskell_symbol_change {
+  enum haskell_symbol_change_kind kind;
+  // Demangled, and not NUL-terminated. The module is empty for symbols
+  // that don't have one, such as C functions.
+  const char *module;
+  size_t module_len;
+  const char *name;
+  size_t name_len;
+  // Zero on the side the symbol is missing from
+  uint64_t old_size;
+  uint64_t new_size;
+};
+
+struct haskell_symbol_diff_state;
+
+struct haskell_symbol_diff {
+  // Sorted by module, then name
+  struct haskell_symbol_change *changes;
+  size_t count;
+  // Private: what the names point into
+  struct haskell_symbol_diff_state *state;
+};
+
+// Returns zero on success, or -1 if either file can't be read, has no
+// symbol table, or memory or threads run out.
+int haskell_symbol_diff(
+  const char *old_path,
+  const char *new_path,
+  const struct haskell_symbol_diff_options *options,
+  struct haskell_symbol_diff *out
+);
+
+void haskell_symbol_diff_free(struct haskell_symbol_diff *diff);
+
+/*
+Ticky-ticky profiles, summed per binder or per module across files. See
+demangle-ghc-ticky.c for what's read, and how names are split.
+*/
+struct haskell_ticky_options {
+  // Zero means one per CPU
+  unsigned threads;
+  // Sum per module, rather than per binder
+  bool by_module;
+};
+
+// Every thread there is, per binder
+extern const struct haskell_ticky_options haskell_default_ticky_options;
+
+struct haskell_ticky_entry {
+  // Demangled, and not NUL-terminated. The module is empty for names that
+  // don't have one, and the binder is empty when summing per module.
+  const char *module;
+  size_t module_len;
+  const char *binder;
+  size_t binder_len;
+  uint64_t entries;
+  // Bytes allocated by the closure, and allocated for it
+  uint64_t alloc;
+  uint64_t allocd;
+};
+
+struct haskell_ticky_state;
+
+struct haskell_ticky {
+  // Most allocating first
+  struct haskell_ticky_entry *entries;
+  size_t count;
+  // Private: what the names point into
+  struct haskell_ticky_state *state;
+};
+
+// Reads and sums the files, in parallel. Returns zero on success, or -1
+// with errno set if a file can't be read, or has no counters table (EINVAL).
+int haskell_ticky_merge(
+  const char *const *paths,
+  size_t count,
+  const struct haskell_ticky_options *options,
+  struct haskell_ticky *out
+);
+
+void haskell_ticky_free(struct haskell_ticky *ticky);
+
+/*
+Ordering by demangled name.
+
+Both names are decoded lazily, in lockstep, and the comparison stops at the
+first difference. Names are ordered by their UTF-8 bytes, which is the same
+as ordering by code point. If a name has a malformed escape, the rest of it
+is compared as it is, and so is a tuple with more fields than
+haskell_default_limits allows.
+*/
+int haskell_demangled_cmp(const char *a, const char *b);
+
+// The first eight demangled bytes, big-endian, zero padded. If two keys
+// differ, they're ordered the same way as haskell_demangled_cmp orders
+// their names.
+uint64_t haskell_demangled_key(const char *mangled);
+
+// Sorts symbols by their demangled names, using up to `threads` threads
+// (zero means one per CPU). Most comparisons are settled by the names'
+// keys. Returns zero on success, or -1 if memory or threads ran out.
+int haskell_sort_demangled(const char **symbols, size_t count, unsigned threads);
+
+/*
+Module prefix filter.
+
+Answers "does this mangled symbol live in one of these modules?" without
+demangling it. Prefixes are given in their demangled form ("GHC",
+"Data.Map"), and match whole module path segments, so "Data.Map" matches
+"Data.Map" and "Data.Map.Internal", but not "Data.Maybe".
+
+Matching doesn't allocate, and stops reading at the end of the symbol's
+module component.
+*/
+struct haskell_module_filter;
+
+// Returns NULL on allocation failure, or if a prefix can't be encoded.
+struct haskell_module_filter *
+haskell_module_filter_new(const char *const *prefixes, size_t count);
+
+bool haskell_module_filter_matches(
+  const struct haskell_module_filter *filter,
+  const char *mangled
+);
+
+void haskell_module_filter_free(struct haskell_module_filter *filter);
+
+/*
+String interning table, mapping byte strings to dense IDs in the order they
+were first added.
+*/
+struct haskell_intern;
+
+#define HASKELL_INTERN_ERROR UINT32_MAX
+
+struct haskell_intern *haskell_intern_new(void);
+
+void haskell_intern_free(struct haskell_intern *table);
+
+// Returns the string's ID, setting `added` if it wasn't in the table yet,
+// or HASKELL_INTERN_ERROR if memory ran out.
+uint32_t haskell_intern_add(
+  struct haskell_intern *table,
+  const char *str,
+  size_t len,
+  bool *added
+);
+
+// Sets `id` to the string's ID, if it's in the table, without adding it
+bool haskell_intern_find(
+  const struct haskell_intern *table,
+  const char *str,
+  size_t len,
+  uint32_t *id
+);
+
+size_t haskell_intern_count(const struct haskell_intern *table);
+
+// The returned string isn't NUL-terminated, and is only valid until the
+// next call to haskell_intern_add.
+const char *haskell_intern_get(const struct haskell_intern *table, uint32_t id, size_t *len);
+
+/*
+The K most frequent symbols in a stream, counted exactly while the number
+of distinct symbols allows, and in bounded memory after that. See
+demangle-ghc-topk.c.
+*/
+struct haskell_top_k;
+
+struct haskell_top_k_entry {
+  // Demangled, or as it was given if it doesn't demangle
+  char *name;
+  // An overestimate, unless counting is exact
+  uint64_t count;
+};
+
+// Counts exactly until more than `exact_limit` distinct symbols have been
+// seen. Returns NULL if memory runs out, or k is too large to track.
+struct haskell_top_k *haskell_top_k_new(size_t k, size_t exact_limit);
+
+void haskell_top_k_free(struct haskell_top_k *t);
+
+// Counts one occurrence of a mangled symbol. Returns zero on success, or
+// -1 if memory runs out.
+int haskell_top_k_add(struct haskell_top_k *t, const char *symbol, size_t len);
+
+bool haskell_top_k_is_exact(const struct haskell_top_k *t);
+
+// Sets `entries` to at most K symbols, most frequent first, then by name.
+// They're valid until the next call to this, or haskell_top_k_free.
+// Returns zero on success, or -1 if memory runs out.
+int haskell_top_k_results(
+  struct haskell_top_k *t,
+  const struct haskell_top_k_entry **entries,
+  size_t *count
+);
+
+/*
+Compressed input. See demangle-ghc-input.c for what's supported.
+*/
+
+// Returns a stream of the input, decompressed on threads of its own (zero
+// means one per CPU) if it starts with a gzip or zstd magic number, or
+// `in` itself, if it doesn't, or is a terminal. Closing the returned
+// stream doesn't close `in`. Returns NULL with errno set if the input
+// can't be read, or ENOTSUP if it's compressed, and support for that
+// wasn't built in.
+FILE *haskell_open_input(FILE *in, unsigned threads);
+
+/*
+Filtering text. See demangle-ghc-filter.c.
+*/
+
+// Writes `text` to `fd`, with the GHC symbols in it demangled, and the
+// rest as it is. `text` should end between tokens, at the end of a line,
+// say. Returns 0, or -1 with errno set if writing failed.
+int haskell_filter(const char *text, size_t len, int fd);
+
+/*
+Streaming, of a name per line, from input that arrives in chunks. See
+demangle-ghc-stream.c, and demangle-ghc.hpp for a C++ coroutine on top.
+*/
+
+struct haskell_stream {
+  // Private
+  const char *chunk;
+  size_t chunk_len;
+  size_t pos;
+  bool finished;
+  // The start of a line that straddles chunks
+  char *carry;
+  size_t carry_len;
+  size_t carry_capacity;
+  bool carry_done;
+  char *out;
+  size_t out_capacity;
+};
+
+// A line, without its newline, and its demangled name, which is NULL if
+// it doesn't demangle. Neither is NUL-terminated, and both are valid until
+// the next call to haskell_stream_next.
+struct haskell_stream_record {
+  const char *mangled;
+  size_t mangled_len;
+  const char *demangled;
+  size_t demangled_len;
+};
+
+enum haskell_stream_status {
+  HASKELL_STREAM_RECORD,
+  // The chunk's used up: feed the next, or finish
+  HASKELL_STREAM_NEED_INPUT,
+  HASKELL_STREAM_END,
+  // Memory ran out
+  HASKELL_STREAM_ERROR,
+};
+
+void haskell_stream_init(struct haskell_stream *s);
+
+void haskell_stream_free(struct haskell_stream *s);
+
+// Gives the stream its next chunk, which must stay valid until the stream
+// next needs input.
+void haskell_stream_feed(struct haskell_stream *s, const char *chunk, size_t len);
+
+// Marks the end of the input. A last line without a newline is still a
+// record.
+void haskell_stream_finish(struct haskell_stream *s);
+
+enum haskell_stream_status haskell_stream_next(
+  struct haskell_stream *s,
+  struct haskell_stream_record *record
+);
+
+/*
+Dictionary-encoded output, for streams where the same symbols repeat.
+Each distinct name is written once, then referred to by a varint ID.
+The format is described in demangle-ghc-dict.c.
+*/
+struct haskell_dict_encoder;
+
+struct haskell_dict_encoder *haskell_dict_encoder_new(void);
+
+void haskell_dict_encoder_free(struct haskell_dict_encoder *enc);
+
+// Writes the record for one symbol. Returns zero on success, or -1 if the
+// symbol doesn't demangle, or memory or output fails. A symbol that doesn't
+// demangle writes nothing and takes no ID, so the stream stays in step
+// with the decoder if the caller carries on.
+int haskell_dict_encode(
+  struct haskell_dict_encoder *enc,
+  const char *mangled,
+  size_t len,
+  FILE *out
+);
+
+// Writes the names in a dictionary-encoded stream, one per line.
+// Returns zero on success, or -1 if the stream is malformed.
+int haskell_dict_decode(FILE *in, FILE *out);
+
+/*
+Compressed, sorted set of demangled names, front coded in blocks.
+The format is described in demangle-ghc-store.c.
+*/
+struct haskell_store;
+
+struct haskell_store_options {
+  // Names per block: larger blocks compress better, but lookups scan more
+  unsigned block_size;
+  // Share the module paths that block heads start with
+  bool prefix_dictionary;
+};
+
+extern const struct haskell_store_options haskell_default_store_options;
+
+// Stores the distinct, non-null names in a batch. The batch can be freed
+// afterwards. Returns NULL if memory runs out.
+struct haskell_store *haskell_store_build(
+  const struct haskell_batch *batch,
+  const struct haskell_store_options *options
+);
+
+void haskell_store_free(struct haskell_store *store);
+
+size_t haskell_store_count(const struct haskell_store *store);
+
+// Bytes of memory the store uses
+size_t haskell_store_size(const struct haskell_store *store);
+
+// Sets `rank`, the name's position in sorted order, if the store has it
+bool haskell_store_find(
+  const struct haskell_store *store,
+  const char *name,
+  size_t len,
+  size_t *rank
+);
+
+// Walks the names in sorted order. After each successful call to
+// haskell_store_iter_next, `name` holds the next one, NUL-terminated, and
+// valid until the next call.
+struct haskell_store_iter {
+  const struct haskell_store *store;
+  char *name;
+  size_t len;
+  // Private
+  size_t next;
+  const uint8_t *p;
+  bool pending;
+};
+
+// Starts at the name with the given rank. Returns zero on success, or -1
+// if memory runs out.
+int haskell_store_iter_init(
+  struct haskell_store_iter *it,
+  const struct haskell_store *store,
+  size_t rank
+);
+
+bool haskell_store_iter_next(struct haskell_store_iter *it);
+
+void haskell_store_iter_free(struct haskell_store_iter *it);
+
+/*
+Autocomplete index over demangled names, as a radix trie in a file that
+is mmap'd rather than loaded. The format is described in
+demangle-ghc-trie.c.
+*/
+
+// Writes the distinct, non-null names in a batch. Returns zero on
+// success, or -1 with errno set.
+int haskell_batch_write_trie(const struct haskell_batch *batch, int fd);
+
+struct haskell_trie {
+  void *map;
+  size_t map_len;
+  const uint8_t *nodes;
+  size_t nodes_len;
+  // Distinct names
+  uint64_t count;
+  uint64_t max_len;
+};
+
+// Maps a trie file. Returns zero on success, or -1 if it can't be mapped,
+// or isn't a trie file.
+int haskell_trie_open(const char *path, struct haskell_trie *trie);
+
+void haskell_trie_close(struct haskell_trie *trie);
+
+struct haskell_trie_frame {
+  size_t offset;
+  size_t name_len;
+  size_t children;
+  size_t next_child;
+  bool yield;
+};
+
+// Walks the names starting with a prefix, in sorted order. After each
+// successful call to haskell_trie_iter_next, `name` holds a match,
+// NUL-terminated, and valid until the next call.
+//
+// For module path queries, each match is cut just after the first '.' or
+// '_' past the prefix, so that "base_GHC." yields "base_GHC.Base_" once,
+// and `count` is how many names it stands for. Otherwise, `count` is one.
+struct haskell_trie_iter {
+  const struct haskell_trie *trie;
+  char *name;
+  size_t len;
+  uint64_t count;
+  // How many names start with the prefix, set by haskell_trie_iter_init
+  uint64_t total;
+  // Private
+  size_t query_len;
+  bool module_path;
+  struct haskell_trie_frame *stack;
+  size_t depth;
+  bool fresh;
+};
+
+// Returns zero on success, or -1 if memory runs out.
+int haskell_trie_iter_init(
+  struct haskell_trie_iter *it,
+  const struct haskell_trie *trie,
+  const char *prefix,
+  size_t len,
+  bool module_path
+);
+
+bool haskell_trie_iter_next(struct haskell_trie_iter *it);
+
+void haskell_trie_iter_free(struct haskell_trie_iter *it);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
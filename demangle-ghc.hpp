@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+C++20 coroutines over haskell_stream (see demangle-ghc-stream.c), for
+services that read names from sockets, without a thread per stream.
+
+demangle_records is an async generator. It co_awaits chunks from a reader,
+and co_yields a record per line. The reader is any callable returning an
+awaitable of a std::string_view, which must stay valid until the reader's
+called again, and is empty at the end of the input:
+
+  haskell::async_generator<haskell::record> records =
+    haskell::demangle_records([&] { return socket.read_some(buffer); });
+  while (const haskell::record *r = co_await records.next()) {
+    use(r->demangled);
+  }
+
+Records point into the chunk, or the stream's buffers, and are valid until
+the next call to next(). They aren't allocated: the only allocation is the
+coroutine's frame, once per stream, and that can come from a frame_arena
+the caller owns instead of the heap:
+
+  alignas(std::max_align_t) char frames[4096];
+  haskell::frame_arena arena(frames, sizeof(frames));
+  auto records = haskell::demangle_records(std::allocator_arg, arena, read);
+
+The arena is a stack: a frame's memory is only reused once the frames
+allocated after it have been freed too, as they are when each generator
+lives in a scope of its own.
+*/
+
+#ifndef DEMANGLE_GHC_HPP
+#define DEMANGLE_GHC_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#include "demangle-ghc.h"
+
+namespace haskell {
+
+struct record {
+  std::string_view mangled;
+  // Empty if it doesn't demangle
+  std::string_view demangled;
+  bool valid;
+};
+
+// Hands out memory from the caller's buffer, a stack's worth at a time
+class frame_arena {
+public:
+  frame_arena(void *buffer, std::size_t size) noexcept
+    : buffer_(static_cast<char *>(buffer)), size_(size) {}
+
+  frame_arena(const frame_arena &) = delete;
+  frame_arena &operator=(const frame_arena &) = delete;
+
+  void *allocate(std::size_t size) {
+    std::size_t at = (used_ + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    if (at > size_ || size > size_ - at) {
+      throw std::bad_alloc();
+    }
+    used_ = at + size;
+    return buffer_ + at;
+  }
+
+  // Frees the last allocation. Anything else is kept until the ones after
+  // it are freed.
+  void deallocate(void *p, std::size_t size) noexcept {
+    if (static_cast<char *>(p) + size == buffer_ + used_) {
+      used_ = static_cast<char *>(p) - buffer_;
+    }
+  }
+
+private:
+  char *buffer_;
+  std::size_t size_;
+  std::size_t used_ = 0;
+};
+
+namespace detail {
+
+// Where a frame came from, kept after it, so that operator delete, which
+// only has the frame and its size, can give it back
+inline std::size_t frame_size(std::size_t size) noexcept {
+  return (size + alignof(frame_arena *) - 1) & ~(alignof(frame_arena *) - 1);
+}
+
+inline void *allocate_frame(std::size_t size, frame_arena *arena) {
+  std::size_t total = frame_size(size) + sizeof(frame_arena *);
+  void *frame = arena != nullptr ? arena->allocate(total) : ::operator new(total);
+  *reinterpret_cast<frame_arena **>(static_cast<char *>(frame) + frame_size(size)) = arena;
+  return frame;
+}
+
+inline void free_frame(void *frame, std::size_t size) noexcept {
+  std::size_t total = frame_size(size) + sizeof(frame_arena *);
+  frame_arena *arena = *reinterpret_cast<frame_arena **>(static_cast<char *>(frame) + frame_size(size));
+  if (arena != nullptr) {
+    arena->deallocate(frame, total);
+  } else {
+    ::operator delete(frame, total);
+  }
+}
+
+} // namespace detail
+
+// A generator whose body can co_await. Each co_await of next() runs the
+// body until it yields a value, which it gives a pointer to, or returns,
+// which gives nullptr.
+template <typename T>
+class async_generator {
+public:
+  struct promise_type {
+    const T *value = nullptr;
+    std::coroutine_handle<> consumer;
+    std::exception_ptr error;
+
+    // Coroutines taking std::allocator_arg and a frame_arena first have
+    // their frames allocated from it, or the heap, if it's null
+    template <typename... Args>
+    static void *operator new(std::size_t size, std::allocator_arg_t, frame_arena *arena, Args &&...) {
+      return detail::allocate_frame(size, arena);
+    }
+
+    static void *operator new(std::size_t size) {
+      return detail::allocate_frame(size, nullptr);
+    }
+
+    static void operator delete(void *frame, std::size_t size) noexcept {
+      detail::free_frame(frame, size);
+    }
+
+    // Back to whoever's waiting on next()
+    struct yield_awaiter {
+      bool await_ready() noexcept { return false; }
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> self) noexcept {
+        return self.promise().consumer;
+      }
+      void await_resume() noexcept {}
+    };
+
+    async_generator get_return_object() noexcept {
+      return async_generator(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    yield_awaiter final_suspend() noexcept {
+      value = nullptr;
+      return {};
+    }
+
+    yield_awaiter yield_value(const T &v) noexcept {
+      value = std::addressof(v);
+      return {};
+    }
+
+    void return_void() noexcept {}
+
+    void unhandled_exception() noexcept {
+      error = std::current_exception();
+    }
+  };
+
+  struct next_awaiter {
+    std::coroutine_handle<promise_type> self;
+
+    bool await_ready() noexcept { return self.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> consumer) noexcept {
+      self.promise().consumer = consumer;
+      return self;
+    }
+
+    const T *await_resume() {
+      if (self.promise().error) {
+        std::rethrow_exception(std::exchange(self.promise().error, nullptr));
+      }
+      return self.done() ? nullptr : self.promise().value;
+    }
+  };
+
+  async_generator(async_generator &&other) noexcept
+    : self_(std::exchange(other.self_, nullptr)) {}
+
+  async_generator &operator=(async_generator &&other) noexcept {
+    if (this != &other) {
+      if (self_) {
+        self_.destroy();
+      }
+      self_ = std::exchange(other.self_, nullptr);
+    }
+    return *this;
+  }
+
+  ~async_generator() {
+    if (self_) {
+      self_.destroy();
+    }
+  }
+
+  // Not to be awaited again until the last one has finished
+  next_awaiter next() noexcept { return next_awaiter{self_}; }
+
+private:
+  explicit async_generator(std::coroutine_handle<promise_type> self) noexcept : self_(self) {}
+
+  std::coroutine_handle<promise_type> self_;
+};
+
+// Owns a haskell_stream
+class stream {
+public:
+  stream() noexcept { haskell_stream_init(&s_); }
+  stream(const stream &) = delete;
+  stream &operator=(const stream &) = delete;
+  ~stream() { haskell_stream_free(&s_); }
+
+  void feed(std::string_view chunk) noexcept { haskell_stream_feed(&s_, chunk.data(), chunk.size()); }
+  void finish() noexcept { haskell_stream_finish(&s_); }
+
+  haskell_stream_status next(record &r) noexcept {
+    haskell_stream_record c;
+    haskell_stream_status status = haskell_stream_next(&s_, &c);
+    if (status == HASKELL_STREAM_RECORD) {
+      r.mangled = std::string_view(c.mangled, c.mangled_len);
+      r.valid = c.demangled != nullptr;
+      r.demangled = r.valid ? std::string_view(c.demangled, c.demangled_len) : std::string_view();
+    }
+    return status;
+  }
+
+private:
+  haskell_stream s_;
+};
+
+namespace detail {
+
+// GCC pairs the frame's operator delete, which the standard says is always
+// the usual form, with the placement form of operator new that allocated
+// it, and warns that they don't match
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// A null arena means the heap
+template <typename Read>
+async_generator<record> demangle_records(std::allocator_arg_t, frame_arena *, Read read) {
+  stream s;
+  record r;
+  while (true) {
+    switch (s.next(r)) {
+      case HASKELL_STREAM_RECORD:
+        co_yield r;
+        break;
+      case HASKELL_STREAM_NEED_INPUT: {
+        std::string_view chunk = co_await read();
+        if (chunk.empty()) {
+          s.finish();
+        } else {
+          s.feed(chunk);
+        }
+        break;
+      }
+      case HASKELL_STREAM_END:
+        co_return;
+      case HASKELL_STREAM_ERROR:
+        throw std::bad_alloc();
+    }
+  }
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+} // namespace detail
+
+template <typename Read>
+async_generator<record> demangle_records(Read read) {
+  return detail::demangle_records(std::allocator_arg, nullptr, std::move(read));
+}
+
+template <typename Read>
+async_generator<record> demangle_records(std::allocator_arg_t, frame_arena &arena, Read read) {
+  return detail::demangle_records(std::allocator_arg, &arena, std::move(read));
+}
+
+} // namespace haskell
+
+#endif
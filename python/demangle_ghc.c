@@ -0,0 +1,497 @@
+// SPDX-License-Identifier: MIT-0
+
+/*
+CPython extension over the batch API.
+
+  import demangle_ghc
+  batch = demangle_ghc.demangle_batch(names)
+  batch[0]              # 'base_GHC.Base_map_info', or None
+  batch.save("names.col")
+  batch = demangle_ghc.open_columnar("names.col")
+
+demangle_batch takes a sequence of str or bytes, or one bytes-like object
+(bytes, a memoryview, an mmap) holding a name per line, which is demangled
+where it is, without a Python object per name. The names are collected
+with the GIL held, then it's released while haskell_demangle_batch_parallel
+demangles them on every thread.
+
+The result, a Batch, keeps the names in the batch's buffers, and only
+makes a str of a name when it's asked for one. The buffers themselves are
+exposed, read-only and without copying, as memoryviews: validity (a
+bitmap), offsets (int64), data (UTF-8), and, for a deduplicated batch,
+indices (uint32), in the same layout as an Arrow LargeUtf8 array, so they
+can be handed to numpy or pyarrow as they are. A Batch opened from a
+columnar file is backed by its mapping, which stays mapped for as long as
+the Batch, or any view of its buffers, is alive.
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../demangle-ghc.h"
+
+typedef struct {
+  PyObject_HEAD
+  struct haskell_batch batch;
+  // Set if the batch points into a columnar file's mapping
+  bool mapped;
+  struct haskell_columnar columnar;
+} BatchObject;
+
+// One of a batch's buffers, exported through the buffer protocol
+typedef struct {
+  PyObject_HEAD
+  BatchObject *owner;
+  void *buf;
+  Py_ssize_t count;
+  Py_ssize_t itemsize;
+  const char *format;
+} ColumnObject;
+
+static PyTypeObject BatchType;
+static PyTypeObject ColumnType;
+
+/*
+Columns
+*/
+
+static
+void column_dealloc(ColumnObject *self) {
+  Py_XDECREF(self->owner);
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static
+int column_getbuffer(ColumnObject *self, Py_buffer *view, int flags) {
+  if (flags & PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "batch buffers are read-only");
+    view->obj = NULL;
+    return -1;
+  }
+  view->buf = self->buf;
+  view->obj = (PyObject *) self;
+  Py_INCREF(self);
+  view->len = self->count * self->itemsize;
+  view->readonly = 1;
+  view->itemsize = self->itemsize;
+  view->format = (flags & PyBUF_FORMAT) ? (char *) self->format : NULL;
+  view->ndim = 1;
+  view->shape = (flags & PyBUF_ND) ? &self->count : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &self->itemsize : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  return 0;
+}
+
+static PyBufferProcs column_as_buffer = {
+  .bf_getbuffer = (getbufferproc) column_getbuffer,
+};
+
+static PyTypeObject ColumnType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "demangle_ghc._Column",
+  .tp_basicsize = sizeof(ColumnObject),
+  .tp_dealloc = (destructor) column_dealloc,
+  .tp_as_buffer = &column_as_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+// A memoryview of one of the batch's buffers
+static
+PyObject *column_view(BatchObject *owner, void *buf, size_t count, size_t itemsize, const char *format) {
+  ColumnObject *column = PyObject_New(ColumnObject, &ColumnType);
+  if (column == NULL) {
+    return NULL;
+  }
+  Py_INCREF(owner);
+  column->owner = owner;
+  // An empty buffer still needs somewhere to point
+  static char empty;
+  column->buf = buf != NULL ? buf : &empty;
+  column->count = count;
+  column->itemsize = itemsize;
+  column->format = format;
+  PyObject *view = PyMemoryView_FromObject((PyObject *) column);
+  Py_DECREF(column);
+  return view;
+}
+
+/*
+Batches
+*/
+
+static
+void batch_dealloc(BatchObject *self) {
+  if (self->mapped) {
+    haskell_columnar_close(&self->columnar);
+  } else {
+    haskell_batch_free(&self->batch);
+  }
+  Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static
+Py_ssize_t batch_len(BatchObject *self) {
+  return self->batch.count;
+}
+
+static
+PyObject *batch_item(BatchObject *self, Py_ssize_t i) {
+  if (i < 0 || (size_t) i >= self->batch.count) {
+    PyErr_SetString(PyExc_IndexError, "batch index out of range");
+    return NULL;
+  }
+  size_t len;
+  const char *name = haskell_batch_get(&self->batch, i, &len);
+  if (name == NULL) {
+    Py_RETURN_NONE;
+  }
+  return PyUnicode_DecodeUTF8(name, len, "surrogateescape");
+}
+
+static
+PyObject *batch_tolist(BatchObject *self, PyObject *Py_UNUSED(ignored)) {
+  PyObject *list = PyList_New(self->batch.count);
+  if (list == NULL) {
+    return NULL;
+  }
+  for (size_t i = 0; i < self->batch.count; i++) {
+    PyObject *name = batch_item(self, i);
+    if (name == NULL) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, name);
+  }
+  return list;
+}
+
+static
+PyObject *batch_save(BatchObject *self, PyObject *arg) {
+  // Caught here, before the file's truncated
+  if (self->batch.indices != NULL) {
+    PyErr_SetString(PyExc_ValueError, "deduplicated batches can't be saved");
+    return NULL;
+  }
+  PyObject *path;
+  if (!PyUnicode_FSConverter(arg, &path)) {
+    return NULL;
+  }
+  int fd = open(PyBytes_AS_STRING(path), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int res = -1;
+  if (fd >= 0) {
+    Py_BEGIN_ALLOW_THREADS
+    res = haskell_batch_write_columnar(&self->batch, fd);
+    Py_END_ALLOW_THREADS
+    if (close(fd) != 0) {
+      res = -1;
+    }
+  }
+  if (res != 0) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, arg);
+    Py_DECREF(path);
+    return NULL;
+  }
+  Py_DECREF(path);
+  Py_RETURN_NONE;
+}
+
+static
+PyObject *batch_null_count(BatchObject *self, void *Py_UNUSED(closure)) {
+  return PyLong_FromSize_t(self->batch.null_count);
+}
+
+static
+PyObject *batch_validity(BatchObject *self, void *Py_UNUSED(closure)) {
+  return column_view(self, self->batch.validity, (self->batch.count + 7) / 8, 1, "B");
+}
+
+static
+PyObject *batch_offsets(BatchObject *self, void *Py_UNUSED(closure)) {
+  return column_view(self, self->batch.offsets, self->batch.entries + 1, sizeof(int64_t), "q");
+}
+
+static
+PyObject *batch_data(BatchObject *self, void *Py_UNUSED(closure)) {
+  return column_view(self, self->batch.data, self->batch.data_len, 1, "B");
+}
+
+static
+PyObject *batch_indices(BatchObject *self, void *Py_UNUSED(closure)) {
+  if (self->batch.indices == NULL) {
+    Py_RETURN_NONE;
+  }
+  return column_view(self, self->batch.indices, self->batch.count, sizeof(uint32_t), "I");
+}
+
+static PySequenceMethods batch_as_sequence = {
+  .sq_length = (lenfunc) batch_len,
+  .sq_item = (ssizeargfunc) batch_item,
+};
+
+static PyMethodDef batch_methods[] = {
+  {
+    "tolist", (PyCFunction) batch_tolist, METH_NOARGS,
+    "Every name, as a list of str, with None for names that didn't demangle."
+  },
+  {
+    "save", (PyCFunction) batch_save, METH_O,
+    "Writes the batch to a columnar file, which open_columnar maps. "
+    "Deduplicated batches can't be saved."
+  },
+  { NULL }
+};
+
+static PyGetSetDef batch_getset[] = {
+  { "null_count", (getter) batch_null_count, NULL, "How many names didn't demangle.", NULL },
+  { "validity", (getter) batch_validity, NULL, "Bit i is set if name i demangled.", NULL },
+  { "offsets", (getter) batch_offsets, NULL, "Where each entry starts and ends in data.", NULL },
+  { "data", (getter) batch_data, NULL, "The demangled names, back to back, in UTF-8.", NULL },
+  { "indices", (getter) batch_indices, NULL, "Each name's entry, if deduplicated, or None.", NULL },
+  { NULL }
+};
+
+static PyTypeObject BatchType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "demangle_ghc.Batch",
+  .tp_doc = "Demangled names, held in columnar buffers.",
+  .tp_basicsize = sizeof(BatchObject),
+  .tp_dealloc = (destructor) batch_dealloc,
+  .tp_as_sequence = &batch_as_sequence,
+  .tp_methods = batch_methods,
+  .tp_getset = batch_getset,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+};
+
+/*
+Functions
+*/
+
+static
+PyObject *demangle(PyObject *Py_UNUSED(module), PyObject *arg) {
+  const char *name;
+  Py_ssize_t len;
+  if (PyUnicode_Check(arg)) {
+    name = PyUnicode_AsUTF8AndSize(arg, &len);
+  } else if (PyBytes_AsStringAndSize(arg, (char **) &name, &len) != 0) {
+    name = NULL;
+  }
+  if (name == NULL) {
+    return NULL;
+  }
+  char *demangled = haskell_demangle_n(name, len);
+  if (demangled == NULL) {
+    Py_RETURN_NONE;
+  }
+  PyObject *res = PyUnicode_DecodeUTF8(demangled, strlen(demangled), "surrogateescape");
+  free(demangled);
+  return res;
+}
+
+// Where the names are, and what keeps them alive
+struct names {
+  const char **symbols;
+  size_t *lens;
+  size_t count;
+  // A tuple of the names, or a buffer of lines
+  PyObject *items;
+  Py_buffer buffer;
+  bool has_buffer;
+};
+
+static
+void free_names(struct names *names) {
+  free(names->symbols);
+  free(names->lens);
+  Py_XDECREF(names->items);
+  if (names->has_buffer) {
+    PyBuffer_Release(&names->buffer);
+  }
+}
+
+// The lines of a bytes-like object
+// true signals an error
+static
+bool buffer_names(PyObject *arg, struct names *names) {
+  if (PyObject_GetBuffer(arg, &names->buffer, PyBUF_SIMPLE) != 0) {
+    return true;
+  }
+  names->has_buffer = true;
+  const char *text = names->buffer.buf;
+  const char *end = text + names->buffer.len;
+  size_t count = 0;
+  for (const char *p = text; p < end; count++) {
+    const char *nl = memchr(p, '\n', end - p);
+    p = nl == NULL ? end : nl + 1;
+  }
+  names->symbols = malloc((count + 1) * sizeof(char *));
+  names->lens = malloc((count + 1) * sizeof(size_t));
+  if (names->symbols == NULL || names->lens == NULL) {
+    PyErr_NoMemory();
+    return true;
+  }
+  for (const char *p = text; p < end; names->count++) {
+    const char *nl = memchr(p, '\n', end - p);
+    names->symbols[names->count] = p;
+    names->lens[names->count] = (nl == NULL ? end : nl) - p;
+    p = nl == NULL ? end : nl + 1;
+  }
+  return false;
+}
+
+// The items of a sequence of str or bytes, which are held in a tuple, so
+// that they stay alive while the GIL's released
+// true signals an error
+static
+bool sequence_names(PyObject *arg, struct names *names) {
+  names->items = PySequence_Tuple(arg);
+  if (names->items == NULL) {
+    return true;
+  }
+  size_t count = PyTuple_GET_SIZE(names->items);
+  names->symbols = malloc((count + 1) * sizeof(char *));
+  names->lens = malloc((count + 1) * sizeof(size_t));
+  if (names->symbols == NULL || names->lens == NULL) {
+    PyErr_NoMemory();
+    return true;
+  }
+  for (size_t i = 0; i < count; i++) {
+    PyObject *item = PyTuple_GET_ITEM(names->items, i);
+    const char *name;
+    Py_ssize_t len;
+    if (PyUnicode_Check(item)) {
+      name = PyUnicode_AsUTF8AndSize(item, &len);
+    } else if (PyBytes_Check(item)) {
+      name = PyBytes_AS_STRING(item);
+      len = PyBytes_GET_SIZE(item);
+    } else {
+      PyErr_Format(PyExc_TypeError, "names must be str or bytes, not %.100s", Py_TYPE(item)->tp_name);
+      return true;
+    }
+    if (name == NULL) {
+      return true;
+    }
+    names->symbols[i] = name;
+    names->lens[i] = len;
+  }
+  names->count = count;
+  return false;
+}
+
+static
+PyObject *demangle_batch(PyObject *Py_UNUSED(module), PyObject *args, PyObject *kwargs) {
+  static char *keywords[] = { "names", "threads", "dedup", NULL };
+  PyObject *arg;
+  unsigned int threads = 0;
+  int dedup = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|$Ip", keywords, &arg, &threads, &dedup)) {
+    return NULL;
+  }
+  struct names names = { 0 };
+  bool error = PyObject_CheckBuffer(arg) ? buffer_names(arg, &names) : sequence_names(arg, &names);
+  if (error) {
+    free_names(&names);
+    return NULL;
+  }
+  BatchObject *self = PyObject_New(BatchObject, &BatchType);
+  if (self == NULL) {
+    free_names(&names);
+    return NULL;
+  }
+  self->mapped = false;
+  struct haskell_batch_options options = haskell_default_batch_options;
+  options.threads = threads;
+  options.dedup = dedup;
+  int res;
+  Py_BEGIN_ALLOW_THREADS
+  res = haskell_demangle_batch_parallel(names.symbols, names.lens, names.count, &options, &self->batch);
+  Py_END_ALLOW_THREADS
+  free_names(&names);
+  if (res != 0) {
+    // Nothing to free: the batch is left empty
+    self->batch = (struct haskell_batch) { 0 };
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  return (PyObject *) self;
+}
+
+static
+PyObject *open_columnar(PyObject *Py_UNUSED(module), PyObject *arg) {
+  PyObject *path;
+  if (!PyUnicode_FSConverter(arg, &path)) {
+    return NULL;
+  }
+  BatchObject *self = PyObject_New(BatchObject, &BatchType);
+  if (self == NULL) {
+    Py_DECREF(path);
+    return NULL;
+  }
+  int res;
+  Py_BEGIN_ALLOW_THREADS
+  res = haskell_columnar_open(PyBytes_AS_STRING(path), &self->columnar);
+  Py_END_ALLOW_THREADS
+  Py_DECREF(path);
+  if (res != 0) {
+    self->mapped = false;
+    self->batch = (struct haskell_batch) { 0 };
+    Py_DECREF(self);
+    PyErr_Format(PyExc_OSError, "%R isn't a columnar file that can be mapped", arg);
+    return NULL;
+  }
+  self->mapped = true;
+  self->batch = self->columnar.batch;
+  return (PyObject *) self;
+}
+
+static PyMethodDef module_methods[] = {
+  {
+    "demangle", demangle, METH_O,
+    "Demangles one name, str or bytes, or returns None if it isn't z-encoded."
+  },
+  {
+    "demangle_batch", (PyCFunction) (void (*)(void)) demangle_batch, METH_VARARGS | METH_KEYWORDS,
+    "demangle_batch(names, *, threads=0, dedup=False)\n\n"
+    "Demangles a sequence of str or bytes, or the lines of a bytes-like "
+    "object, in parallel, without the GIL. threads=0 means one per CPU. "
+    "dedup demangles each distinct name once."
+  },
+  {
+    "open_columnar", open_columnar, METH_O,
+    "Maps a columnar file written by Batch.save, or main --columnar."
+  },
+  { NULL }
+};
+
+static struct PyModuleDef module = {
+  PyModuleDef_HEAD_INIT,
+  .m_name = "demangle_ghc",
+  .m_doc = "Demangling GHC's symbol names, in bulk.",
+  .m_size = -1,
+  .m_methods = module_methods,
+};
+
+PyMODINIT_FUNC
+PyInit_demangle_ghc(void)
+{
+  if (PyType_Ready(&BatchType) < 0 || PyType_Ready(&ColumnType) < 0) {
+    return NULL;
+  }
+  PyObject *m = PyModule_Create(&module);
+  if (m == NULL) {
+    return NULL;
+  }
+  Py_INCREF(&BatchType);
+  if (PyModule_AddObject(m, "Batch", (PyObject *) &BatchType) < 0) {
+    Py_DECREF(&BatchType);
+    Py_DECREF(m);
+    return NULL;
+  }
+  return m;
+}
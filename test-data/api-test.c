@@ -0,0 +1,465 @@
+// Built by test.sh, with every demangle-ghc*.c but demangle-ghc-main.c:
+//   cc -I.. -pthread -o api-test api-test.c demangle-ghc.c ...
+//   ./api-test SCRATCH_DIR
+//
+// Checks the parts of the library that main doesn't reach, and names each
+// check that fails.
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "demangle-ghc.h"
+
+static int failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+// Set to make realloc fail, as if memory had run out
+static bool fail_realloc;
+
+void *realloc(void *p, size_t size) {
+  static void *(*next)(void *, size_t);
+  if (next == NULL) {
+    next = (void *(*)(void *, size_t)) dlsym(RTLD_NEXT, "realloc");
+  }
+  return fail_realloc ? NULL : next(p, size);
+}
+
+static
+void check(bool ok, const char *what, int line) {
+  if (!ok) {
+    fprintf(stderr, "api-test.c:%d: %s\n", line, what);
+    failures++;
+  }
+}
+
+static
+void test_module_filter(void) {
+  const char *prefixes[] = { "Data.Map", "GHC.", "Test.QuickCheck" };
+  struct haskell_module_filter *filter = haskell_module_filter_new(prefixes, 3);
+  CHECK(filter != NULL);
+  if (filter == NULL) {
+    return;
+  }
+  CHECK(haskell_module_filter_matches(filter, "containerszm0zi6_DataziMap_insert_info"));
+  CHECK(haskell_module_filter_matches(filter, "containerszm0zi6_DataziMapziInternal_insert_info"));
+  CHECK(!haskell_module_filter_matches(filter, "base_DataziMaybe_fromJust_info"));
+  CHECK(haskell_module_filter_matches(filter, "base_GHCziBase_map_info"));
+  CHECK(!haskell_module_filter_matches(filter, "Main_main_info"));
+  CHECK(haskell_module_filter_matches(filter, "QuickCheckzm2zi14zi3zmAbC_TestziQuickCheck_quickCheck_info"));
+  CHECK(!haskell_module_filter_matches(filter, "QuickCheckzm2zi14zi3zmAbC_TestziQuickCheckGen_x_info"));
+  haskell_module_filter_free(filter);
+
+  // An empty prefix is every module
+  const char *everything[] = { "" };
+  filter = haskell_module_filter_new(everything, 1);
+  CHECK(filter != NULL && haskell_module_filter_matches(filter, "Main_main_info"));
+  haskell_module_filter_free(filter);
+}
+
+static
+void check_binder(const char *mangled, const char *expected, int line) {
+  char *binder = haskell_demangle_binder(mangled);
+  bool ok = binder != NULL ? expected != NULL && strcmp(binder, expected) == 0 : expected == NULL;
+  if (!ok) {
+    fprintf(stderr, "api-test.c:%d: binder of %s is %s\n", line, mangled, binder ? binder : "NULL");
+    failures++;
+  }
+  free(binder);
+}
+
+static
+void test_binder(void) {
+  check_binder("base_GHCziBase_map_info", "map", __LINE__);
+  check_binder("Main_main_closure", "main", __LINE__);
+  check_binder("Main_zdwgo_r1Ab_info", "$wgo", __LINE__);
+  check_binder("Main_x1_info", "x1", __LINE__);
+  check_binder("sat_s1Abc_info", "sat", __LINE__);
+  check_binder("ghczmprim_GHCziTuple_Z3T_con_info", "(,,)", __LINE__);
+  check_binder("QuickCheckzm2zi14zi3zmAbC_TestziQuickCheckziGen_choose_info", "choose", __LINE__);
+  check_binder("DataziMapziinsertWith", "insertWith", __LINE__);
+  check_binder("Main_Z3Tzx_info", NULL, __LINE__);
+}
+
+static
+int cmp_symbols(const void *a, const void *b) {
+  return haskell_demangled_cmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+static
+void test_sort(void) {
+  // '$' < '.' < ':' < 'M' < 'z' < 'λ', by their UTF-8 bytes
+  CHECK(haskell_demangled_cmp("zd", "zi") < 0);
+  CHECK(haskell_demangled_cmp("ZCMain", "zi") > 0);
+  CHECK(haskell_demangled_cmp("Main", "Mainzd") < 0);
+  CHECK(haskell_demangled_cmp("zz", "z3bbU") < 0);
+  CHECK(haskell_demangled_cmp("Z3T", "Z3T") == 0);
+  // Decoded, not compared as written: "zi" is '.' and "Z" is 'Z'
+  CHECK(haskell_demangled_cmp("Azi", "AZZ") < 0);
+  // Past the default arity, tuples are compared as written, rather than
+  // comma by comma
+  CHECK(haskell_demangled_cmp("Z400000000T", "Z400000000Tx") < 0);
+  CHECK(haskell_demangled_key("Z400000000T") == haskell_demangled_key("Z400000000Tx"));
+  CHECK(haskell_demangled_cmp("Z1024T", "Z1025T") < 0);
+
+  // Distinct names, long enough that keys often tie
+  enum { COUNT = 5000 };
+  static char names[COUNT][40];
+  static const char *sorted[COUNT];
+  static const char *expected[COUNT];
+  const char *pieces[] = { "zd", "zi", "ZC", "z3bbU", "Map", "map", "zz", "Z3T" };
+  uint32_t state = 1;
+  for (size_t i = 0; i < COUNT; i++) {
+    state = state * 1103515245 + 12345;
+    snprintf(names[i], sizeof(names[i]), "base_GHCzi%s%s_%u_info",
+      pieces[(state >> 8) % 8], pieces[(state >> 16) % 8], (unsigned) i);
+    sorted[i] = expected[i] = names[i];
+  }
+  qsort(expected, COUNT, sizeof(const char *), cmp_symbols);
+  CHECK(haskell_sort_demangled(sorted, COUNT, 4) == 0);
+  CHECK(memcmp(sorted, expected, sizeof(sorted)) == 0);
+  for (size_t i = 1; i < COUNT; i++) {
+    uint64_t a = haskell_demangled_key(sorted[i - 1]);
+    uint64_t b = haskell_demangled_key(sorted[i]);
+    if (a != b && (a < b) != (haskell_demangled_cmp(sorted[i - 1], sorted[i]) < 0)) {
+      fprintf(stderr, "api-test.c:%d: keys of %s and %s disagree with their order\n", __LINE__, sorted[i - 1], sorted[i]);
+      failures++;
+    }
+  }
+}
+
+static
+void test_dict(void) {
+  FILE *encoded = tmpfile();
+  FILE *decoded = tmpfile();
+  struct haskell_dict_encoder *enc = haskell_dict_encoder_new();
+  CHECK(encoded != NULL && decoded != NULL && enc != NULL);
+  if (encoded == NULL || decoded == NULL || enc == NULL) {
+    return;
+  }
+  // A symbol that fails, carried on past, takes no ID, even when it's
+  // seen again
+  const char *symbols[] = { "zd", "Z3Tzx", "zd", "Z3T", "Z3Tzx", "Z3T" };
+  int results[6];
+  for (size_t i = 0; i < 6; i++) {
+    results[i] = haskell_dict_encode(enc, symbols[i], strlen(symbols[i]), encoded);
+  }
+  CHECK(results[0] == 0 && results[1] == -1 && results[2] == 0);
+  CHECK(results[3] == 0 && results[4] == -1 && results[5] == 0);
+  haskell_dict_encoder_free(enc);
+
+  const char expected_encoded[] = "\0\1$\1\0\4(,,)\2";
+  char buf[64];
+  rewind(encoded);
+  size_t len = fread(buf, 1, sizeof(buf), encoded);
+  CHECK(len == sizeof(expected_encoded) - 1 && memcmp(buf, expected_encoded, len) == 0);
+  rewind(encoded);
+  CHECK(haskell_dict_decode(encoded, decoded) == 0);
+  rewind(decoded);
+  len = fread(buf, 1, sizeof(buf), decoded);
+  CHECK(len == 14 && memcmp(buf, "$\n$\n(,,)\n(,,)\n", len) == 0);
+  fclose(encoded);
+  fclose(decoded);
+}
+
+// Overwrites the columnar header field at `at`, and tries to open the file
+static
+bool open_patched(const char *path, off_t at, uint64_t value) {
+  int fd = open(path, O_RDWR);
+  uint64_t old;
+  bool ok = fd >= 0 && pread(fd, &old, 8, at) == 8 && pwrite(fd, &value, 8, at) == 8;
+  struct haskell_columnar col;
+  bool opened = ok && haskell_columnar_open(path, &col) == 0;
+  if (opened) {
+    haskell_columnar_close(&col);
+  }
+  if (ok && pwrite(fd, &old, 8, at) != 8) {
+    opened = true;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return opened;
+}
+
+static
+void test_columnar(const char *dir) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/api-test.col", dir);
+  const char *symbols[] = { "zd", "Z3", "Z3T" };
+  struct haskell_batch batch;
+  CHECK(haskell_demangle_batch(symbols, NULL, 3, &batch) == 0);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd >= 0 && haskell_batch_write_columnar(&batch, fd) == 0 && close(fd) == 0);
+  haskell_batch_free(&batch);
+
+  struct haskell_columnar col;
+  CHECK(haskell_columnar_open(path, &col) == 0);
+  size_t len;
+  const char *name = haskell_batch_get(&col.batch, 2, &len);
+  CHECK(col.batch.count == 3 && haskell_batch_get(&col.batch, 1, &len) == NULL);
+  CHECK(name != NULL && len == 4 && memcmp(name, "(,,)", 4) == 0);
+  haskell_columnar_close(&col);
+
+  // Offsets that would wrap around past the end of the mapping, or that
+  // aren't aligned
+  CHECK(!open_patched(path, 32, UINT64_MAX));
+  CHECK(!open_patched(path, 40, UINT64_MAX - 8));
+  CHECK(!open_patched(path, 40, 65));
+  CHECK(!open_patched(path, 48, UINT64_MAX));
+  CHECK(!open_patched(path, 16, UINT64_MAX / 8));
+  CHECK(haskell_columnar_open(path, &col) == 0);
+  haskell_columnar_close(&col);
+  unlink(path);
+}
+
+static
+void check_limited(
+  const char *mangled,
+  struct haskell_demangle_limits limits,
+  enum haskell_demangle_error expected,
+  const char *expected_name,
+  int line
+) {
+  enum haskell_demangle_error error = HASKELL_DEMANGLE_OK;
+  char *name = haskell_demangle_limited(mangled, strlen(mangled), &limits, &error);
+  bool ok = error == expected && (name == NULL) == (expected != HASKELL_DEMANGLE_OK);
+  if (ok && name != NULL) {
+    ok = strcmp(name, expected_name) == 0;
+  }
+  // haskell_demangled_length makes the same checks, in the same order
+  size_t len;
+  enum haskell_demangle_error measured = haskell_demangled_length(mangled, strlen(mangled), &limits, &len);
+  if (expected != HASKELL_DEMANGLE_NO_MEMORY) {
+    ok = ok && measured == expected && (measured != HASKELL_DEMANGLE_OK || len == strlen(expected_name));
+  }
+  // haskell_demangle_into fits it in a buffer of exactly that length
+  if (ok && expected == HASKELL_DEMANGLE_OK) {
+    char *exact = malloc(len > 0 ? len : 1);
+    size_t written = SIZE_MAX;
+    ok = exact != NULL
+      && haskell_demangle_into(mangled, strlen(mangled), &limits, exact, len, &written) == HASKELL_DEMANGLE_OK
+      && written == len
+      && memcmp(exact, expected_name, len) == 0;
+    free(exact);
+  }
+  if (!ok) {
+    fprintf(stderr, "api-test.c:%d: %s gave %s (%s), measured as %s, or didn't fit its length\n", line, mangled,
+      name ? name : "NULL", haskell_demangle_strerror(error), haskell_demangle_strerror(measured));
+    failures++;
+  }
+  free(name);
+}
+
+static
+void test_limits(void) {
+  typedef struct haskell_demangle_limits L;
+  const enum haskell_demangle_error OK = HASKELL_DEMANGLE_OK;
+  const enum haskell_demangle_error LONG = HASKELL_DEMANGLE_TOO_LONG;
+  check_limited("abcdef", (L) { 6, 0, 0 }, OK, "abcdef", __LINE__);
+  check_limited("abcdef", (L) { 3, 0, 0 }, LONG, NULL, __LINE__);
+  check_limited("zdzdzd", (L) { 3, 0, 0 }, OK, "$$$", __LINE__);
+  check_limited("zdzdzd", (L) { 2, 0, 0 }, LONG, NULL, __LINE__);
+  // Plain output past the limit fails before anything invalid after it
+  check_limited("abcdefzx", (L) { 3, 0, 0 }, LONG, NULL, __LINE__);
+  check_limited("z3bbUz3bbU", (L) { 4, 0, 0 }, OK, "λλ", __LINE__);
+  check_limited("z3bbUz3bbU", (L) { 3, 0, 0 }, LONG, NULL, __LINE__);
+  // Long enough for the eight bytes at a time path
+  check_limited("z3bbUz3bbUz3bbUz3bbUz3bbU", (L) { 10, 0, 0 }, OK, "λλλλλ", __LINE__);
+  check_limited("z3bbUz3bbUz3bbUz3bbUz3bbU", (L) { 9, 0, 0 }, LONG, NULL, __LINE__);
+  // Code points in the last few bytes of an exactly sized buffer
+  check_limited("z41Uz3bbU", (L) { 0, 0, 0 }, OK, "Aλ", __LINE__);
+  check_limited("abz41Uz3bbU", (L) { 0, 0, 0 }, OK, "abAλ", __LINE__);
+  check_limited("z3bbUz3bbUz3bbUz3bbUz41U", (L) { 0, 0, 0 }, OK, "λλλλA", __LINE__);
+  check_limited("Z1H", (L) { 4, 0, 0 }, LONG, NULL, __LINE__);
+  check_limited("Z5T", (L) { 5, 0, 0 }, LONG, NULL, __LINE__);
+  check_limited("Z5T", (L) { 0, 5, 0 }, OK, "(,,,,)", __LINE__);
+  check_limited("Z5T", (L) { 0, 4, 0 }, HASKELL_DEMANGLE_TOO_MANY_FIELDS, NULL, __LINE__);
+  check_limited("Z5T", (L) { 0, 0, 2 }, OK, "(,,,,)", __LINE__);
+  check_limited("Z5T", (L) { 0, 0, 1 }, HASKELL_DEMANGLE_TOO_EXPANSIVE, NULL, __LINE__);
+  check_limited("Z3Tzx", (L) { 0, 0, 0 }, HASKELL_DEMANGLE_INVALID, NULL, __LINE__);
+  // The unboxed unit is five bytes from three
+  check_limited("Z1HZ1HZ1H", (L) { 0, 0, 1 }, HASKELL_DEMANGLE_TOO_EXPANSIVE, NULL, __LINE__);
+  check_limited("Z1HZ1HZ1H", (L) { 0, 0, 2 }, OK, "(# #)(# #)(# #)", __LINE__);
+
+  // Longer than the initial buffer, so it has to grow, in the middle of
+  // a run of char codes, with more to decode after it
+  char big[406];
+  for (size_t i = 0; i < 400; i += 5) {
+    memcpy(&big[i], "z3bbU", 5);
+  }
+  strcpy(&big[400], "abcde");
+  fail_realloc = true;
+  check_limited(big, (L) { 0, 0, 0 }, HASKELL_DEMANGLE_NO_MEMORY, NULL, __LINE__);
+  check_limited("Z300T", (L) { 0, 0, 0 }, HASKELL_DEMANGLE_NO_MEMORY, NULL, __LINE__);
+  fail_realloc = false;
+
+  for (int e = HASKELL_DEMANGLE_OK; e <= HASKELL_DEMANGLE_TOO_EXPANSIVE; e++) {
+    CHECK(strcmp(haskell_demangle_strerror(e), "unknown error") != 0);
+  }
+}
+
+static
+bool same_names(const struct haskell_batch *a, const struct haskell_batch *b) {
+  if (a->count != b->count || a->null_count != b->null_count) {
+    return false;
+  }
+  for (size_t i = 0; i < a->count; i++) {
+    size_t a_len;
+    size_t b_len;
+    const char *a_name = haskell_batch_get(a, i, &a_len);
+    const char *b_name = haskell_batch_get(b, i, &b_len);
+    if ((a_name == NULL) != (b_name == NULL)) {
+      return false;
+    }
+    if (a_name != NULL && (a_len != b_len || memcmp(a_name, b_name, a_len) != 0)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static
+void test_parallel_batch(void) {
+  // Enough for several threads' shares, with invalid names among them
+  enum { COUNT = 20000 };
+  static char names[COUNT][48];
+  static const char *symbols[COUNT];
+  const char *forms[] = {
+    "base_GHCziBase_map%u_info", "Main_zdwgo_r%uAb_info", "Z%uT", "z3bbU%uzx", "z41Uz3bbU%u", "z41Uz3bbU"
+  };
+  for (size_t i = 0; i < COUNT; i++) {
+    snprintf(names[i], sizeof(names[i]), forms[i % 6], (unsigned) (i % 1500));
+    symbols[i] = names[i];
+  }
+  struct haskell_batch expected;
+  CHECK(haskell_demangle_batch(symbols, NULL, COUNT, &expected) == 0);
+  struct haskell_batch_options options[] = {
+    { .threads = 4 },
+    { .threads = 4, .prefetch = 8, .address_order = true },
+    { .threads = 4, .dedup = true },
+    { .threads = 1, .dedup = true },
+  };
+  for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+    struct haskell_batch batch;
+    CHECK(haskell_demangle_batch_parallel(symbols, NULL, COUNT, &options[i], &batch) == 0);
+    if (!same_names(&batch, &expected)) {
+      fprintf(stderr, "api-test.c:%d: batch with options %zu differs\n", __LINE__, i);
+      failures++;
+    }
+    haskell_batch_free(&batch);
+  }
+  haskell_batch_free(&expected);
+}
+
+static
+int cmp_names(const void *a, const void *b) {
+  const char *x = *(const char *const *) a;
+  const char *y = *(const char *const *) b;
+  return strcmp(x, y);
+}
+
+static
+void test_store(void) {
+  // Module paths shared between blocks, duplicates, a prefix of another
+  // name, and an invalid name, which the store leaves out
+  enum { COUNT = 300 };
+  static char names[COUNT][48];
+  static const char *symbols[COUNT + 3];
+  const char *forms[] = { "base_GHCziBase_map%u_info", "containerszm0zi6_DataziMap_insert%u_closure", "Main_x%u" };
+  for (size_t i = 0; i < COUNT; i++) {
+    snprintf(names[i], sizeof(names[i]), forms[i % 3], (unsigned) (i % 120));
+    symbols[i] = names[i];
+  }
+  symbols[COUNT] = "Main_x1";
+  symbols[COUNT + 1] = "Main_x";
+  symbols[COUNT + 2] = "Z3Tzx";
+  struct haskell_batch batch;
+  CHECK(haskell_demangle_batch(symbols, NULL, COUNT + 3, &batch) == 0);
+  CHECK(batch.null_count == 1);
+
+  // The distinct names, sorted. Batch names aren't NUL-terminated.
+  char *expected[COUNT + 3];
+  size_t count = 0;
+  for (size_t i = 0; i < batch.count; i++) {
+    size_t len;
+    const char *name = haskell_batch_get(&batch, i, &len);
+    if (name != NULL) {
+      expected[count++] = strndup(name, len);
+    }
+  }
+  qsort(expected, count, sizeof(char *), cmp_names);
+  size_t distinct = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (distinct == 0 || strcmp(expected[distinct - 1], expected[i]) != 0) {
+      expected[distinct++] = expected[i];
+    } else {
+      free(expected[i]);
+    }
+  }
+
+  struct haskell_store_options options[] = {
+    { .block_size = 16, .prefix_dictionary = true },
+    { .block_size = 16, .prefix_dictionary = false },
+    { .block_size = 1, .prefix_dictionary = true },
+    { .block_size = 7, .prefix_dictionary = false },
+  };
+  for (size_t o = 0; o < sizeof(options) / sizeof(options[0]); o++) {
+    struct haskell_store *store = haskell_store_build(&batch, &options[o]);
+    CHECK(store != NULL);
+    if (store == NULL) {
+      continue;
+    }
+    CHECK(haskell_store_count(store) == distinct);
+    for (size_t i = 0; i < distinct; i++) {
+      size_t rank = SIZE_MAX;
+      CHECK(haskell_store_find(store, expected[i], strlen(expected[i]), &rank) && rank == i);
+    }
+    // Before the first, between two, a prefix of one, and after the last
+    const char *missing[] = { "", "A", "Main.x1y", "base_GHC.Base.map", "base_GHC.Base.map0_infp", "zzz" };
+    for (size_t i = 0; i < sizeof(missing) / sizeof(missing[0]); i++) {
+      size_t rank;
+      CHECK(!haskell_store_find(store, missing[i], strlen(missing[i]), &rank));
+    }
+
+    // From the start, and from the middle of a block
+    size_t starts[] = { 0, distinct / 2 + 1, distinct };
+    for (size_t s = 0; s < sizeof(starts) / sizeof(starts[0]); s++) {
+      struct haskell_store_iter it;
+      CHECK(haskell_store_iter_init(&it, store, starts[s]) == 0);
+      size_t i = starts[s];
+      while (haskell_store_iter_next(&it)) {
+        CHECK(i < distinct && it.len == strlen(expected[i]) && strcmp(it.name, expected[i]) == 0);
+        i++;
+      }
+      CHECK(i == distinct);
+      haskell_store_iter_free(&it);
+    }
+    haskell_store_free(store);
+  }
+  for (size_t i = 0; i < distinct; i++) {
+    free(expected[i]);
+  }
+  haskell_batch_free(&batch);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fputs("usage: api-test SCRATCH_DIR\n", stderr);
+    return 2;
+  }
+  test_module_filter();
+  test_binder();
+  test_limits();
+  test_sort();
+  test_dict();
+  test_parallel_batch();
+  test_store();
+  test_columnar(argv[1]);
+  return failures != 0;
+}
@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+# Writes perf.data, a small perf.data file sampling perf-fixture, laid out
+# as in linux/perf_event.h and tools/perf/util/header.h. Run it from the
+# repository's root, after building perf-fixture and main.
+
+import struct
+import subprocess
+
+functions = {}
+for line in subprocess.run(
+    ["./main", "--dwarf", "test-data/perf-fixture"], capture_output=True, text=True, check=True
+).stdout.splitlines():
+    low, _high, name = line.split(" ", 2)
+    functions[name] = int(low, 16)
+
+# perf-fixture's code segment, at file offset 0x1000, mapped in a PIE way
+base = 0x555555554000
+def at(name, offset):
+    return base + functions[name] + offset
+
+MAP, GO, MAIN = "base_GHC.Base_map_info", "Main_$wgo_info", "main"
+
+PERF_RECORD_MMAP, PERF_RECORD_COMM, PERF_RECORD_SAMPLE, PERF_RECORD_MMAP2 = 1, 3, 9, 10
+PERF_RECORD_FINISHED_ROUND = 68
+PERF_CONTEXT_KERNEL = 2**64 - 128
+PERF_CONTEXT_USER = 2**64 - 512
+
+# IDENTIFIER | IP | TID | TIME | CPU | PERIOD | CALLCHAIN
+sample_type = (1 << 16) | (1 << 0) | (1 << 1) | (1 << 2) | (1 << 7) | (1 << 8) | (1 << 5)
+sample_id_all = 1 << 18
+
+def attr():
+    size = 128
+    body = struct.pack("<IIQQQQQ", 0, size, 0, 4000, sample_type, 0, sample_id_all)
+    return body + bytes(size - len(body)) + struct.pack("<QQ", 0, 0)
+
+def record(kind, body, misc=0):
+    # With sample_id_all, every other record ends with the sample's ID
+    # fields: pid and tid, time, cpu, and identifier
+    if kind != PERF_RECORD_SAMPLE and kind != PERF_RECORD_FINISHED_ROUND:
+        body += struct.pack("<IIQIIQ", 100, 100, 1, 0, 0, 7)
+    return struct.pack("<IHH", kind, misc, 8 + len(body)) + body
+
+def name(s):
+    b = s.encode() + b"\0"
+    return b + bytes(-len(b) % 8)
+
+def mmap2(pid, addr, length, pgoff, filename):
+    return record(PERF_RECORD_MMAP2,
+        struct.pack("<IIQQQIIQQII", pid, pid, addr, length, pgoff, 8, 1, 42, 0, 5, 2) + name(filename))
+
+def sample(pid, tid, chain):
+    return record(PERF_RECORD_SAMPLE,
+        struct.pack("<QQIIQIIQQ", 7, chain[-1], pid, tid, 1, 0, 0, 4000, len(chain))
+        + b"".join(struct.pack("<Q", ip) for ip in chain))
+
+data = b"".join([
+    record(PERF_RECORD_COMM, struct.pack("<II", 100, 100) + name("ghc-prog")),
+    # Replaced by the next mapping, which overlaps it
+    mmap2(100, base + 0x1000, 0x1000, 0x1000, "/nonexistent/old"),
+    mmap2(100, base + 0x1000, 0x1000, 0x1000, "test-data/perf-fixture"),
+    record(PERF_RECORD_MMAP,
+        struct.pack("<IIQQQ", 100, 100, 0x7f0000000000, 0x10000, 0) + name("/nonexistent/libfoo.so")),
+    record(PERF_RECORD_FINISHED_ROUND, b""),
+] + [
+    sample(100, 100, [PERF_CONTEXT_USER, at(MAP, 2), at(GO, 5), at(MAIN, 8)]),
+] * 3 + [
+    sample(100, 100, [PERF_CONTEXT_USER, at(GO, 3), at(MAIN, 8)]),
+] * 2 + [
+    sample(100, 100, [PERF_CONTEXT_KERNEL, 0xffffffff81000000, PERF_CONTEXT_USER, at(MAP, 1), at(GO, 5), at(MAIN, 8)]),
+    sample(100, 100, [PERF_CONTEXT_USER, 0x7f0000000100, at(MAIN, 8)]),
+    # A thread with no name, outside of any mapping
+    sample(200, 201, [PERF_CONTEXT_USER, 0x1234]),
+])
+
+attrs = attr() + attr()
+header_size = 104
+attrs_offset = header_size
+data_offset = attrs_offset + len(attrs)
+header = struct.pack("<8sQQQQQQQQ4Q", b"PERFILE2", header_size, len(attr()),
+    attrs_offset, len(attrs), data_offset, len(data), 0, 0, 0, 0, 0, 0)
+
+with open("test-data/perf.data", "wb") as f:
+    f.write(header + attrs + data)
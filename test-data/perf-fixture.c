@@ -0,0 +1,13 @@
+// Built into perf-fixture with: cc -g -O0 -o perf-fixture perf-fixture.c
+// The functions are named like GHC's entry code, so that they demangle.
+
+void base_GHCziBase_map_info(void) {}
+
+void Main_zdwgo_info(void) {
+  base_GHCziBase_map_info();
+}
+
+int main(void) {
+  Main_zdwgo_info();
+  return 0;
+}
@@ -0,0 +1,122 @@
+// Built by test.sh, when there's a C++20 compiler, with:
+//   cc -c demangle-ghc.c demangle-ghc-stream.c
+//   c++ -std=c++20 -O2 -Wall -Werror -I.. -o stream-test stream-test.cpp demangle-ghc.o demangle-ghc-stream.o
+//
+// Demangles stdin on two streams at once, fed in chunks of a few bytes by
+// a pretend event loop, and writes the first's records like ./main does.
+// Fails if the streams disagree, or if anything, such as a coroutine
+// frame, is allocated with new once they're under way.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "demangle-ghc.hpp"
+
+static std::size_t allocations;
+
+void *operator new(std::size_t size) {
+  allocations++;
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+// Not inlined, or GCC sees free() given what operator new returned
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+// Coroutines waiting on a read, in a ring that's never reallocated
+static std::coroutine_handle<> ready[4];
+static std::size_t ready_start;
+static std::size_t ready_len;
+
+struct chunked_input {
+  std::string_view text;
+  std::size_t step;
+
+  struct read_awaiter {
+    chunked_input *in;
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) noexcept {
+      ready[(ready_start + ready_len++) % 4] = h;
+    }
+    std::string_view await_resume() noexcept {
+      std::string_view chunk = in->text.substr(0, in->step);
+      in->text.remove_prefix(chunk.size());
+      // Chunk sizes cycle, so that lines straddle chunks in every way
+      in->step = in->step % 7 + 1;
+      return chunk;
+    }
+  };
+
+  read_awaiter read() { return {this}; }
+};
+
+struct task {
+  struct promise_type {
+    task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+static char output[2][1 << 16];
+static std::size_t output_len[2];
+static std::size_t late_allocations;
+
+static void put(int which, std::string_view s) {
+  if (output_len[which] + s.size() + 1 > sizeof(output[which])) {
+    std::exit(1);
+  }
+  s.copy(output[which] + output_len[which], s.size());
+  output_len[which] += s.size();
+  output[which][output_len[which]++] = '\n';
+}
+
+static task demangle(int which, chunked_input &in, haskell::frame_arena &arena) {
+  auto records = haskell::demangle_records(std::allocator_arg, arena, [&] { return in.read(); });
+  std::size_t count = 0;
+  std::size_t before = 0;
+  while (const haskell::record *r = co_await records.next()) {
+    // By now, the stream's buffers have grown to fit
+    if (++count == 4) {
+      before = allocations;
+    }
+    put(which, r->valid ? r->demangled : r->mangled);
+  }
+  late_allocations += count >= 4 ? allocations - before : 0;
+}
+
+int main() {
+  std::string text;
+  char buf[4096];
+  for (std::size_t n; (n = std::fread(buf, 1, sizeof(buf), stdin)) > 0;) {
+    text.append(buf, n);
+  }
+  alignas(std::max_align_t) static char frames[16384];
+  haskell::frame_arena arena(frames, sizeof(frames));
+  chunked_input a { text, 1 };
+  chunked_input b { text, 4 };
+  demangle(0, a, arena);
+  demangle(1, b, arena);
+  while (ready_len > 0) {
+    std::coroutine_handle<> h = ready[ready_start];
+    ready_start = (ready_start + 1) % 4;
+    ready_len--;
+    h.resume();
+  }
+  std::fwrite(output[0], 1, output_len[0], stdout);
+  if (output_len[0] != output_len[1] || std::string_view(output[0], output_len[0]) != std::string_view(output[1], output_len[1])) {
+    std::fputs("the streams disagree\n", stderr);
+    return 1;
+  }
+  if (late_allocations != 0) {
+    std::fprintf(stderr, "%zu allocations while streaming\n", late_allocations);
+    return 1;
+  }
+  return 0;
+}
@@ -1,5 +1,7 @@
 #!/usr/bin/env bash
 
+set -e
+
 input="abcdefghijklmnopqrstuvwxyzz
 ABCDEFGHIJKLMNOPQRSTUVWXYZZ
 z03bbU z03a0U
@@ -21,3 +23,207 @@ ABCDEFGHIJKLMNOPQRSTUVWXYZ
 (#,,,,,,,,#)"
 
 diff <(echo "$input" | ./main) <(echo "$expected")
+
+# Every name repeats, so the second half is all IDs
+diff <(printf '%s\n%s\n' "$input" "$input" | ./main --dict | ./main --dict-decode) \
+  <(printf '%s\n%s\n' "$expected" "$expected")
+
+# Arity would wrap around to 2, and then to a huge tuple
+diff <(echo Z4294967298T | ./main) <(echo "Demangler error!")
+diff <(echo Z4000000000T | ./main) <(echo "Demangler error!")
+diff <(echo Z3Tzx | ./main) <(echo "Demangler error!")
+
+# Function names and source lines from DWARF, in both the version 4 and
+# version 5 layouts
+dwarf_dir=$(mktemp -d)
+trap 'rm -rf "$dwarf_dir"' EXIT
+printf '%s\n' 'void Main_zdwmain_info(void) {}' 'int main(void) { Main_zdwmain_info(); return 0; }' \
+  > "$dwarf_dir/dwarf.c"
+for version in 4 5; do
+  (cd "$dwarf_dir" && cc -gdwarf-$version -o dwarf dwarf.c)
+  diff <(./main --dwarf "$dwarf_dir/dwarf" | cut -d' ' -f3) <(printf '%s\n' 'Main_$wmain_info' main)
+  diff <(./main --dwarf "$dwarf_dir/dwarf" | cut -d' ' -f1 | ./main --symbolize "$dwarf_dir/dwarf") \
+    <(printf '%s\n' 'Main_$wmain_info (dwarf.c:1)' 'main (dwarf.c:2)')
+done
+
+# Without debug info, from the symbol table
+(cd "$dwarf_dir" && cc -o nodebug dwarf.c)
+diff <(./main --dwarf "$dwarf_dir/nodebug" | cut -d' ' -f3 | grep -x -e 'Main_$wmain_info' -e main) \
+  <(printf '%s\n' 'Main_$wmain_info' main)
+diff <(./main --dwarf "$dwarf_dir/nodebug" | awk '$3 == "Main_$wmain_info" || $3 == "main" { print $1 }' \
+  | ./main --symbolize "$dwarf_dir/nodebug") <(printf '%s\n' 'Main_$wmain_info' main)
+
+# The same, in a running process, whose executable is mapped wherever it
+# was loaded
+printf '%s\n' '#include <unistd.h>' 'void Main_zdwmain_info(void) { pause(); }' \
+  'int main(void) { Main_zdwmain_info(); return 0; }' > "$dwarf_dir/sleeper.c"
+(cd "$dwarf_dir" && cc -g -o sleeper sleeper.c)
+"$dwarf_dir/sleeper" &
+sleeper=$!
+trap 'kill $sleeper; wait $sleeper 2>/dev/null || true; rm -rf "$dwarf_dir"' EXIT
+base=
+for try in $(seq 100); do
+  kill -0 $sleeper
+  base=$(awk '$6 ~ /sleeper$/ && $3 == "00000000" { print $1; exit }' /proc/$sleeper/maps | cut -d- -f1)
+  [ -z "$base" ] || break
+  sleep 0.05
+done
+[ -n "$base" ]
+low=$(./main --dwarf "$dwarf_dir/sleeper" | awk '$3 == "Main_$wmain_info" { print $1 }')
+diff <(printf '%x\n' $((0x$base + 0x$low)) | ./main --pid $sleeper) \
+  <(echo 'Main_$wmain_info (sleeper.c:2)')
+
+# Folded stacks from perf.data. test-data/make-perf-data.py describes the
+# samples in it.
+diff <(./main --perf test-data/perf.data) <(printf '%s\n' \
+  '[unknown];[unknown] 1' \
+  'ghc-prog;main;Main_$wgo_info 2' \
+  'ghc-prog;main;Main_$wgo_info;base_GHC.Base_map_info 3' \
+  'ghc-prog;main;Main_$wgo_info;base_GHC.Base_map_info;[unknown] 1' \
+  'ghc-prog;main;[unknown] 1')
+
+# Module path completion, counting the distinct names under each
+printf '%s\n' base_GHCziBase_map_info base_GHCziBase_map_closure base_GHCziList_filter_info \
+  base_GHCziBase_map_info Main_main_info | ./main --trie "$dwarf_dir/names.trie"
+diff <(printf '%s\n' base_GHC. base_GHC.Base_map_ M | ./main --complete "$dwarf_dir/names.trie") \
+  <(printf '%s\n' 'base_GHC.Base_ 2' 'base_GHC.List_ 1' 'base_GHC.Base_map_closure 1' \
+    'base_GHC.Base_map_info 1' 'Main_ 1')
+
+# Symbol table diff, with the unit ID hash and the local binder's unique
+# normalized away
+printf '%s\n' 'char textzm2zi0zmAbC12_DataziText_pack_info[8] = { 1 };' \
+  'char QuickCheckzm2zi14zi3zmAbC_TestziQuickCheckziGen_choose_info[8] = { 1 };' \
+  'char Main_zdwgo_r1Ab_info[16] = { 1 };' 'char Main_gone_closure[4] = { 1 };' > "$dwarf_dir/old.c"
+printf '%s\n' 'char textzm2zi0zmXyW99_DataziText_pack_info[8] = { 1 };' \
+  'char QuickCheckzm2zi14zi3zmXyW_TestziQuickCheckziGen_choose_info[16] = { 1 };' \
+  'char Main_zdwgo_r9Yq_info[32] = { 1 };' 'char Main_new_closure[4] = { 1 };' > "$dwarf_dir/new.c"
+(cd "$dwarf_dir" && cc -c old.c new.c)
+diff <(./main --diff "$dwarf_dir/old.o" "$dwarf_dir/new.o") \
+  <(printf '%s\n' Main '  ~ $wgo_info 16 -> 32' '  - gone_closure 4' '  + new_closure 4' \
+    QuickCheck-2.14.3_Test.QuickCheck.Gen '  ~ choose_info 8 -> 16')
+
+# Distinct and most frequent lines, counted before demangling
+diff <(printf '%s\n' zd Z3T zd x zd Z3T | ./main --unique) <(printf '%s\n' '$' '(,,)' x)
+diff <(printf '%s\n' zd Z3T zd x zd Z3T | ./main --top 2) <(printf '%s\n' '      3 $' '      2 (,,)')
+# Counts that aren't positive, or are too large to track, are refused
+for k in 0 -1 abc 2x '' 18446744073709551616 18446744073709551615; do
+  status=0
+  ./main --top "$k" < /dev/null 2> /dev/null || status=$?
+  [ $status != 0 ]
+done
+
+# Symbols demangled in place, in a file and in a pipe, and everything else
+# left as it is
+printf '%s\n' '0x4012a0 base_GHCziBase_map_info+0x12 (/usr/bin/prog)' 'size_t Main_main_info zdx' \
+  'ghczmprim_GHCziTuple_Z3T_con_info,ZCMain_main_closure' > "$dwarf_dir/filter.txt"
+filtered=$(printf '%s\n' '0x4012a0 base_GHC.Base_map_info+0x12 (/usr/bin/prog)' 'size_t Main_main_info zdx' \
+  'ghc-prim_GHC.Tuple_(,,)_con_info,:Main_main_closure')
+[ "$(./main --filter < "$dwarf_dir/filter.txt")" = "$filtered" ]
+[ "$(cat "$dwarf_dir/filter.txt" | ./main --filter)" = "$filtered" ]
+
+# Output written in place, from a file and from a pipe, with lines that
+# don't demangle left as they are
+printf '%s\n' zd Z3T Z3 base_GHCziBase_map_info > "$dwarf_dir/names.txt"
+./main -o "$dwarf_dir/names.out" < "$dwarf_dir/names.txt"
+diff "$dwarf_dir/names.out" <(printf '%s\n' '$' '(,,)' Z3 base_GHC.Base_map_info)
+cat "$dwarf_dir/names.txt" | ./main -o "$dwarf_dir/names.piped"
+cmp "$dwarf_dir/names.out" "$dwarf_dir/names.piped"
+# Ending in a code point, at the end of a page
+{ head -c 4092 /dev/zero | tr '\0' a; printf '\nz41Uz3bbU'; } > "$dwarf_dir/page.txt"
+./main -o "$dwarf_dir/page.out" < "$dwarf_dir/page.txt"
+cmp "$dwarf_dir/page.out" <(./main < "$dwarf_dir/page.txt")
+# Not over the input, which is left as it was, and not with another mode
+cp "$dwarf_dir/names.txt" "$dwarf_dir/names.copy"
+status=0
+./main -o "$dwarf_dir/names.txt" < "$dwarf_dir/names.txt" 2> /dev/null || status=$?
+[ $status = 1 ]
+cmp "$dwarf_dir/names.txt" "$dwarf_dir/names.copy"
+for mode in --filter --unique --dict; do
+  status=0
+  ./main $mode -o "$dwarf_dir/names.mode" < "$dwarf_dir/names.txt" 2> /dev/null || status=$?
+  [ $status = 2 ]
+done
+
+# Ticky-ticky profiles summed per binder and per module, across z-encoded
+# and plain names, with units and uniques dropped
+printf '%s\n' "    Entries      Alloc    Alloc'd  Non-void Arguments      STG Name" '-----' \
+  '         10        480          0   1 L                    Main_zdwgo_r1Ab_info' \
+  '          3         64          0   0                      base_GHCziBase_map_info' > "$dwarf_dir/a.ticky"
+printf '%s\n' "    Entries      Alloc    Alloc'd  Non-void Arguments      STG Name" '-----' \
+  '          5        100         16   2 PL                   main:Main.$wgo{v r2Cd} (fun)' \
+  '          2         40          0   1 L                    QuickCheckzm2zi14zi3zmAbC_TestziQuickCheckziGen_choose_info' \
+  '          1          8          0   1 L                    QuickCheck-2.14.3-AbC:Test.QuickCheck.Gen.choose (fun)' \
+  '          1          4          0   0                      Main_z41Uz3bbU_info' \
+  > "$dwarf_dir/b.ticky"
+diff <(./main --ticky "$dwarf_dir/a.ticky" "$dwarf_dir/b.ticky") <(printf '%s\n' \
+  "     Entries          Alloc        Alloc'd  Binder" \
+  '          15            580             16  Main.$wgo' \
+  '           3             64              0  GHC.Base.map' \
+  '           3             48              0  Test.QuickCheck.Gen.choose' \
+  '           1              4              0  Main.Aλ')
+diff <(./main --by-module --ticky "$dwarf_dir/a.ticky" "$dwarf_dir/b.ticky" | tail -n +2) <(printf '%s\n' \
+  '          16            584             16  Main' \
+  '           3             64              0  GHC.Base' \
+  '           3             48              0  Test.QuickCheck.Gen')
+
+# Library functions that main doesn't use
+cc -I. -pthread -o "$dwarf_dir/api-test" test-data/api-test.c $(ls demangle-ghc*.c | grep -v main)
+"$dwarf_dir/api-test" "$dwarf_dir"
+
+# Streams fed a few bytes at a time, through the C++ coroutine adapter
+if command -v c++ > /dev/null && echo 'int main() {}' | c++ -std=c++20 -x c++ -o /dev/null - 2> /dev/null; then
+  cc -c -o "$dwarf_dir/demangle-ghc.o" demangle-ghc.c
+  cc -c -o "$dwarf_dir/demangle-ghc-stream.o" demangle-ghc-stream.c
+  c++ -std=c++20 -O2 -Wall -Werror -I. -o "$dwarf_dir/stream-test" test-data/stream-test.cpp \
+    "$dwarf_dir/demangle-ghc.o" "$dwarf_dir/demangle-ghc-stream.o"
+  printf '%s\nZ3Tzx\nbase_GHCziBase_map_info' "$input" | "$dwarf_dir/stream-test" > "$dwarf_dir/streamed"
+  diff "$dwarf_dir/streamed" <(printf '%s\n' "$expected" Z3Tzx base_GHC.Base_map_info)
+fi
+
+# The Python extension, where there are headers to build it against
+if command -v python3-config > /dev/null && python3-config --includes > /dev/null 2>&1; then
+  cc -O2 -shared -fPIC -pthread $(python3-config --includes) \
+    -o "$dwarf_dir/demangle_ghc$(python3-config --extension-suffix)" python/demangle_ghc.c \
+    demangle-ghc.c demangle-ghc-parallel.c demangle-ghc-intern.c demangle-ghc-columnar.c
+  printf '%s\n' zd Z3T Z3 > "$dwarf_dir/names.lines"
+  PYTHONPATH="$dwarf_dir" python3 - "$dwarf_dir" <<'PY'
+import mmap, sys
+import demangle_ghc
+d = sys.argv[1]
+batch = demangle_ghc.demangle_batch(["zd", b"Z3T", "Z3", "zd"], threads=2)
+assert batch.tolist() == ["$", "(,,)", None, "$"], batch.tolist()
+assert bytes(batch.data) == b"$(,,)$" and batch.offsets.tolist() == [0, 1, 5, 5, 6]
+assert demangle_ghc.demangle_batch(["zd", "Z3T", "zd"], dedup=True).indices.tolist() == [0, 1, 0]
+with open(d + "/names.lines", "rb") as f, mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as m:
+    assert demangle_ghc.demangle_batch(m).tolist() == ["$", "(,,)", None]
+batch.save(d + "/names.col")
+data = demangle_ghc.open_columnar(d + "/names.col").data
+assert bytes(data) == b"$(,,)$"
+PY
+fi
+
+# Compressed input, in builds that can read it
+gz_out=$(printf '%s\n' zd Z3T | gzip | ./main 2>&1 || true)
+[ "$gz_out" = "$(printf '%s\n' '$' '(,,)')" ] || [ "$gz_out" = "this build can't read compressed input" ]
+
+# zstd, where libzstd is installed: frames that give their size, which are
+# decompressed in parallel, and frames that don't, as zstd writes to a
+# pipe, which are streamed, both mapped from a file and through a pipe
+if command -v zstd > /dev/null && printf '%s\n' '#include <zstd.h>' \
+  'int main(void) { return ZSTD_versionNumber() == 0; }' | cc -x c -o /dev/null - -lzstd 2> /dev/null; then
+  cc -O2 -pthread -DHAVE_ZSTD -o "$dwarf_dir/main-zstd" demangle-ghc*.c -lzstd
+  seq 1000 | sed 's/.*/base_GHCziBase_map&_info/' > "$dwarf_dir/many.txt"
+  ./main < "$dwarf_dir/many.txt" > "$dwarf_dir/many.out"
+  split -l 100 "$dwarf_dir/many.txt" "$dwarf_dir/part."
+  zstd -q -c "$dwarf_dir/many.txt" > "$dwarf_dir/one.zst"
+  for part in "$dwarf_dir"/part.*; do zstd -q -c "$part"; done > "$dwarf_dir/sized.zst"
+  for part in "$dwarf_dir"/part.*; do zstd -q < "$part"; done > "$dwarf_dir/unsized.zst"
+  cat "$dwarf_dir/sized.zst" "$dwarf_dir/unsized.zst" > "$dwarf_dir/mixed.zst"
+  cat "$dwarf_dir/many.out" "$dwarf_dir/many.out" > "$dwarf_dir/mixed.out"
+  for zst in one sized unsized mixed; do
+    expected="$dwarf_dir/many.out"
+    [ $zst != mixed ] || expected="$dwarf_dir/mixed.out"
+    "$dwarf_dir/main-zstd" < "$dwarf_dir/$zst.zst" | cmp - "$expected"
+    cat "$dwarf_dir/$zst.zst" | "$dwarf_dir/main-zstd" | cmp - "$expected"
+  done
+fi